@@ -1,8 +1,12 @@
 #include <deal.II/base/function.h>
 #include <deal.II/base/logstream.h>
+#include <deal.II/base/multithread_info.h>
 #include <deal.II/base/quadrature_lib.h>
 #include <deal.II/base/tensor_function.h>
+#include <deal.II/base/work_stream.h>
 #include <deal.II/lac/full_matrix.h>
+#include <deal.II/lac/solver_control.h>
+#include <deal.II/lac/solver_gmres.h>
 #include <deal.II/lac/sparse_direct.h>
 #include <deal.II/lac/sparse_matrix.h>
 #include <deal.II/lac/vector.h>
@@ -14,6 +18,7 @@
 #include <deal.II/dofs/dof_handler.h>
 #include <deal.II/dofs/dof_tools.h>
 #include <deal.II/grid/grid_generator.h>
+#include <deal.II/grid/grid_refinement.h>
 #include <deal.II/grid/grid_tools.h>
 #include <deal.II/grid/tria.h>
 #include <deal.II/grid/tria_accessor.h>
@@ -23,23 +28,32 @@
 #include <deal.II/fe/fe_system.h>
 #include <deal.II/fe/fe_values.h>
 // Standard C++ libraries
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
+
+#include "dofIndices.h"
+#include "lanczos.h"
+#include "orderedSum.h"
+#include "pMultigrid.h"
 
 using namespace dealii;
 
-template <int dim> class FEM {
+template <int dim, typename IndexType = unsigned int> class FEM {
 public:
   // Class functions
-  FEM(unsigned int order, unsigned int problem); // Class constructor
+  FEM(unsigned int order, unsigned int problem,
+      bool spectral = false); // Class constructor
   ~FEM();                                        // Class destructor
 
   // Function to find the value of xi at the given node (using deal.II node
   // numbering)
   double xi_at_node(unsigned int dealNode);
+  std::vector<double> node_xi; // xi of each element node, filled in constructor
 
   // Define your 1D basis functions and derivatives
   double basis_function(unsigned int node, double xi);
@@ -51,11 +65,39 @@ public:
   void setup_system();
   void assemble_system();
   void solve();
+  // Iterative alternative to solve() for high order. Throws if GMRES does not
+  // converge within max_iterations, unless allow_early_stop (nested
+  // iteration), which keeps the last iterate
+  void solve_pmultigrid(unsigned int max_iterations = 1000,
+                        bool allow_early_stop = false);
+
+  // Initial guesses for the iterative solve - call these after setup_system()
+  void warm_start(const Vector<double> &initial_guess);
+  void warm_start_from_coarse(FEM<dim, IndexType> &coarse);
   void output_results();
 
   // Function to calculate the l2 norm of the error in the finite element sol'n
   // vs. the exact solution
   double l2norm_of_error();
+  double exact_solution(double x);
+
+  /*Goal-oriented (dual weighted residual) error estimation for a quantity of
+    interest J(u): the average of u over [sensor_start, sensor_end], or the
+    value of u at sensor_start if the two are equal (e.g. the tip displacement
+    for sensor_start = sensor_end = L).*/
+  double quantity_of_interest();       // J(u_h)
+  double quantity_of_interest_exact(); // J(u) of the exact solution
+  double estimate_qoi_error(); // Estimate of J(u)-J(u_h), call after solving
+  void refine_for_qoi(double refine_fraction = 0.3); // Refine where the
+                                                     // estimate is largest
+  void sensor_quadrature(double x_0, double x_1, std::vector<double> &xi,
+                         std::vector<double> &weights);
+
+  /*Vibration modes of the bar: the lowest eigenpairs of K x = lambda M x (for
+    unit E and density, lambda is the squared angular frequency), by
+    shift-invert Lanczos. Call after assemble_system().*/
+  void assemble_mass_matrix();
+  void compute_modes(unsigned int n_modes, double shift = 0.);
 
   // Class objects
   Triangulation<dim> triangulation; // mesh
@@ -67,6 +109,15 @@ public:
   std::vector<double> quad_points; // vector of Gauss quadrature points
   std::vector<double> quad_weight; // vector of the quadrature point weights
 
+  /*Spectral element option: Gauss-Lobatto-Legendre (GLL) nodes with the
+    collocated GLL quadrature. The basis functions evaluated at the quadrature
+    points are then the identity and the mass matrix is diagonal.*/
+  bool spectralElement;
+
+  // Basis functions and xi-derivatives tabulated at the quadrature points,
+  // indexed [q][A] - These are filled in setup_system()
+  std::vector<std::vector<double>> basis_at_quad, gradient_at_quad;
+
   // Data structures
   SparsityPattern sparsity_pattern; // Sparse matrix pattern
   SparseMatrix<double> K;           // Global stiffness (sparse) matrix
@@ -74,9 +125,26 @@ public:
       F; // Global vectors - Solution vector (D) and Global force vector (F)
   std::vector<double>
       nodeLocation; // Vector of the x-coordinate of nodes by global dof number
-  std::map<unsigned int, double>
+  Vector<double> M_diag; // Diagonal mass matrix (spectral elements only)
+  SparseMatrix<double> M; // Consistent mass matrix (for compute_modes)
+  std::map<IndexType, double>
       boundary_values; // Map of dirichlet boundary conditions
   double basisFunctionOrder, prob, L, g1, g2, E, f, h;
+  unsigned int solver_iterations; // Iterations used by the last iterative solve
+
+  // Quantity of interest, adjoint solution and the element error indicators
+  double sensor_start, sensor_end;
+  Vector<double> Z;
+  Vector<double> qoi_error_indicators;
+
+  /*LU factorization of K, kept from solve() so that the adjoint problem costs
+    only a (transposed) forward/back substitution*/
+  SparseDirectUMFPACK K_factorization;
+  bool K_factorized;
+
+  // Eigenvalues and M-orthonormal mode shapes from compute_modes
+  std::vector<double> eigenvalues;
+  std::vector<Vector<double>> modes;
 
   // solution name array
   std::vector<std::string> nodal_solution_names;
@@ -85,10 +153,16 @@ public:
 };
 
 // Class constructor for a vector field
-template <int dim>
-FEM<dim>::FEM(unsigned int order, unsigned int problem)
-    : fe(FE_Q<dim>(order), dim), dof_handler(triangulation) {
+template <int dim, typename IndexType>
+FEM<dim, IndexType>::FEM(unsigned int order, unsigned int problem, bool spectral)
+    : fe(spectral ? FE_Q<dim>(QGaussLobatto<1>(order + 1)) : FE_Q<dim>(order),
+         dim),
+      dof_handler(triangulation) {
   basisFunctionOrder = order;
+  spectralElement = spectral;
+  solver_iterations = 0;
+  sensor_start = sensor_end = 0.;
+  K_factorized = false;
   if (problem == 1 || problem == 2) {
     prob = problem;
   } else {
@@ -96,6 +170,32 @@ FEM<dim>::FEM(unsigned int order, unsigned int problem)
     exit(0);
   }
 
+  /*Define constants for problem (Dirichlet boundary values). They are set
+    here rather than in setup_system() so a run's inputs are all known (and
+    can be changed) before the mesh is built, e.g. for the result cache.*/
+  g1 = 0;
+  g2 = 0.001;
+  E = 1e11;
+  f = 1e11;
+  h = 1e10;
+
+  /*Element nodes in deal.II numbering: the two end nodes first, then the
+    interior nodes from left to right. They are equispaced by default and at
+    the GLL points for spectral elements (QGaussLobatto is defined on [0,1]).*/
+  node_xi.resize(order + 1);
+  node_xi[0] = -1.;
+  node_xi[1] = 1.;
+  if (spectral) {
+    QGaussLobatto<1> gll(order + 1);
+    for (unsigned int i = 2; i <= order; i++) {
+      node_xi[i] = 2. * gll.point(i - 1)[0] - 1.;
+    }
+  } else {
+    for (unsigned int i = 2; i <= order; i++) {
+      node_xi[i] = -1. + 2. * (i - 1.) / order;
+    }
+  }
+
   // Nodal Solution names - this is for writing the output file
   for (unsigned int i = 0; i < dim; ++i) {
     nodal_solution_names.push_back("u");
@@ -105,18 +205,16 @@ FEM<dim>::FEM(unsigned int order, unsigned int problem)
 }
 
 // Class destructor
-template <int dim> FEM<dim>::~FEM() { dof_handler.clear(); }
+template <int dim, typename IndexType>
+FEM<dim, IndexType>::~FEM() { dof_handler.clear(); }
 
 // Find the value of xi at the given node (using deal.II node numbering)
-template <int dim> double FEM<dim>::xi_at_node(unsigned int dealNode) {
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::xi_at_node(unsigned int dealNode) {
   double xi;
 
-  if (dealNode == 0) {
-    xi = -1.;
-  } else if (dealNode == 1) {
-    xi = 1.;
-  } else if (dealNode <= basisFunctionOrder) {
-    xi = -1. + 2. * (dealNode - 1.) / basisFunctionOrder;
+  if (dealNode <= basisFunctionOrder) {
+    xi = node_xi[dealNode];
   } else {
     std::cout << "Error: you input node number " << dealNode
               << " but there are only " << basisFunctionOrder + 1
@@ -128,8 +226,8 @@ template <int dim> double FEM<dim>::xi_at_node(unsigned int dealNode) {
 }
 
 // Define basis functions
-template <int dim>
-double FEM<dim>::basis_function(unsigned int node, double xi) {
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::basis_function(unsigned int node, double xi) {
   /*"basisFunctionOrder" defines the polynomial order of the basis function,
     "node" specifies which node the basis function corresponds to,
     "xi" is the point (in the bi-unit, or local, domain) where the function is
@@ -152,8 +250,8 @@ double FEM<dim>::basis_function(unsigned int node, double xi) {
 }
 
 // Define basis function gradient
-template <int dim>
-double FEM<dim>::basis_gradient(unsigned int node, double xi) {
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::basis_gradient(unsigned int node, double xi) {
   /*"basisFunctionOrder" defines the polynomial order of the basis function,
     "node" specifies which node the basis function corresponds to,
     "xi" is the point (in the bi-unit domain) where the function is being
@@ -240,11 +338,27 @@ double FEM<dim>::basis_gradient(unsigned int node, double xi) {
       value = (xi-xi2)*(xi-xi3)/denum + (xi-xi1)*(xi-xi3)/denum+(xi-xi1)*(xi-xi2)/denum;
   }
 
+  // Higher orders (e.g. spectral elements): product rule on the Lagrange basis
+  if (basisFunctionOrder > 3)
+  {
+      for (unsigned int m = 0; m <= basisFunctionOrder; ++m) {
+        if (m == node) continue;
+        double term = 1. / (xi_at_node(node) - xi_at_node(m));
+        for (unsigned int i = 0; i <= basisFunctionOrder; ++i) {
+          if (i != node && i != m) {
+            term *= (xi - xi_at_node(i)) / (xi_at_node(node) - xi_at_node(i));
+          }
+        }
+        value += term;
+      }
+  }
+
   return value;
 }
 
 // Define the problem domain and generate the mesh
-template <int dim> void FEM<dim>::generate_mesh(unsigned int numberOfElements) {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::generate_mesh(unsigned int numberOfElements) {
 
   // Define the limits of your domain
   L = 0.1;
@@ -258,8 +372,9 @@ template <int dim> void FEM<dim>::generate_mesh(unsigned int numberOfElements) {
 }
 
 // Specify the Dirichlet boundary conditions
-template <int dim> void FEM<dim>::define_boundary_conds() {
-  const unsigned int totalNodes = dof_handler.n_dofs(); // Total number of nodes
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::define_boundary_conds() {
+  const IndexType totalNodes = dof_handler.n_dofs(); // Total number of nodes
 
   // Identify dirichlet boundary nodes and specify their values.
   // This function is called from within "setup_system"
@@ -273,7 +388,7 @@ template <int dim> void FEM<dim>::define_boundary_conds() {
     Deal.II will use this information later to apply Dirichlet boundary
     conditions. Neumann boundary conditions are applied when constructing Flocal
     in "assembly"*/
-  for (unsigned int globalNode = 0; globalNode < totalNodes; globalNode++) {
+  for (IndexType globalNode = 0; globalNode < totalNodes; globalNode++) {
     if (nodeLocation[globalNode] == 0) {
       boundary_values[globalNode] = g1;
     }
@@ -286,17 +401,12 @@ template <int dim> void FEM<dim>::define_boundary_conds() {
 }
 
 // Setup data structures (sparse matrix, vectors)
-template <int dim> void FEM<dim>::setup_system() {
-
-  // Define constants for problem (Dirichlet boundary values)
-  g1 = 0;
-  g2 = 0.001;
-  E = 1e11;
-  f = 1e11;
-  h = 1e10;
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::setup_system() {
 
   // Let deal.II organize degrees of freedom
   dof_handler.distribute_dofs(fe);
+  check_index_range<IndexType>(dof_handler.n_dofs());
 
   // Enter the global node x-coordinates into the vector "nodeLocation"
   MappingQ1<dim, dim> mapping;
@@ -304,7 +414,7 @@ template <int dim> void FEM<dim>::setup_system() {
   nodeLocation.resize(dof_handler.n_dofs());
   DoFTools::map_dofs_to_support_points<dim, dim>(mapping, dof_handler,
                                                  dof_coords);
-  for (unsigned int i = 0; i < dof_coords.size(); i++) {
+  for (IndexType i = 0; i < dof_coords.size(); i++) {
     nodeLocation[i] = dof_coords[i][0];
   }
 
@@ -319,6 +429,9 @@ template <int dim> void FEM<dim>::setup_system() {
   K.reinit(sparsity_pattern);
   F.reinit(dof_handler.n_dofs());
   D.reinit(dof_handler.n_dofs());
+  if (spectralElement) {
+    M_diag.reinit(dof_handler.n_dofs());
+  }
 
   // Define quadrature rule
   /*A quad rule of 2 is included here as an example. You will need to decide
@@ -327,13 +440,43 @@ template <int dim> void FEM<dim>::setup_system() {
   // Number of quadrature points along one dimension
   // quadRule needs to find by empirical method
 
-  quadRule = 3;
-  quad_points.resize(quadRule);
-  quad_weight.resize(quadRule);
+  if (spectralElement) {
+    // Collocated GLL rule: one quadrature point per element node
+    QGaussLobatto<1> gll(basisFunctionOrder + 1);
+    quadRule = gll.size();
+    quad_points.resize(quadRule);
+    quad_weight.resize(quadRule);
+    for (unsigned int q = 0; q < quadRule; q++) {
+      quad_points[q] = 2. * gll.point(q)[0] - 1.;
+      quad_weight[q] = 2. * gll.weight(q);
+    }
+  } else {
+    quadRule = 3;
+    quad_points.resize(quadRule);
+    quad_weight.resize(quadRule);
 
-  quad_points = {-0.7745966692414834, 0.0, 0.7745966692414834};
+    quad_points = {-0.7745966692414834, 0.0, 0.7745966692414834};
 
-  quad_weight = {0.5555555555555557, 0.8888888888888888, 0.5555555555555557};
+    quad_weight = {0.5555555555555557, 0.8888888888888888, 0.5555555555555557};
+  }
+
+  /*Tabulate the basis functions and their derivatives at the quadrature
+    points once, instead of re-evaluating them inside the element loops. For
+    spectral elements basis_at_quad is the identity (up to the node ordering)
+    and gradient_at_quad is the GLL differentiation matrix.*/
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  basis_at_quad.assign(quadRule, std::vector<double>(dofs_per_elem));
+  gradient_at_quad.assign(quadRule, std::vector<double>(dofs_per_elem));
+  for (unsigned int q = 0; q < quadRule; q++) {
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      basis_at_quad[q][A] = basis_function(A, quad_points[q]);
+      gradient_at_quad[q][A] = basis_gradient(A, quad_points[q]);
+      if (spectralElement) {
+        basis_at_quad[q][A] =
+            (std::abs(quad_points[q] - xi_at_node(A)) < 1.e-12) ? 1. : 0.;
+      }
+    }
+  }
 
   // Just some notes...
   std::cout << "   Number of active elems:       "
@@ -345,27 +488,48 @@ template <int dim> void FEM<dim>::setup_system() {
 // Form elmental vectors and matrices and assemble to the global vector (F) and
 // matrix (K)
 
-template <int dim>
-void FEM<dim>::assemble_system(){
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_system(){
 
   K=0; F=0;
+  if (spectralElement) M_diag = 0;
+  K_factorized = false;
 
   const unsigned int dofs_per_elem = fe.dofs_per_cell; //This gives you number of degrees of freedom per element
-  FullMatrix<double> Klocal (dofs_per_elem, dofs_per_elem);
-  Vector<double> Flocal (dofs_per_elem);
-  std::vector<unsigned int> local_dof_indices (dofs_per_elem);
-  double h_e, x, f;
 
+  /*The elements are processed in parallel with WorkStream: the worker computes
+    Klocal and Flocal, the copier adds them to K and F. The copier runs on one
+    thread at a time and in the order of the elements, with the same additions
+    as a serial loop, so K, F (and D) are bitwise the same for any number of
+    threads (see orderedSum.h).*/
+  struct CopyData {
+    std::vector<IndexType> local_dof_indices;
+    FullMatrix<double> Klocal;
+    Vector<double> Flocal;
+    FullMatrix<double> Mterms; //[A][q]: mass terms of the GLL rule (spectral only)
+  };
+  CopyData sample_copy;
+  sample_copy.local_dof_indices.resize(dofs_per_elem);
+  sample_copy.Klocal.reinit(dofs_per_elem, dofs_per_elem);
+  sample_copy.Flocal.reinit(dofs_per_elem);
+  sample_copy.Mterms.reinit(dofs_per_elem, quadRule);
+  struct ScratchData {};
 
   //loop over elements  
-  typename DoFHandler<dim>::active_cell_iterator elem = dof_handler.begin_active(), 
-    endc = dof_handler.end();
-  for (;elem!=endc; ++elem){
+  WorkStream::run(
+    dof_handler.begin_active(), dof_handler.end(),
+    [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+        ScratchData &, CopyData &copy){
+
+    std::vector<IndexType> &local_dof_indices = copy.local_dof_indices;
+    FullMatrix<double> &Klocal = copy.Klocal;
+    Vector<double> &Flocal = copy.Flocal;
+    double h_e, x, f;
 
     /*Retrieve the effective "connectivity matrix" for this element
       "local_dof_indices" relates local dofs to global dofs,
       i.e. local_dof_indices[i] gives the global dof number for local dof i.*/
-    elem->get_dof_indices (local_dof_indices);
+    get_dof_indices(elem, local_dof_indices);
 
     /*We find the element length by subtracting the x-coordinates of the two end nodes
       of the element. Remember that the vector "nodeLocation" holds the x-coordinates, indexed
@@ -383,11 +547,11 @@ void FEM<dim>::assemble_system(){
             //Interpolate the x-coordinates at the nodes to find the x-coordinate at the quad pt.
             for(unsigned int B=0; B<dofs_per_elem; B++)
             {
-                x += nodeLocation[local_dof_indices[B]]*basis_function(B,quad_points[q]);
+                x += nodeLocation[local_dof_indices[B]]*basis_at_quad[q][B];
             }
             
             f=1.*x;
-            Flocal[A] += h_e/2.* basis_function(A,quad_points[q]) * quad_weight[q]  *f;// f
+            Flocal[A] += h_e/2.* basis_at_quad[q][A] * quad_weight[q]  *f;// f
         }
     }
     //Add nonzero Neumann condition, if applicable
@@ -408,46 +572,168 @@ void FEM<dim>::assemble_system(){
         {
             for(unsigned int q=0; q<quadRule; q++)
             {
-                Klocal[A][B] += 2. / h_e *  basis_gradient(A,quad_points[q]) * basis_gradient(B,quad_points[q]) * quad_weight[q];
+                Klocal[A][B] += 2. / h_e *  gradient_at_quad[q][A] * gradient_at_quad[q][B] * quad_weight[q];
             }
         }
     }
 
+    //With the collocated GLL rule the element mass matrix is diagonal
+    if (spectralElement)
+    {
+        for(unsigned int A=0; A<dofs_per_elem; A++)
+        {
+            for(unsigned int q=0; q<quadRule; q++)
+            {
+                copy.Mterms[A][q] = h_e/2. * basis_at_quad[q][A] * quad_weight[q];
+            }
+        }
+    }
+    },
+    [&](const CopyData &copy){
+
+    const std::vector<IndexType> &local_dof_indices = copy.local_dof_indices;
+
     //Assemble local K and F into global K and F
     //You will need to used local_dof_indices[A]
     for(unsigned int A=0; A<dofs_per_elem; A++)
     {
       /*Remember, local_dof_indices[A] is the global degree-of-freedom number
 	corresponding to element node number A*/
-        F[local_dof_indices[A]] += Flocal[A];
+        F[local_dof_indices[A]] += copy.Flocal[A];
+        if (spectralElement)
+        {
+            for(unsigned int q=0; q<quadRule; q++)
+            {
+                M_diag[local_dof_indices[A]] += copy.Mterms[A][q];
+            }
+        }
       for(unsigned int B=0; B<dofs_per_elem; B++)
       {
 	/*Note: K is a sparse matrix, so you need to use the function "add".
 	  For example, to add the variable C to K[i][j], you would use:
 	  K.add(i,j,C);*/
-            K.add(local_dof_indices[A],local_dof_indices[B],Klocal[A][B]);
+            K.add(local_dof_indices[A],local_dof_indices[B],copy.Klocal[A][B]);
       }
     }
-
-  }
+    },
+    ScratchData(), sample_copy);
 
   //Apply Dirichlet boundary conditions
   /*deal.II applies Dirichlet boundary conditions (using the boundary_values map we
     defined in the function "define_boundary_conds") without resizing K or F*/
-  MatrixTools::apply_boundary_values (boundary_values, K, D, F, false);
+  apply_boundary_values(boundary_values, K, D, F, false);
 }
 
 // Solve for D in KD=F
-template <int dim> void FEM<dim>::solve() {
+template <int dim, typename IndexType> void FEM<dim, IndexType>::solve() {
 
   // Solve for D
-  SparseDirectUMFPACK A;
-  A.initialize(K);
-  A.vmult(D, F); // D=K^{-1}*F
+  K_factorization.initialize(K);
+  K_factorized = true;
+  K_factorization.vmult(D, F); // D=K^{-1}*F
+}
+
+// Solve for D in KD=F with GMRES, preconditioned by a p-multigrid V-cycle
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::solve_pmultigrid(unsigned int max_iterations,
+                                           bool allow_early_stop) {
+
+  /*The condition number of K grows quickly with the basis function order, so
+    unpreconditioned iterations do not stay bounded as p goes up. The
+    preconditioner transfers between this order-p space and the order-1 space
+    on the same mesh and does a direct solve only on the (small) linear
+    problem. The element prolongation is built from our own basis functions:
+    the order-1 basis functions evaluated at the order-p nodes.*/
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  FullMatrix<double> cell_prolongation(dofs_per_elem, 2);
+  for (unsigned int A = 0; A < dofs_per_elem; A++) {
+    cell_prolongation[A][0] = (1. - xi_at_node(A)) / 2.;
+    cell_prolongation[A][1] = (1. + xi_at_node(A)) / 2.;
+  }
+
+  PMultigrid<dim> preconditioner(dim);
+  preconditioner.initialize(dof_handler, K, cell_prolongation);
+
+  // K is not symmetric once the Dirichlet rows are applied, so use GMRES
+  SolverControl solver_control(max_iterations, 1.e-12 * F.l2_norm());
+  SolverGMRES<Vector<double>> solver(solver_control);
+  try {
+    solver.solve(K, D, F, preconditioner);
+  } catch (SolverControl::NoConvergence &) {
+    /*With a small max_iterations (nested iteration) stopping early is
+      intended; D is then the last iterate. Anywhere else an unconverged D
+      must not be taken for a solution*/
+    if (!allow_early_stop) throw;
+    std::cout << "   GMRES stopped after " << max_iterations
+              << " iterations, residual " << solver_control.last_value()
+              << std::endl;
+  }
+
+  solver_iterations = solver_control.last_step();
+  std::cout << "   p-multigrid GMRES iterations: " << solver_iterations
+            << std::endl;
+}
+
+// Use a solution from an earlier run on the same mesh and order as the initial
+// guess (setup_system() starts from D = 0)
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::warm_start(const Vector<double> &initial_guess) {
+
+  AssertThrow(initial_guess.size() == dof_handler.n_dofs(),
+              ExcMessage("The initial guess has " +
+                         std::to_string(initial_guess.size()) +
+                         " entries, but there are " +
+                         std::to_string(dof_handler.n_dofs()) +
+                         " degrees of freedom"));
+  D = initial_guess;
+}
+
+// Use the solution of a coarser mesh, interpolated onto this mesh, as the
+// initial guess
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::warm_start_from_coarse(FEM<dim, IndexType> &coarse) {
+
+  /*Evaluate the coarse finite element solution at each node of this mesh. The
+    coarse elements are sorted by their left end, so the element containing a
+    node is found by a binary search; the coarse solution is then evaluated
+    with the same basis functions that were used to compute it.*/
+  const unsigned int coarse_dofs_per_elem = coarse.fe.dofs_per_cell;
+  std::vector<IndexType> coarse_dof_indices(coarse_dofs_per_elem);
+  std::vector<std::pair<double, std::vector<IndexType>>> coarse_elems;
+  typename DoFHandler<dim>::active_cell_iterator
+      elem = coarse.dof_handler.begin_active(),
+      endc = coarse.dof_handler.end();
+  for (; elem != endc; ++elem) {
+    get_dof_indices(elem, coarse_dof_indices);
+    coarse_elems.push_back(std::make_pair(
+        coarse.nodeLocation[coarse_dof_indices[0]], coarse_dof_indices));
+  }
+  std::sort(coarse_elems.begin(), coarse_elems.end());
+  std::vector<double> left_ends(coarse_elems.size());
+  for (unsigned int e = 0; e < coarse_elems.size(); e++) {
+    left_ends[e] = coarse_elems[e].first;
+  }
+
+  for (IndexType i = 0; i < dof_handler.n_dofs(); i++) {
+    double x = nodeLocation[i];
+    unsigned int e =
+        std::upper_bound(left_ends.begin(), left_ends.end(), x) -
+        left_ends.begin();
+    e = (e > 0) ? e - 1 : 0;
+    const std::vector<IndexType> &dofs = coarse_elems[e].second;
+    double x0 = coarse.nodeLocation[dofs[0]], x1 = coarse.nodeLocation[dofs[1]];
+    double xi = 2. * (x - x0) / (x1 - x0) - 1.;
+
+    D[i] = 0.;
+    for (unsigned int B = 0; B < coarse_dofs_per_elem; B++) {
+      D[i] += coarse.D[dofs[B]] * coarse.basis_function(B, xi);
+    }
+  }
 }
 
 // Output results
-template <int dim> void FEM<dim>::output_results() {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::output_results() {
 
   // Write results to VTK file
   std::string str = ("CA1_Order" + std::to_string(int(basisFunctionOrder)) + "_Problem" + std::to_string(int(prob)) + ".vtk"); //basisFunctionOrder, prob
@@ -463,50 +749,419 @@ template <int dim> void FEM<dim>::output_results() {
   output1.close();
 }
 
-template <int dim> double FEM<dim>::l2norm_of_error() {
-
-  double l2norm = 0.;
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::l2norm_of_error() {
 
   // Find the l2 norm of the error between the finite element sol'n and the
   // exact sol'n
   const unsigned int dofs_per_elem =
       fe.dofs_per_cell; // This gives you dofs per element
-  std::vector<unsigned int> local_dof_indices(dofs_per_elem);
-  double u_exact, u_h, x, h_e;
 
-  // loop over elements
+  /*The collocated GLL rule of the spectral elements under-integrates the
+    error, so a Gauss rule with enough points is used for it instead*/
+  std::vector<double> error_points = quad_points, error_weights = quad_weight;
+  if (spectralElement) {
+    QGauss<1> gauss(basisFunctionOrder + 2);
+    error_points.resize(gauss.size());
+    error_weights.resize(gauss.size());
+    for (unsigned int q = 0; q < gauss.size(); q++) {
+      error_points[q] = 2. * gauss.point(q)[0] - 1.;
+      error_weights[q] = 2. * gauss.weight(q);
+    }
+  }
+
+  // loop over elements, in parallel but summed in element order (orderedSum.h)
+  double l2norm = ordered_sum(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          std::vector<IndexType> &local_dof_indices,
+          std::vector<double> &terms) {
+        double u_exact, u_h, x, h_e;
+
+        // Retrieve the effective "connectivity matrix" for this element
+        get_dof_indices(elem, local_dof_indices);
+
+        // Find the element length
+        h_e = nodeLocation[local_dof_indices[1]] -
+              nodeLocation[local_dof_indices[0]];
+
+        for (unsigned int q = 0; q < error_points.size(); q++) {
+          x = 0.0;
+          u_h = 0.0;
+          // Find the values of x and u_h (the finite element solution) at the
+          // quadrature points
+          for (unsigned int B = 0; B < dofs_per_elem; B++) {
+            x += nodeLocation[local_dof_indices[B]] *
+                 basis_function(B, error_points[q]);
+            u_h += D[local_dof_indices[B]] * basis_function(B, error_points[q]);
+          }
+          u_exact = exact_solution(x);
+
+          terms.push_back((u_h-u_exact)*(u_h-u_exact) * h_e / 2. * error_weights[q]);
+          /*This includes evaluating the exact solution at the quadrature points*/
+        }
+      },
+      std::vector<IndexType>(dofs_per_elem));
+
+  return sqrt(l2norm);
+}
+
+// Exact solution of the subproblem at x
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::exact_solution(double x) {
+
+  double u_exact = 0.;
+  if (prob==1)
+  u_exact = -x*x*x*100000000000/(6.*E) + (g2-g1+L*L*L*100000000000/(6.*E))/L *x + g1;
+
+  if (prob==2)
+      u_exact = -x*x*x  / (6. * E) + (h+0.5*L*L)*x + g1;
+
+  return u_exact;
+}
+
+/*Points (in xi) and weights of the quantity of interest on the element
+  [x_0, x_1]: J(u) restricted to the element is sum_q weights[q]*u(xi[q]). For
+  an interval the Gauss rule is placed on the overlap of the element with the
+  sensor, so the result is exact for elements the sensor only partly covers.*/
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::sensor_quadrature(double x_0, double x_1,
+                                 std::vector<double> &xi,
+                                 std::vector<double> &weights) {
+  xi.clear();
+  weights.clear();
+  if (sensor_end <= sensor_start) {
+    // Point value; a point on a shared node belongs to the element on its right
+    if (x_0 <= sensor_start && (sensor_start < x_1 || x_1 >= L)) {
+      xi.push_back(2. * (sensor_start - x_0) / (x_1 - x_0) - 1.);
+      weights.push_back(1.);
+    }
+    return;
+  }
+
+  double a = std::max(x_0, sensor_start), b = std::min(x_1, sensor_end);
+  if (b <= a) return;
+  QGauss<1> gauss(basisFunctionOrder + 2);
+  for (unsigned int q = 0; q < gauss.size(); q++) {
+    double x = a + (b - a) * gauss.point(q)[0];
+    xi.push_back(2. * (x - x_0) / (x_1 - x_0) - 1.);
+    weights.push_back((b - a) * gauss.weight(q) / (sensor_end - sensor_start));
+  }
+}
+
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::quantity_of_interest() {
+
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  struct ScratchData {
+    std::vector<IndexType> local_dof_indices;
+    std::vector<double> xi, weights;
+  };
+  ScratchData sample_scratch;
+  sample_scratch.local_dof_indices.resize(dofs_per_elem);
+
+  return ordered_sum(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          ScratchData &scratch, std::vector<double> &terms) {
+        get_dof_indices(elem, scratch.local_dof_indices);
+        const std::vector<IndexType> &dofs = scratch.local_dof_indices;
+        sensor_quadrature(nodeLocation[dofs[0]], nodeLocation[dofs[1]],
+                          scratch.xi, scratch.weights);
+        for (unsigned int q = 0; q < scratch.xi.size(); q++) {
+          for (unsigned int B = 0; B < dofs_per_elem; B++) {
+            terms.push_back(scratch.weights[q] * D[dofs[B]] *
+                            basis_function(B, scratch.xi[q]));
+          }
+        }
+      },
+      sample_scratch);
+}
+
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::quantity_of_interest_exact() {
+
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  struct ScratchData {
+    std::vector<IndexType> local_dof_indices;
+    std::vector<double> xi, weights;
+  };
+  ScratchData sample_scratch;
+  sample_scratch.local_dof_indices.resize(dofs_per_elem);
+
+  return ordered_sum(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          ScratchData &scratch, std::vector<double> &terms) {
+        get_dof_indices(elem, scratch.local_dof_indices);
+        double x_0 = nodeLocation[scratch.local_dof_indices[0]],
+               x_1 = nodeLocation[scratch.local_dof_indices[1]];
+        sensor_quadrature(x_0, x_1, scratch.xi, scratch.weights);
+        for (unsigned int q = 0; q < scratch.xi.size(); q++) {
+          terms.push_back(scratch.weights[q] *
+                          exact_solution(x_0 + (scratch.xi[q] + 1.) / 2. *
+                                                   (x_1 - x_0)));
+        }
+      },
+      sample_scratch);
+}
+
+// Dual weighted residual estimate of the error in the quantity of interest
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::estimate_qoi_error() {
+
+  /*The adjoint (dual) problem K^T*Z = j, with j_A = J(N_A), gives the
+    sensitivity of J to the residual. It is solved with the factorization of K
+    kept from solve(); with the Dirichlet rows of K replaced by
+    apply_boundary_values, the equations of the free dofs in K^T*Z = j are
+    exactly the adjoint equations, and Z is zero on the Dirichlet boundary.*/
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  std::vector<IndexType> local_dof_indices(dofs_per_elem);
+  std::vector<double> xi, weights;
+
+  Vector<double> j(dof_handler.n_dofs());
   typename DoFHandler<dim>::active_cell_iterator elem =
                                                      dof_handler.begin_active(),
                                                  endc = dof_handler.end();
   for (; elem != endc; ++elem) {
+    get_dof_indices(elem, local_dof_indices);
+    sensor_quadrature(nodeLocation[local_dof_indices[0]],
+                      nodeLocation[local_dof_indices[1]], xi, weights);
+    for (unsigned int q = 0; q < xi.size(); q++) {
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        j[local_dof_indices[A]] += weights[q] * basis_function(A, xi[q]);
+      }
+    }
+  }
+  typename std::map<IndexType, double>::const_iterator bc;
+  for (bc = boundary_values.begin(); bc != boundary_values.end(); ++bc) {
+    j[bc->first] = 0.;
+  }
 
-    // Retrieve the effective "connectivity matrix" for this element
-    elem->get_dof_indices(local_dof_indices);
+  if (!K_factorized) {
+    K_factorization.initialize(K);
+    K_factorized = true;
+  }
+  Z.reinit(dof_handler.n_dofs());
+  K_factorization.Tvmult(Z, j);
+  for (bc = boundary_values.begin(); bc != boundary_values.end(); ++bc) {
+    Z[bc->first] = 0.;
+  }
 
-    // Find the element length
-    h_e =
-        nodeLocation[local_dof_indices[1]] - nodeLocation[local_dof_indices[0]];
+  /*J(u)-J(u_h) = R(z - z_h), the residual of u_h weighted by the adjoint
+    error. In 1D the Galerkin solutions are exact at the element end nodes, so
+    z - z_h vanishes there and is found element by element: it solves
+      int phi' v' dx = J(v) - int z_h' v' dx
+    for all v vanishing at the element ends, which is solved in the bubble
+    space (1-xi^2)*xi^k, k = 0..p. The element indicator is then
+      eta_e = int_e (f phi - u_h' phi') dx,
+    (the residual integrated by parts, no second derivatives needed) and the
+    sum of the eta_e estimates J(u)-J(u_h).*/
+  const unsigned int n_bubbles = basisFunctionOrder + 1;
+  auto bubble = [](unsigned int k, double xi) {
+    return (1. - xi * xi) * std::pow(xi, k);
+  };
+  auto bubble_gradient = [](unsigned int k, double xi) {
+    return (k > 0 ? k * std::pow(xi, k - 1) * (1. - xi * xi) : 0.) -
+           2. * std::pow(xi, k + 1);
+  };
+  QGauss<1> gauss(basisFunctionOrder + 4);
+  qoi_error_indicators.reinit(triangulation.n_active_cells());
+
+  /*The element problems are independent and solved in parallel with
+    WorkStream; the copier adds the indicators in element order, so the
+    estimate does not depend on the number of threads (see orderedSum.h)*/
+  struct ScratchData {
+    std::vector<IndexType> local_dof_indices;
+    std::vector<double> xi, weights;
+    FullMatrix<double> Kbubble;
+    Vector<double> Fbubble, phi;
+  };
+  struct CopyData {
+    unsigned int cell;
+    double eta;
+  };
+  ScratchData sample_scratch;
+  sample_scratch.local_dof_indices.resize(dofs_per_elem);
+  sample_scratch.Kbubble.reinit(n_bubbles, n_bubbles);
+  sample_scratch.Fbubble.reinit(n_bubbles);
+  sample_scratch.phi.reinit(n_bubbles);
+
+  double estimate = 0.;
+  WorkStream::run(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          ScratchData &scratch, CopyData &copy) {
+        std::vector<IndexType> &local_dof_indices = scratch.local_dof_indices;
+        FullMatrix<double> &Kbubble = scratch.Kbubble;
+        Vector<double> &Fbubble = scratch.Fbubble, &phi = scratch.phi;
+        std::vector<double> &xi = scratch.xi, &weights = scratch.weights;
+        get_dof_indices(elem, local_dof_indices);
+        double x_0 = nodeLocation[local_dof_indices[0]],
+               x_1 = nodeLocation[local_dof_indices[1]], h_e = x_1 - x_0;
+
+        Kbubble = 0.;
+        Fbubble = 0.;
+        for (unsigned int q = 0; q < gauss.size(); q++) {
+          double xi_q = 2. * gauss.point(q)[0] - 1., w = h_e * gauss.weight(q);
+          double dz_h = 0.;
+          for (unsigned int B = 0; B < dofs_per_elem; B++) {
+            dz_h +=
+                Z[local_dof_indices[B]] * basis_gradient(B, xi_q) * 2. / h_e;
+          }
+          for (unsigned int k = 0; k < n_bubbles; k++) {
+            double db_k = bubble_gradient(k, xi_q) * 2. / h_e;
+            Fbubble[k] -= dz_h * db_k * w;
+            for (unsigned int l = 0; l < n_bubbles; l++) {
+              Kbubble[k][l] += db_k * bubble_gradient(l, xi_q) * 2. / h_e * w;
+            }
+          }
+        }
+        sensor_quadrature(x_0, x_1, xi, weights);
+        for (unsigned int q = 0; q < xi.size(); q++) {
+          for (unsigned int k = 0; k < n_bubbles; k++) {
+            Fbubble[k] += weights[q] * bubble(k, xi[q]);
+          }
+        }
+        Kbubble.gauss_jordan();
+        Kbubble.vmult(phi, Fbubble);
+
+        double eta = 0.;
+        for (unsigned int q = 0; q < gauss.size(); q++) {
+          double xi_q = 2. * gauss.point(q)[0] - 1., w = h_e * gauss.weight(q);
+          double x = x_0 + gauss.point(q)[0] * h_e, du_h = 0., phi_q = 0.,
+                 dphi_q = 0.;
+          for (unsigned int B = 0; B < dofs_per_elem; B++) {
+            du_h +=
+                D[local_dof_indices[B]] * basis_gradient(B, xi_q) * 2. / h_e;
+          }
+          for (unsigned int k = 0; k < n_bubbles; k++) {
+            phi_q += phi[k] * bubble(k, xi_q);
+            dphi_q += phi[k] * bubble_gradient(k, xi_q) * 2. / h_e;
+          }
+          // f = x, as in assemble_system
+          eta += (1. * x * phi_q - du_h * dphi_q) * w;
+        }
+        copy.cell = elem->active_cell_index();
+        copy.eta = eta;
+      },
+      [&](const CopyData &copy) {
+        qoi_error_indicators[copy.cell] = copy.eta;
+        estimate += copy.eta;
+      },
+      sample_scratch, CopyData());
+  return estimate;
+}
 
-    for (unsigned int q = 0; q < quadRule; q++) {
-      x = 0.0;
-      u_h = 0.0;
-      // Find the values of x and u_h (the finite element solution) at the
-      // quadrature points
+// Refine the elements with the largest contributions to the QoI error
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::refine_for_qoi(double refine_fraction) {
+
+  Vector<float> indicators(qoi_error_indicators.size());
+  for (unsigned int e = 0; e < indicators.size(); e++) {
+    indicators[e] = std::abs(qoi_error_indicators[e]);
+  }
+  GridRefinement::refine_and_coarsen_fixed_number(triangulation, indicators,
+                                                  refine_fraction, 0.);
+  triangulation.execute_coarsening_and_refinement();
+
+  // The dofs are renumbered, so setup_system() has to rebuild the BCs
+  boundary_values.clear();
+}
+
+// Consistent mass matrix M_AB = int N_A N_B dx
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_mass_matrix() {
+
+  M.reinit(sparsity_pattern);
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  std::vector<IndexType> local_dof_indices(dofs_per_elem);
+  typename DoFHandler<dim>::active_cell_iterator elem = dof_handler.begin_active(),
+                                                 endc = dof_handler.end();
+  for (; elem != endc; ++elem) {
+    get_dof_indices(elem, local_dof_indices);
+    double h_e = nodeLocation[local_dof_indices[1]] - nodeLocation[local_dof_indices[0]];
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
       for (unsigned int B = 0; B < dofs_per_elem; B++) {
-        x += nodeLocation[local_dof_indices[B]] *
-             basis_function(B, quad_points[q]);
-        u_h += D[local_dof_indices[B]] * basis_function(B, quad_points[q]);
+        double Mlocal = 0.;
+        for (unsigned int q = 0; q < quadRule; q++) {
+          Mlocal += h_e / 2. * basis_at_quad[q][A] * basis_at_quad[q][B] *
+                    quad_weight[q];
+        }
+        M.add(local_dof_indices[A], local_dof_indices[B], Mlocal);
       }
-      if (prob==1)
-      u_exact = -x*x*x*100000000000/(6.*E) + (g2-g1+L*L*L*100000000000/(6.*E))/L *x + g1;
+    }
+  }
+}
 
-      if (prob==2)
-          u_exact = -x*x*x  / (6. * E) + (h+0.5*L*L)*x + g1;
+// Lowest vibration modes (closest to "shift") by shift-invert Lanczos
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::compute_modes(unsigned int n_modes, double shift) {
+
+  /*With spectral elements the GLL mass matrix M_diag from assemble_system() is
+    used (diagonal, so K - shift*M keeps the sparsity of K), otherwise the
+    consistent mass matrix*/
+  ShiftInvertLanczos lanczos;
+  unsigned int steps;
+  if (spectralElement) {
+    steps = lanczos.solve(K, M_diag, boundary_values, shift, n_modes,
+                          eigenvalues, modes);
+  } else {
+    assemble_mass_matrix();
+    steps = lanczos.solve(K, M, boundary_values, shift, n_modes, eigenvalues,
+                          modes);
+  }
 
-      l2norm += (u_h-u_exact)*(u_h-u_exact) * h_e / 2. * quad_weight[q];
-      /*This includes evaluating the exact solution at the quadrature points*/
-    }
+  // Exact: (k*pi/L)^2 fixed-fixed (problem 1), ((k-1/2)*pi/L)^2 fixed-free (2)
+  std::cout << "   " << n_modes << " modes after " << steps
+            << " Lanczos steps" << std::endl;
+  for (unsigned int k = 0; k < eigenvalues.size(); k++) {
+    double exact = std::pow((k + (prob == 1 ? 1. : 0.5)) * M_PI / L, 2);
+    std::cout << "   Mode " << k + 1 << ": lambda = " << eigenvalues[k]
+              << " (exact " << exact << "), omega = " << std::sqrt(eigenvalues[k])
+              << std::endl;
   }
+}
+
+/*Nested iteration convergence study: solve directly on the coarsest mesh only,
+  then on each finer mesh (twice the elements of the previous one) start the
+  iterative solver from the interpolated coarser solution and stop it after a
+  few cycles. The initial guess is already close to the discretization error
+  of the finer mesh, so a few cycles suffice and the whole study costs about
+  as much as one fine solve. Returns the l2 norm of the error on each level.*/
+template <int dim>
+std::vector<double>
+nested_iteration_study(unsigned int order, unsigned int problem, bool spectral,
+                       unsigned int coarseElements, unsigned int levels,
+                       unsigned int cyclesPerLevel = 2) {
+
+  std::vector<double> l2norms;
+  std::unique_ptr<FEM<dim>> coarse, fine;
+  unsigned int numberOfElements = coarseElements;
+  for (unsigned int level = 0; level < levels; level++) {
+    fine.reset(new FEM<dim>(order, problem, spectral));
+    fine->generate_mesh(numberOfElements);
+    fine->setup_system();
+    if (level > 0) {
+      fine->warm_start_from_coarse(*coarse);
+    }
+    fine->assemble_system();
+    if (level == 0) {
+      fine->solve();
+    } else {
+      fine->solve_pmultigrid(cyclesPerLevel, true);
+    }
+    l2norms.push_back(fine->l2norm_of_error());
+
+    std::cout << "   Level " << level << ": " << numberOfElements
+              << " elements, l2 norm of error " << l2norms[level];
+    if (level > 0) {
+      std::cout << ", rate " << std::log2(l2norms[level - 1] / l2norms[level]);
+    }
+    std::cout << std::endl;
 
-  return sqrt(l2norm);;
+    coarse.swap(fine);
+    numberOfElements *= 2;
+  }
+  return l2norms;
 }
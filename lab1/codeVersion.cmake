@@ -0,0 +1,26 @@
+##
+#  Writes OUTPUT with RESULT_CACHE_CODE_VERSION, a SHA-256 digest of the
+#  sources in SOURCE_DIR (the header-only FEM classes and main1.cc), for the
+#  result cache (resultCache.h). OUTPUT is only rewritten when the digest
+#  changes, so a rebuild without changes keeps the cached results.
+##
+
+FILE(GLOB SOURCES ${SOURCE_DIR}/*.h ${SOURCE_DIR}/*.cc)
+LIST(REMOVE_ITEM SOURCES ${OUTPUT})
+LIST(SORT SOURCES)
+SET(DIGESTS "")
+FOREACH(SOURCE ${SOURCES})
+  FILE(SHA256 ${SOURCE} DIGEST)
+  GET_FILENAME_COMPONENT(NAME ${SOURCE} NAME)
+  SET(DIGESTS "${DIGESTS}${NAME} ${DIGEST}\n")
+ENDFOREACH()
+STRING(SHA256 VERSION "${DIGESTS}")
+
+SET(CONTENT "#define RESULT_CACHE_CODE_VERSION \"${VERSION}\"\n")
+SET(OLD_CONTENT "")
+IF(EXISTS ${OUTPUT})
+  FILE(READ ${OUTPUT} OLD_CONTENT)
+ENDIF()
+IF(NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+  FILE(WRITE ${OUTPUT} "${CONTENT}")
+ENDIF()
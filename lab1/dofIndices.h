@@ -0,0 +1,78 @@
+#ifndef DOFINDICES_H_
+#define DOFINDICES_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/types.h>
+#include <deal.II/lac/sparse_matrix.h>
+#include <deal.II/lac/vector.h>
+#include <deal.II/numerics/matrix_tools.h>
+// Standard C++ libraries
+#include <limits>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+using namespace dealii;
+
+/*Global dof indices of width IndexType in the FEM classes.
+
+  deal.II itself numbers dofs with types::global_dof_index, which is 32 bit
+  unless deal.II was configured with DEAL_II_WITH_64BIT_INDICES. The FEM
+  classes keep their own index arrays (local_dof_indices, boundary_values, the
+  per-cell caches) in IndexType, which is unsigned int by default: half the
+  memory traffic of 64 bit indices, and enough for up to 2^32 - 1 dofs. For
+  larger meshes the classes are instantiated with IndexType =
+  types::global_dof_index (on a 64 bit deal.II).
+
+  These helpers are the only places where the two meet. If the widths are the
+  same they pass straight through to deal.II; otherwise the indices are
+  converted, and check_index_range() refuses a mesh whose dofs do not fit in
+  IndexType instead of letting them wrap around.*/
+
+// Throw if dofs 0..n_dofs-1 cannot be represented in IndexType
+template <typename IndexType>
+void check_index_range(types::global_dof_index n_dofs) {
+  AssertThrow(n_dofs == 0 ||
+                  n_dofs - 1 <= types::global_dof_index(
+                                    std::numeric_limits<IndexType>::max()),
+              ExcMessage("The mesh has " + std::to_string(n_dofs) +
+                         " dofs, more than the index type of the FEM class can "
+                         "hold; use 64 bit indices (IndexType = "
+                         "types::global_dof_index) for this mesh"));
+}
+
+// object->get_dof_indices() (for a cell or face iterator) into IndexType
+template <typename Iterator, typename IndexType>
+void get_dof_indices(const Iterator &object, std::vector<IndexType> &indices) {
+  if constexpr (std::is_same<IndexType, types::global_dof_index>::value) {
+    object->get_dof_indices(indices);
+  } else {
+    static thread_local std::vector<types::global_dof_index> global_indices;
+    global_indices.resize(indices.size());
+    object->get_dof_indices(global_indices);
+    for (unsigned int i = 0; i < indices.size(); i++) {
+      indices[i] = IndexType(global_indices[i]);
+    }
+  }
+}
+
+// MatrixTools::apply_boundary_values with the Dirichlet map in IndexType
+template <typename IndexType>
+void apply_boundary_values(const std::map<IndexType, double> &boundary_values,
+                           SparseMatrix<double> &K, Vector<double> &D,
+                           Vector<double> &F, bool eliminate_columns) {
+  if constexpr (std::is_same<IndexType, types::global_dof_index>::value) {
+    MatrixTools::apply_boundary_values(boundary_values, K, D, F,
+                                       eliminate_columns);
+  } else {
+    // The map is sorted either way, so the copy is built in linear time
+    std::map<types::global_dof_index, double> global_values;
+    typename std::map<IndexType, double>::const_iterator bc;
+    for (bc = boundary_values.begin(); bc != boundary_values.end(); ++bc) {
+      global_values.emplace_hint(global_values.end(), bc->first, bc->second);
+    }
+    MatrixTools::apply_boundary_values(global_values, K, D, F,
+                                       eliminate_columns);
+  }
+}
+
+#endif
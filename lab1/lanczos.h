@@ -0,0 +1,295 @@
+#ifndef LANCZOS_H_
+#define LANCZOS_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/lac/full_matrix.h>
+#include <deal.II/lac/sparse_direct.h>
+#include <deal.II/lac/sparse_matrix.h>
+#include <deal.II/lac/vector.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+using namespace dealii;
+
+/*Shift-invert Lanczos for the eigenpairs of K x = lambda M x (K, M symmetric,
+  M positive definite on the free dofs) whose eigenvalues are closest to a
+  shift sigma, e.g. sigma = 0 for the lowest vibration modes of the lab1 bar or
+  the slowest thermal decay modes in lab2.
+
+  The Lanczos recurrence runs on OP = (K - sigma*M)^{-1}*M, which is symmetric
+  in the M inner product, so the projected problem is a symmetric tridiagonal
+  matrix T instead of the full Hessenberg matrix of Arnoldi. Its eigenvalues
+  theta give lambda = sigma + 1/theta, so the wanted eigenvalues (closest to
+  sigma) are the largest |theta| and converge first. K - sigma*M is factored
+  once and every step is one M product and one pair of triangular solves. The
+  basis is fully reorthogonalized (twice), which is affordable for the few
+  dozen to few hundred steps needed and avoids spurious copies of converged
+  eigenvalues.
+
+  Dirichlet dofs (the keys of boundary_values) are taken out of the problem:
+  their rows and columns of K - sigma*M are replaced by the identity and M
+  products are zeroed there, so every Lanczos vector (and eigenvector) is zero
+  on them. K may be given before or after MatrixTools::apply_boundary_values.
+
+  M can be a SparseMatrix with the sparsity pattern of K, or a Vector with the
+  diagonal of a lumped mass matrix.*/
+class ShiftInvertLanczos {
+public:
+  ShiftInvertLanczos(unsigned int max_steps = 300, double tolerance = 1.e-10);
+
+  /*Compute the n_eigenvalues eigenpairs closest to "shift", sorted by
+    eigenvalue, with M-orthonormal eigenvectors. Returns the number of Lanczos
+    steps. If max_steps is reached before all the pairs converge, the Ritz
+    pairs are returned anyway, with a warning; n_converged tells how many of
+    them are within the tolerance.*/
+  template <typename MassType, typename IndexType>
+  unsigned int solve(const SparseMatrix<double> &K, const MassType &M,
+                     const std::map<IndexType, double> &boundary_values,
+                     double shift, unsigned int n_eigenvalues,
+                     std::vector<double> &eigenvalues,
+                     std::vector<Vector<double>> &eigenvectors);
+
+  // Eigenvalues (in place of "diagonal") and eigenvectors (columns of Q) of the
+  // symmetric tridiagonal matrix with the given diagonal and off-diagonal
+  static void tridiagonal_eigenpairs(std::vector<double> &diagonal,
+                                     std::vector<double> off_diagonal,
+                                     FullMatrix<double> &Q);
+
+  unsigned int max_steps;
+  double tolerance; // On the relative residual of the eigenpairs of OP
+
+  // Factorization of K - shift*M, kept so later solves with the same shift
+  // can call it directly
+  SparseMatrix<double> shifted_matrix;
+  SparseDirectUMFPACK shifted_factorization;
+
+  // Residual estimates |beta*s| / |theta| of the returned pairs, in their order
+  std::vector<double> residuals;
+  // Returned pairs within the tolerance (all of them unless max_steps was hit)
+  unsigned int n_converged;
+
+private:
+  static void add_mass(SparseMatrix<double> &A, double factor,
+                       const SparseMatrix<double> &M) {
+    A.add(factor, M);
+  }
+  static void add_mass(SparseMatrix<double> &A, double factor,
+                       const Vector<double> &M_diag) {
+    for (types::global_dof_index i = 0; i < M_diag.size(); i++) {
+      A.diag_element(i) += factor * M_diag[i];
+    }
+  }
+  static void mass_vmult(Vector<double> &dst, const SparseMatrix<double> &M,
+                         const Vector<double> &src) {
+    M.vmult(dst, src);
+  }
+  static void mass_vmult(Vector<double> &dst, const Vector<double> &M_diag,
+                         const Vector<double> &src) {
+    dst = src;
+    dst.scale(M_diag);
+  }
+};
+
+inline ShiftInvertLanczos::ShiftInvertLanczos(unsigned int max_steps,
+                                              double tolerance)
+    : max_steps(max_steps), tolerance(tolerance), n_converged(0) {}
+
+template <typename MassType, typename IndexType>
+unsigned int ShiftInvertLanczos::solve(
+    const SparseMatrix<double> &K, const MassType &M,
+    const std::map<IndexType, double> &boundary_values, double shift,
+    unsigned int n_eigenvalues, std::vector<double> &eigenvalues,
+    std::vector<Vector<double>> &eigenvectors) {
+
+  const types::global_dof_index n = K.m();
+  std::vector<bool> constrained(n, false);
+  typename std::map<IndexType, double>::const_iterator bc;
+  for (bc = boundary_values.begin(); bc != boundary_values.end(); ++bc) {
+    constrained[bc->first] = true;
+  }
+  const types::global_dof_index n_free = n - boundary_values.size();
+  AssertThrow(n_eigenvalues > 0 && n_eigenvalues <= n_free,
+              ExcMessage("Asked for more eigenvalues than free dofs"));
+
+  // K - shift*M with identity rows/columns for the Dirichlet dofs, factored once
+  shifted_matrix.reinit(K.get_sparsity_pattern());
+  shifted_matrix.copy_from(K);
+  add_mass(shifted_matrix, -shift, M);
+  for (SparseMatrix<double>::iterator entry = shifted_matrix.begin();
+       entry != shifted_matrix.end(); ++entry) {
+    if (constrained[entry->row()] || constrained[entry->column()]) {
+      entry->value() = (entry->row() == entry->column()) ? 1. : 0.;
+    }
+  }
+  shifted_factorization.initialize(shifted_matrix);
+
+  auto apply_mass = [&](Vector<double> &dst, const Vector<double> &src) {
+    mass_vmult(dst, M, src);
+    for (types::global_dof_index i = 0; i < n; i++) {
+      if (constrained[i]) dst[i] = 0.;
+    }
+  };
+
+  // Lanczos vectors q_j and M*q_j (kept for the reorthogonalization)
+  std::vector<Vector<double>> q, Mq;
+  std::vector<double> alpha, beta;
+  const unsigned int steps =
+      std::min<types::global_dof_index>(max_steps, n_free);
+
+  // Reproducible pseudo-random start vector
+  Vector<double> r(n), Mr(n), w(n);
+  std::mt19937 generator(5489u);
+  std::uniform_real_distribution<double> uniform(-1., 1.);
+  for (types::global_dof_index i = 0; i < n; i++) {
+    r[i] = constrained[i] ? 0. : uniform(generator);
+  }
+  apply_mass(Mr, r);
+  double beta_next = std::sqrt(r * Mr);
+
+  std::vector<double> theta;
+  FullMatrix<double> S;
+  std::vector<unsigned int> wanted;
+  bool converged = false;
+  for (unsigned int j = 0; j < steps; j++) {
+    // Invariant subspace: the eigenpairs of T are exact
+    if (j > 0 && beta_next <= 1.e-14 * std::abs(alpha[0])) {
+      converged = true;
+      break;
+    }
+    if (j > 0) beta.push_back(beta_next);
+    q.push_back(r);
+    q[j] /= beta_next;
+    Mq.push_back(Mr);
+    Mq[j] /= beta_next;
+
+    shifted_factorization.vmult(w, Mq[j]);
+    alpha.push_back(w * Mq[j]);
+
+    /*Subtracting the components along all previous q_i (in the M inner
+      product) includes the three-term recurrence w -= alpha_j*q_j +
+      beta_j*q_{j-1}; the second pass removes what rounding left*/
+    for (unsigned int pass = 0; pass < 2; pass++) {
+      for (unsigned int i = 0; i <= j; i++) {
+        w.add(-(w * Mq[i]), q[i]);
+      }
+    }
+    r = w;
+    apply_mass(Mr, r);
+    beta_next = std::sqrt(std::max(r * Mr, 0.));
+
+    // Ritz pairs, once there are enough
+    const unsigned int m = j + 1;
+    if (m < n_eigenvalues) continue;
+    theta = alpha;
+    tridiagonal_eigenpairs(theta, beta, S);
+    wanted.resize(m);
+    for (unsigned int i = 0; i < m; i++) {
+      wanted[i] = i;
+    }
+    std::sort(wanted.begin(), wanted.end(), [&](unsigned int a, unsigned int b) {
+      return std::abs(theta[a]) > std::abs(theta[b]);
+    });
+    wanted.resize(n_eigenvalues);
+    converged = true;
+    for (unsigned int k = 0; k < n_eigenvalues; k++) {
+      converged = converged && (beta_next * std::abs(S[m - 1][wanted[k]]) <=
+                                tolerance * std::abs(theta[wanted[k]]));
+    }
+    if (converged) break;
+  }
+  AssertThrow(theta.size() >= n_eigenvalues,
+              ExcMessage("Lanczos broke down before finding all eigenvalues"));
+
+  // lambda = shift + 1/theta, with eigenvectors Q*s; sorted by lambda
+  std::sort(wanted.begin(), wanted.end(), [&](unsigned int a, unsigned int b) {
+    return 1. / theta[a] < 1. / theta[b];
+  });
+  eigenvalues.resize(n_eigenvalues);
+  eigenvectors.assign(n_eigenvalues, Vector<double>(n));
+  residuals.resize(n_eigenvalues);
+  n_converged = 0;
+  const unsigned int m = theta.size();
+  for (unsigned int k = 0; k < n_eigenvalues; k++) {
+    eigenvalues[k] = shift + 1. / theta[wanted[k]];
+    for (unsigned int i = 0; i < m; i++) {
+      eigenvectors[k].add(S[i][wanted[k]], q[i]);
+    }
+    residuals[k] =
+        beta_next * std::abs(S[m - 1][wanted[k]]) / std::abs(theta[wanted[k]]);
+    if (converged || residuals[k] <= tolerance) n_converged++;
+  }
+  if (n_converged < n_eigenvalues) {
+    std::cout << "   Warning: Lanczos stopped after " << m
+              << " steps (max_steps " << max_steps << ") with " << n_converged
+              << " of " << n_eigenvalues
+              << " eigenpairs converged (largest residual "
+              << *std::max_element(residuals.begin(), residuals.end())
+              << ", tolerance " << tolerance << ")" << std::endl;
+  }
+  return m;
+}
+
+// Implicit QL with Wilkinson shifts (as in EISPACK's tql2)
+inline void
+ShiftInvertLanczos::tridiagonal_eigenpairs(std::vector<double> &diagonal,
+                                           std::vector<double> off_diagonal,
+                                           FullMatrix<double> &Q) {
+  std::vector<double> &d = diagonal, &e = off_diagonal;
+  const unsigned int n = d.size();
+  e.resize(n, 0.);
+  Q.reinit(n, n);
+  for (unsigned int i = 0; i < n; i++) {
+    Q[i][i] = 1.;
+  }
+
+  for (unsigned int l = 0; l < n; l++) {
+    unsigned int iterations = 0, m;
+    do {
+      // Look for a negligible off-diagonal element to split the matrix
+      for (m = l; m + 1 < n; m++) {
+        double dd = std::abs(d[m]) + std::abs(d[m + 1]);
+        if (std::abs(e[m]) <= 1.e-15 * dd) break;
+      }
+      if (m == l) break;
+      AssertThrow(iterations++ < 60,
+                  ExcMessage("Tridiagonal eigenvalue iteration did not converge"));
+
+      double g = (d[l + 1] - d[l]) / (2. * e[l]);
+      double r = std::hypot(g, 1.);
+      g = d[m] - d[l] + e[l] / (g + std::copysign(r, g));
+      double s = 1., c = 1., p = 0.;
+      bool deflated = false;
+      for (int i = int(m) - 1; i >= int(l); i--) {
+        double f = s * e[i], b = c * e[i];
+        e[i + 1] = r = std::hypot(f, g);
+        if (r == 0.) {
+          d[i + 1] -= p;
+          e[m] = 0.;
+          deflated = true;
+          break;
+        }
+        s = f / r;
+        c = g / r;
+        g = d[i + 1] - p;
+        r = (d[i] - g) * s + 2. * c * b;
+        p = s * r;
+        d[i + 1] = g + p;
+        g = c * r - b;
+        for (unsigned int k = 0; k < n; k++) {
+          f = Q[k][i + 1];
+          Q[k][i + 1] = s * Q[k][i] + c * f;
+          Q[k][i] = c * Q[k][i] - s * f;
+        }
+      }
+      if (deflated) continue;
+      d[l] -= p;
+      e[l] = g;
+      e[m] = 0.;
+    } while (true);
+  }
+}
+
+#endif
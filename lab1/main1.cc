@@ -5,6 +5,8 @@
 
 #include "FEM1.h"
 #include "writeSolutions.h"
+#include "resultCache.h"
+#include "solutionSeries.h"
 
 using namespace dealii;
 
@@ -18,22 +20,162 @@ int main (){
 		//Specify the subproblem: 1 or 2
 		unsigned int problem = 2;
 
-    FEM<1> problemObject(order,problem);
-    
+		//Use GLL nodes and collocated GLL quadrature (spectral elements): true or false
+		bool spectral = false;
+
+		//Specify the linear solver: 0 (direct, UMFPACK) or 1 (p-multigrid GMRES)
+		unsigned int linearSolver = 0;
+
+		//Number of threads for the element loops: 0 for all cores. The element
+		//contributions are added in element order, so K, F, D and the norms are
+		//bitwise the same for any number of threads
+		unsigned int threads = 0;
+		if(threads > 0){
+		  MultithreadInfo::set_thread_limit(threads);
+		}
+
+		//Initial guess for the iterative solver (linearSolver = 1), zero if neither is set:
+		//the tag of an h5 file written by an earlier run on the same mesh and order,
+		//e.g. "CA1_Order3_Problem2", or the number of elements of a coarser mesh to solve first
+		std::string warmStartFile = "";
+		unsigned int warmStartCoarseElements = 0;
+
+		//Nested iteration convergence study instead of a single solve: true or false.
+		//Starts from studyCoarseElements elements and doubles them studyLevels-1 times
+		bool nestedIterationStudy = false;
+		unsigned int studyCoarseElements = 10, studyLevels = 5;
+		if(nestedIterationStudy){
+		  nested_iteration_study<1>(order,problem,spectral,studyCoarseElements,studyLevels);
+		  return 0;
+		}
+
+		//Goal-oriented refinement: number of adaptive cycles (0 for none). The quantity of
+		//interest is the average of u over [sensorStart, sensorEnd], or the value of u at
+		//sensorStart if they are equal (e.g. 0.1 and 0.1: the tip displacement)
+		unsigned int goalOrientedCycles = 0;
+		double sensorStart = 0.1, sensorEnd = 0.1;
+
+		//Number of vibration modes of the bar to compute after the solve (shift-invert
+		//Lanczos, see lanczos.h): 0 for none
+		unsigned int vibrationModes = 0;
+		//Also write the modes as the steps 1, 2, ... of an HDF5/XDMF series (solutionSeries.h),
+		//<tag>_modes.h5 and <tag>_modes.xdmf, to step through them in ParaView
+		bool vibrationModeSeries = false;
+
+		//Result cache (resultCache.h): a rerun with the same inputs and the same code reads
+		//D and the L2 error from resultCacheDirectory instead of meshing, assembling and
+		//solving, and only rewrites the h5 file (not solution.vtk, nor the modes)
+		bool useResultCache = false;
+		std::string resultCacheDirectory = "resultCache";
+
+		//Number of elements of the mesh
+		unsigned int numberOfElements = 10;
+
+    FEM<1> problemObject(order,problem,spectral);
+
+    char tag[21];
+    sprintf(tag, "CA1_Order%d_Problem%d",order,problem);
+
+    //Everything that defines the result, in a fixed order
+    ResultCache resultCache(resultCacheDirectory);
+    resultCache.add_input("order", order);
+    resultCache.add_input("problem", problem);
+    resultCache.add_input("spectral", spectral);
+    resultCache.add_input("linearSolver", linearSolver);
+    resultCache.add_input("elements", numberOfElements);
+    resultCache.add_file("warmStartFile", warmStartFile);
+    resultCache.add_input("warmStartCoarseElements", warmStartCoarseElements);
+    resultCache.add_input("goalOrientedCycles", goalOrientedCycles);
+    resultCache.add_input("sensorStart", sensorStart);
+    resultCache.add_input("sensorEnd", sensorEnd);
+    resultCache.add_input("E", problemObject.E);
+    resultCache.add_input("f", problemObject.f);
+    resultCache.add_input("h", problemObject.h);
+    resultCache.add_input("g1", problemObject.g1);
+    resultCache.add_input("g2", problemObject.g2);
+    if(useResultCache && !resultCache.enabled){
+      std::cout << "   Warning: result cache disabled (built without codeVersion.h)" << std::endl;
+    }
+    if(useResultCache){
+      Vector<double> cachedD;
+      std::map<std::string, double> cachedResults;
+      if(resultCache.load(cachedD, cachedResults)){
+        std::cout << "   Result cache hit (" << resultCache.key() << ")" << std::endl;
+        std::cout << cachedResults["l2norm"] << std::endl;
+        writeSolutionsToFileCA1(cachedD, cachedResults["l2norm"], tag);
+        return 0;
+      }
+    }
+
     //Define the number of elements as an input to "generate_mesh"
-    problemObject.generate_mesh(10); //e.g. a 10 element mesh
+    problemObject.generate_mesh(numberOfElements); //e.g. a 10 element mesh
     problemObject.setup_system();
+    if(!warmStartFile.empty()){
+      Vector<double> initialGuess;
+      readSolutionFromFileCA1(initialGuess, warmStartFile);
+      problemObject.warm_start(initialGuess);
+    }
+    else if(warmStartCoarseElements > 0){
+      FEM<1> coarseObject(order,problem,spectral);
+      coarseObject.generate_mesh(warmStartCoarseElements);
+      coarseObject.setup_system();
+      coarseObject.assemble_system();
+      coarseObject.solve();
+      problemObject.warm_start_from_coarse(coarseObject);
+    }
     problemObject.assemble_system();
-    problemObject.solve();
+    if(linearSolver == 1){
+      problemObject.solve_pmultigrid();
+    }
+    else{
+      problemObject.solve();
+    }
     std::cout << problemObject.l2norm_of_error() << std::endl;
+    if(vibrationModes > 0){
+      problemObject.compute_modes(vibrationModes);
+      if(vibrationModeSeries){
+        SolutionSeries modeSeries(std::string(tag) + "_modes");
+        modeSeries.write_mesh(problemObject.dof_handler, problemObject.nodeLocation);
+        for(unsigned int k = 0; k < problemObject.modes.size(); k++){
+          modeSeries.add_step(k + 1);
+          modeSeries.add_field("mode", problemObject.modes[k]);
+        }
+      }
+    }
+
+    //Refine where the error in the quantity of interest comes from, and solve again
+    problemObject.sensor_start = sensorStart;
+    problemObject.sensor_end = sensorEnd;
+    for(unsigned int cycle = 0; cycle < goalOrientedCycles; cycle++){
+      double estimate = problemObject.estimate_qoi_error();
+      std::cout << "   Cycle " << cycle << ": " << problemObject.dof_handler.n_dofs()
+                << " dofs, QoI " << problemObject.quantity_of_interest()
+                << ", estimated error " << estimate << ", actual error "
+                << problemObject.quantity_of_interest_exact() - problemObject.quantity_of_interest()
+                << std::endl;
+      problemObject.refine_for_qoi();
+      problemObject.setup_system();
+      problemObject.assemble_system();
+      if(linearSolver == 1){
+        problemObject.solve_pmultigrid();
+      }
+      else{
+        problemObject.solve();
+      }
+    }
     
     //write output file in vtk format for visualization
     problemObject.output_results();
     
     //write solutions to h5 file
-    char tag[21];
-    sprintf(tag, "CA1_Order%d_Problem%d",order,problem);
-    writeSolutionsToFileCA1(problemObject.D, problemObject.l2norm_of_error(), tag);
+    double l2norm = problemObject.l2norm_of_error();
+    writeSolutionsToFileCA1(problemObject.D, l2norm, tag);
+    if(useResultCache){
+      std::map<std::string, double> results;
+      results["l2norm"] = l2norm;
+      results["dofs"] = problemObject.D.size();
+      resultCache.store(problemObject.D, results);
+    }
   }
   catch (std::exception &exc){
     std::cerr << std::endl << std::endl
@@ -0,0 +1,43 @@
+#ifndef ORDEREDSUM_H_
+#define ORDEREDSUM_H_
+#include <deal.II/base/work_stream.h>
+// Standard C++ libraries
+#include <vector>
+using namespace dealii;
+
+/*Reproducible parallel sums over the elements of a mesh.
+
+  Summing in whatever order the threads finish makes the last bits of a
+  result depend on the number of threads (and on the run). Here the elements
+  are processed on all threads with WorkStream, but the worker only computes
+  an element's terms; the copier, which WorkStream runs on one thread at a
+  time and in the order of the element range, adds them up. The terms are
+  therefore added in exactly the order of a serial loop over the elements,
+  and the result is bitwise the same for any number of threads, and the same
+  as that serial loop. The assembly of K and F in FEM1.h works the same way.
+
+  element_terms(elem, scratch, terms) appends the terms of one element to
+  "terms" in the order the serial loop adds them; scratch (a copy of
+  sample_scratch per thread) holds its work arrays.*/
+template <typename Iterator, typename ScratchData, typename Function>
+double ordered_sum(const Iterator &begin, const Iterator &end,
+                   const Function &element_terms,
+                   const ScratchData &sample_scratch) {
+  double sum = 0.;
+  WorkStream::run(
+      begin, end,
+      [&](const Iterator &elem, ScratchData &scratch,
+          std::vector<double> &terms) {
+        terms.clear();
+        element_terms(elem, scratch, terms);
+      },
+      [&](const std::vector<double> &terms) {
+        for (unsigned int i = 0; i < terms.size(); i++) {
+          sum += terms[i];
+        }
+      },
+      sample_scratch, std::vector<double>());
+  return sum;
+}
+
+#endif
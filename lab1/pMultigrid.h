@@ -0,0 +1,175 @@
+#ifndef PMULTIGRID_H_
+#define PMULTIGRID_H_
+#include <deal.II/dofs/dof_handler.h>
+#include <deal.II/dofs/dof_tools.h>
+#include <deal.II/fe/fe_q.h>
+#include <deal.II/fe/fe_system.h>
+#include <deal.II/fe/fe_tools.h>
+#include <deal.II/lac/dynamic_sparsity_pattern.h>
+#include <deal.II/lac/full_matrix.h>
+#include <deal.II/lac/sparse_direct.h>
+#include <deal.II/lac/sparse_matrix.h>
+#include <deal.II/lac/vector.h>
+using namespace dealii;
+
+/*Two-level p-multigrid preconditioner. The fine level is the order-p space the
+  matrix K was assembled on; the coarse level is the order-1 space on the same
+  triangulation. The two are connected by the prolongation P (linear -> order
+  p interpolation), the coarse operator is the Galerkin product P^T K P, which
+  is small enough to factor directly, and SSOR sweeps on K smooth the high
+  order error components the coarse space cannot see. One application of
+  "vmult" is one V-cycle, so the class can be handed to any deal.II solver as
+  a preconditioner.*/
+template <int dim> class PMultigrid {
+public:
+  PMultigrid(unsigned int n_components);
+
+  /*"cell_prolongation" is the (dofs per fine cell) x (dofs per coarse cell)
+    matrix interpolating the coarse basis onto the fine nodes of one element.
+    If it is left empty it is taken from the deal.II finite elements, which is
+    only right if K was assembled with the deal.II shape functions.*/
+  void initialize(const DoFHandler<dim> &dof_handler, const SparseMatrix<double> &K,
+                  const FullMatrix<double> &cell_prolongation = FullMatrix<double>(),
+                  unsigned int smoothing_steps = 2, double relaxation = 1.0);
+
+  // Apply one V-cycle: dst ~ K^{-1}*src
+  void vmult(Vector<double> &dst, const Vector<double> &src) const;
+
+  // Coarse (order-1) space
+  FESystem<dim> fe_linear;
+  DoFHandler<dim> dof_handler_linear;
+
+  // Transfer operator and coarse operator
+  SparsityPattern prolongation_pattern, KP_pattern, coarse_pattern;
+  SparseMatrix<double> P, KP, K_coarse;
+  SparseDirectUMFPACK coarse_solver;
+
+  const SparseMatrix<double> *K_fine;
+  unsigned int n_smoothing_steps;
+  double omega;
+
+  // Work vectors, kept to avoid reallocating them every cycle
+  mutable Vector<double> residual, correction, coarse_residual,
+      coarse_correction;
+
+private:
+  void smooth(Vector<double> &dst, const Vector<double> &src) const;
+};
+
+template <int dim>
+PMultigrid<dim>::PMultigrid(unsigned int n_components)
+    : fe_linear(FE_Q<dim>(1), n_components), K_fine(NULL), n_smoothing_steps(2),
+      omega(1.0) {}
+
+template <int dim>
+void PMultigrid<dim>::initialize(const DoFHandler<dim> &dof_handler,
+                                 const SparseMatrix<double> &K,
+                                 const FullMatrix<double> &cell_prolongation,
+                                 unsigned int smoothing_steps,
+                                 double relaxation) {
+  K_fine = &K;
+  P.clear();
+  K_coarse.clear();
+  n_smoothing_steps = smoothing_steps;
+  omega = relaxation;
+
+  // Distribute the order-1 dofs on the same mesh
+  dof_handler_linear.reinit(dof_handler.get_triangulation());
+  dof_handler_linear.distribute_dofs(fe_linear);
+
+  const unsigned int dofs_per_elem = dof_handler.get_fe().dofs_per_cell;
+  const unsigned int linear_dofs_per_elem = fe_linear.dofs_per_cell;
+
+  FullMatrix<double> interpolation(dofs_per_elem, linear_dofs_per_elem);
+  if (cell_prolongation.m() == 0) {
+    FETools::get_interpolation_matrix(fe_linear, dof_handler.get_fe(),
+                                      interpolation);
+  } else {
+    interpolation = cell_prolongation;
+  }
+
+  /*Build P element by element. A fine node shared between elements gets the
+    same interpolated value from either side, so entries are set, not added.*/
+  std::vector<types::global_dof_index> local_dof_indices(dofs_per_elem),
+      linear_dof_indices(linear_dofs_per_elem);
+  DynamicSparsityPattern dsp(dof_handler.n_dofs(), dof_handler_linear.n_dofs());
+  typename DoFHandler<dim>::active_cell_iterator
+      elem = dof_handler.begin_active(),
+      elem_linear = dof_handler_linear.begin_active(),
+      endc = dof_handler.end();
+  for (; elem != endc; ++elem, ++elem_linear) {
+    elem->get_dof_indices(local_dof_indices);
+    elem_linear->get_dof_indices(linear_dof_indices);
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      for (unsigned int a = 0; a < linear_dofs_per_elem; a++) {
+        if (std::abs(interpolation[A][a]) > 1.e-14) {
+          dsp.add(local_dof_indices[A], linear_dof_indices[a]);
+        }
+      }
+    }
+  }
+  prolongation_pattern.copy_from(dsp);
+  P.reinit(prolongation_pattern);
+
+  elem = dof_handler.begin_active();
+  elem_linear = dof_handler_linear.begin_active();
+  for (; elem != endc; ++elem, ++elem_linear) {
+    elem->get_dof_indices(local_dof_indices);
+    elem_linear->get_dof_indices(linear_dof_indices);
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      for (unsigned int a = 0; a < linear_dofs_per_elem; a++) {
+        if (std::abs(interpolation[A][a]) > 1.e-14) {
+          P.set(local_dof_indices[A], linear_dof_indices[a],
+                interpolation[A][a]);
+        }
+      }
+    }
+  }
+
+  /*Galerkin coarse operator K_coarse = P^T*K*P. mmult/Tmmult rebuild the
+    (initially empty) sparsity patterns attached to KP and K_coarse.*/
+  KP.reinit(KP_pattern);
+  K_coarse.reinit(coarse_pattern);
+  K.mmult(KP, P);
+  P.Tmmult(K_coarse, KP);
+  KP.clear();
+
+  coarse_solver.initialize(K_coarse);
+
+  residual.reinit(dof_handler.n_dofs());
+  correction.reinit(dof_handler.n_dofs());
+  coarse_residual.reinit(dof_handler_linear.n_dofs());
+  coarse_correction.reinit(dof_handler_linear.n_dofs());
+}
+
+// SSOR smoothing steps on the fine level, starting from the current dst
+template <int dim>
+void PMultigrid<dim>::smooth(Vector<double> &dst,
+                             const Vector<double> &src) const {
+  for (unsigned int s = 0; s < n_smoothing_steps; s++) {
+    K_fine->residual(residual, dst, src); // residual = src - K*dst
+    K_fine->precondition_SSOR(correction, residual, omega);
+    dst += correction;
+  }
+}
+
+template <int dim>
+void PMultigrid<dim>::vmult(Vector<double> &dst,
+                            const Vector<double> &src) const {
+  dst = 0.;
+
+  // Pre-smoothing
+  smooth(dst, src);
+
+  // Restrict the residual, solve on the linear space and prolong the correction
+  K_fine->residual(residual, dst, src);
+  P.Tvmult(coarse_residual, residual);
+  coarse_solver.vmult(coarse_correction, coarse_residual);
+  P.vmult(correction, coarse_correction);
+  dst += correction;
+
+  // Post-smoothing
+  smooth(dst, src);
+}
+
+#endif
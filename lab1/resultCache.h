@@ -0,0 +1,230 @@
+#ifndef RESULTCACHE_H_
+#define RESULTCACHE_H_
+#include <deal.II/base/config.h>
+#include <deal.II/base/exceptions.h>
+#include <deal.II/lac/vector.h>
+// Standard C++ libraries
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+// RESULT_CACHE_CODE_VERSION, generated by CMakeLists.txt (codeVersion.cmake)
+#if defined(__has_include)
+#if __has_include("codeVersion.h")
+#include "codeVersion.h"
+#endif
+#endif
+using namespace dealii;
+
+/*Results of earlier runs on local disk, keyed by everything that defines a
+  run, so an identical rerun can skip meshing, assembly and solving.
+
+  The inputs are added one by one, by name, into a canonical text (doubles in
+  hexadecimal, so they are exact); input files (add_file) by a hash of their
+  contents, so a changed file is a new run even under the same name. The
+  first line is the code version: RESULT_CACHE_CODE_VERSION, a SHA-256
+  digest of the lab1 sources that the build writes to codeVersion.h (the FEM
+  classes are header-only, so it covers all the code), and the deal.II
+  version. Changing the code starts a new cache; rebuilding the same code
+  does not. Built without codeVersion.h the cache is disabled: load() always
+  misses and store() does nothing.
+  The file name is a 64 bit FNV-1a hash of the text, and the file also holds
+  the text itself, so load() only accepts a file whose inputs match exactly;
+  a hash collision, a truncated file or a file from another build is a miss.
+
+  store() writes to a temporary file and renames it, so concurrent runs
+  (e.g. a parameter sweep) never see a partial entry. Old entries are never
+  used again once the code changes; delete the directory to reclaim the
+  space. The files are in the machine's byte order: a local cache.*/
+class ResultCache {
+public:
+  ResultCache(const std::string &directory = "resultCache");
+
+  // Add one input of the run; the order of the calls is part of the key
+  void add_input(const std::string &name, const std::string &value);
+  void add_input(const std::string &name, double value);
+  template <typename Integer,
+            typename = typename std::enable_if<std::is_integral<Integer>::value>::type>
+  void add_input(const std::string &name, Integer value) {
+    add_input(name, std::to_string(value));
+  }
+  // An input file, by its name and a hash of its contents ("" for none)
+  void add_file(const std::string &name, const std::string &filename);
+
+  // File name of the inputs added so far
+  std::string key() const;
+
+  // The stored solution and named results, if this run is in the cache
+  bool load(Vector<double> &D, std::map<std::string, double> &results) const;
+  // Store them (a failure only prints a warning: the cache is optional)
+  void store(const Vector<double> &D,
+             const std::map<std::string, double> &results) const;
+
+  std::string directory;
+  std::string inputs; // Canonical text of the inputs
+  bool enabled;       // The code version is known
+
+private:
+  std::string path() const { return directory + "/" + key() + ".bin"; }
+};
+
+namespace result_cache {
+// 64 bit FNV-1a hash, continued from "hash"
+inline std::uint64_t fnv1a(const char *data, std::size_t size,
+                           std::uint64_t hash = 14695981039346656037ull) {
+  for (std::size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ull; // FNV prime
+  }
+  return hash;
+}
+inline std::string hex(std::uint64_t hash) {
+  char text[17];
+  std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+  return text;
+}
+} // namespace result_cache
+
+inline ResultCache::ResultCache(const std::string &cache_directory)
+    : directory(cache_directory) {
+#ifdef RESULT_CACHE_CODE_VERSION
+  enabled = true;
+  inputs = std::string("code ") + RESULT_CACHE_CODE_VERSION + " deal.II " +
+           DEAL_II_PACKAGE_VERSION + "\n";
+#else
+  enabled = false;
+  inputs = "code unknown\n";
+#endif
+}
+
+inline void ResultCache::add_input(const std::string &name,
+                                   const std::string &value) {
+  AssertThrow(name.find_first_of(" \n") == std::string::npos &&
+                  value.find('\n') == std::string::npos,
+              ExcMessage("Result cache inputs are single-line name/value pairs"));
+  inputs += name + " " + value + "\n";
+}
+
+inline void ResultCache::add_input(const std::string &name, double value) {
+  std::ostringstream text;
+  text << std::hexfloat << value;
+  add_input(name, text.str());
+}
+
+inline void ResultCache::add_file(const std::string &name,
+                                  const std::string &filename) {
+  if (filename.empty()) {
+    add_input(name, filename);
+    return;
+  }
+  std::ifstream in(filename, std::ios::binary);
+  std::uint64_t hash = 14695981039346656037ull;
+  char chunk[1 << 16];
+  while (in.read(chunk, sizeof(chunk)) || in.gcount() > 0) {
+    hash = result_cache::fnv1a(chunk, in.gcount(), hash);
+  }
+  add_input(name, filename + " " +
+                      (in.eof() ? result_cache::hex(hash) : "unreadable"));
+}
+
+inline std::string ResultCache::key() const {
+  return result_cache::hex(result_cache::fnv1a(inputs.data(), inputs.size()));
+}
+
+namespace result_cache {
+// Unformatted reads and writes of sizes, doubles and strings
+template <typename T> void write(std::ostream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+template <typename T> bool read(std::istream &in, T &value) {
+  return bool(in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+inline void write_string(std::ostream &out, const std::string &text) {
+  write(out, std::uint64_t(text.size()));
+  out.write(text.data(), text.size());
+}
+inline bool read_string(std::istream &in, std::string &text) {
+  std::uint64_t size;
+  if (!read(in, size) || size > (std::uint64_t(1) << 30)) return false;
+  text.resize(size);
+  return bool(in.read(&text[0], size));
+}
+const std::string magic = "result cache 1";
+} // namespace result_cache
+
+inline bool ResultCache::load(Vector<double> &D,
+                              std::map<std::string, double> &results) const {
+  using namespace result_cache;
+  if (!enabled) return false;
+  std::ifstream in(path(), std::ios::binary);
+  if (!in) return false;
+
+  std::string text;
+  if (!read_string(in, text) || text != magic) return false;
+  if (!read_string(in, text) || text != inputs) return false;
+
+  std::uint64_t n_results, n;
+  if (!read(in, n_results)) return false;
+  std::map<std::string, double> stored_results;
+  for (std::uint64_t k = 0; k < n_results; k++) {
+    double value;
+    if (!read_string(in, text) || !read(in, value)) return false;
+    stored_results[text] = value;
+  }
+  if (!read(in, n) || n > (std::uint64_t(1) << 32)) return false;
+  Vector<double> stored_D(n);
+  for (std::uint64_t i = 0; i < n; i++) {
+    if (!read(in, stored_D[i])) return false;
+  }
+
+  D = stored_D;
+  results = stored_results;
+  return true;
+}
+
+inline void ResultCache::store(
+    const Vector<double> &D,
+    const std::map<std::string, double> &results) const {
+  using namespace result_cache;
+  if (!enabled) return;
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  const std::string final_path = path();
+  const std::string temporary_path =
+      final_path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream out(temporary_path, std::ios::binary);
+    write_string(out, magic);
+    write_string(out, inputs);
+    write(out, std::uint64_t(results.size()));
+    std::map<std::string, double>::const_iterator result;
+    for (result = results.begin(); result != results.end(); ++result) {
+      write_string(out, result->first);
+      write(out, result->second);
+    }
+    write(out, std::uint64_t(D.size()));
+    for (unsigned int i = 0; i < D.size(); i++) {
+      write(out, D[i]);
+    }
+    if (!out) {
+      std::cout << "   Warning: could not write " << temporary_path << std::endl;
+      std::filesystem::remove(temporary_path, error);
+      return;
+    }
+  }
+  // Atomic on POSIX: readers see the old state or the whole new file
+  std::filesystem::rename(temporary_path, final_path, error);
+  if (error) {
+    std::cout << "   Warning: could not store " << final_path << ": "
+              << error.message() << std::endl;
+    std::filesystem::remove(temporary_path, error);
+  }
+}
+
+#endif
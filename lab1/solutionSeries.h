@@ -0,0 +1,553 @@
+#ifndef SOLUTIONSERIES_H_
+#define SOLUTIONSERIES_H_
+#include <hdf5.h>
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/table.h>
+#include <deal.II/dofs/dof_handler.h>
+#include <deal.II/lac/vector.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace dealii;
+
+/*Many solutions on one mesh (the steps of a transient run, the iterations of
+  an optimization, the runs of a parameter sweep, the modes of an eigenvalue
+  problem) in a single HDF5 file, <tag>.h5, with an XDMF file, <tag>.xdmf,
+  that ParaView or VisIt open as a time series.
+
+  The mesh is written once:
+    /mesh/points  n_points x 3 coordinates (doubles),
+    /mesh/cells   n_cells x nodes_per_cell node numbers (64 bit, so any dof
+                  index fits);
+  and every field is one dataset with a row per step, extended as the steps
+  come and stored in chunks of one row:
+    /fields/<name>  n_steps x n_points (nodal) or n_steps x n_cells (cell),
+    /time           n_steps step times (or parameter values).
+  So the file grows by the size of the data of a step and nothing is
+  rewritten. The XDMF file refers to the datasets by path and to a step by
+  its row. After each step the HDF5 file is flushed and the step's <Grid> is
+  appended to the XDMF file (in place of its closing tags, which follow it
+  again), so a run can be watched, or survive a crash, up to its last
+  complete step. As a grid gives the number of rows its fields had when it
+  was written, close() writes the XDMF file once more, with the final
+  numbers (to a temporary file and renamed, so a viewer never reads half of
+  it); so does the first step after reopening a series.
+
+  Every step holds the same fields, those added in the first step. With
+  append = true an existing series is reopened and continued (e.g. one run
+  of a sweep per process, one after the other; HDF5 does not allow two
+  writers at once); its mesh must have the same size as the new one.
+
+  A node is a dof: the fields are FEM::D, indexed by dof, or vectors indexed
+  by active cell index.*/
+class SolutionSeries {
+public:
+  SolutionSeries(const std::string &tag, bool append = false);
+  ~SolutionSeries();
+
+  // Points (3 coordinates each) and cells (nodes_per_cell node numbers each)
+  // of an XDMF topology ("Polyline", "Quadrilateral", "Hexahedron", ...)
+  void write_mesh(const std::vector<double> &points,
+                  const std::vector<unsigned long long> &cells,
+                  unsigned int nodes_per_cell, const std::string &topology);
+  // Linear quads/hexes or simplices with nodeLocation[dof][i] (lab2)
+  template <int dim>
+  void write_mesh(const DoFHandler<dim> &dof_handler,
+                  const Table<2, double> &nodeLocation);
+  // Bar elements of any order with nodeLocation[dof] = x (lab1), split into
+  // two-node segments between neighboring nodes
+  void write_mesh(const DoFHandler<1> &dof_handler,
+                  const std::vector<double> &nodeLocation);
+
+  // Start a step; the fields added next belong to it
+  void add_step(double time);
+  // A nodal field (one value per point) or a cell field (one per cell)
+  void add_field(const std::string &name, const Vector<double> &values);
+  // Finish the last step and close the file (also done by the destructor)
+  void close();
+
+  unsigned int n_steps() const { return times.size(); }
+
+  std::string h5_file, xdmf_file;
+
+private:
+  struct Field {
+    std::string name;
+    bool on_cells;
+  };
+
+  bool step_complete() const {
+    return std::find(step_fields.begin(), step_fields.end(), false) ==
+           step_fields.end();
+  }
+  void finish_step();
+  void write_xdmf();
+  void append_xdmf();
+  void write_xdmf_grid(std::ostream &out, unsigned int step,
+                       hsize_t rows) const;
+  hid_t create_extendible(const std::string &path, hsize_t columns);
+  void append_row(hid_t dataset, hsize_t row, hsize_t columns,
+                  const double *values);
+  void read_existing();
+  void set_rows(hsize_t n_rows);
+
+  hid_t file;
+  hsize_t n_points, n_cells, nodes_per_cell;
+  std::string topology;
+  std::vector<Field> fields;
+  std::vector<double> times;
+  std::vector<bool> step_fields; // Fields already added to the current step
+  bool step_open;
+  unsigned int xdmf_steps; // Steps in the XDMF file
+};
+
+namespace solution_series {
+// Values per HDF5 chunk of /time (a field has one row per chunk)
+const hsize_t time_chunk = 256;
+// End of the XDMF file, after the grid of the last step
+const std::string xdmf_tail = "  </Grid>\n </Domain>\n</Xdmf>\n";
+
+inline void write_string_attribute(hid_t object, const std::string &name,
+                                   const std::string &value) {
+  hid_t type = H5Tcopy(H5T_C_S1);
+  H5Tset_size(type, value.size());
+  hid_t space = H5Screate(H5S_SCALAR);
+  hid_t attribute =
+      H5Acreate(object, name.c_str(), type, space, H5P_DEFAULT, H5P_DEFAULT);
+  H5Awrite(attribute, type, value.c_str());
+  H5Aclose(attribute);
+  H5Sclose(space);
+  H5Tclose(type);
+}
+
+inline std::string read_string_attribute(hid_t object,
+                                         const std::string &name) {
+  hid_t attribute = H5Aopen(object, name.c_str(), H5P_DEFAULT);
+  AssertThrow(attribute >= 0, ExcMessage("Missing HDF5 attribute " + name));
+  hid_t type = H5Aget_type(attribute);
+  std::string value(H5Tget_size(type), '\0');
+  H5Aread(attribute, type, &value[0]);
+  H5Tclose(type);
+  H5Aclose(attribute);
+  return value.substr(0, value.find('\0'));
+}
+
+inline hsize_t rows(hid_t dataset) {
+  hid_t space = H5Dget_space(dataset);
+  hsize_t dims[2] = {0, 0};
+  H5Sget_simple_extent_dims(space, dims, NULL);
+  H5Sclose(space);
+  return dims[0];
+}
+
+inline herr_t collect_name(hid_t, const char *name, const H5L_info_t *,
+                           void *names) {
+  static_cast<std::vector<std::string> *>(names)->push_back(name);
+  return 0;
+}
+} // namespace solution_series
+
+inline SolutionSeries::SolutionSeries(const std::string &tag, bool append)
+    : h5_file(tag + ".h5"), xdmf_file(tag + ".xdmf"), file(-1), n_points(0),
+      n_cells(0), nodes_per_cell(0), step_open(false), xdmf_steps(0) {
+  std::ifstream existing(h5_file);
+  if (append && existing) {
+    existing.close();
+    file = H5Fopen(h5_file.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+    AssertThrow(file >= 0, ExcMessage("Could not open " + h5_file));
+    read_existing();
+  } else {
+    file = H5Fcreate(h5_file.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    AssertThrow(file >= 0, ExcMessage("Could not create " + h5_file));
+    H5Gclose(H5Gcreate(file, "/mesh", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+    H5Gclose(H5Gcreate(file, "/fields", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+    H5Dclose(create_extendible("/time", 0));
+  }
+}
+
+inline SolutionSeries::~SolutionSeries() {
+  try {
+    close();
+  } catch (std::exception &exc) {
+    std::cerr << "   Warning: " << h5_file << ": " << exc.what() << std::endl;
+  }
+}
+
+inline void SolutionSeries::close() {
+  if (file < 0) return;
+  const bool complete = !step_open || step_complete();
+  if (step_open && complete) finish_step();
+  if (!complete) {
+    times.pop_back();
+    set_rows(times.size());
+  }
+  step_open = false;
+  H5Fclose(file);
+  file = -1;
+  if (!times.empty()) write_xdmf();
+  AssertThrow(complete, ExcMessage("The last step of " + h5_file +
+                                   " is missing fields and was dropped"));
+}
+
+// Sizes, topology and fields of a series written earlier
+inline void SolutionSeries::read_existing() {
+  using namespace solution_series;
+  if (H5Lexists(file, "/mesh/cells", H5P_DEFAULT) > 0) {
+    hid_t cells = H5Dopen(file, "/mesh/cells", H5P_DEFAULT);
+    hid_t space = H5Dget_space(cells);
+    hsize_t dims[2];
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    n_cells = dims[0];
+    nodes_per_cell = dims[1];
+    topology = read_string_attribute(cells, "topology");
+    H5Dclose(cells);
+    hid_t points = H5Dopen(file, "/mesh/points", H5P_DEFAULT);
+    n_points = rows(points);
+    H5Dclose(points);
+  }
+
+  AssertThrow(H5Lexists(file, "/time", H5P_DEFAULT) > 0,
+              ExcMessage(h5_file + " is not a solution series"));
+  hid_t time = H5Dopen(file, "/time", H5P_DEFAULT);
+  times.resize(rows(time));
+  if (!times.empty()) {
+    H5Dread(time, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &times[0]);
+  }
+  H5Dclose(time);
+
+  std::vector<std::string> names;
+  hid_t group = H5Gopen(file, "/fields", H5P_DEFAULT);
+  H5Literate(group, H5_INDEX_NAME, H5_ITER_NATIVE, NULL, collect_name,
+             &names);
+  for (unsigned int k = 0; k < names.size(); k++) {
+    hid_t dataset = H5Dopen(group, names[k].c_str(), H5P_DEFAULT);
+    Field field;
+    field.name = names[k];
+    field.on_cells = read_string_attribute(dataset, "center") == "Cell";
+    // A step that was not finished (a crash while writing it) is dropped
+    times.resize(std::min<hsize_t>(times.size(), rows(dataset)));
+    fields.push_back(field);
+    H5Dclose(dataset);
+  }
+  H5Gclose(group);
+  set_rows(times.size());
+}
+
+// Cut /time and the fields to n_rows steps
+inline void SolutionSeries::set_rows(hsize_t n_rows) {
+  std::vector<std::string> paths(1, "/time");
+  for (unsigned int k = 0; k < fields.size(); k++) {
+    paths.push_back("/fields/" + fields[k].name);
+  }
+  for (unsigned int k = 0; k < paths.size(); k++) {
+    hid_t dataset = H5Dopen(file, paths[k].c_str(), H5P_DEFAULT);
+    hid_t space = H5Dget_space(dataset);
+    hsize_t dims[2] = {0, 0};
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    if (dims[0] > n_rows) {
+      dims[0] = n_rows;
+      H5Dset_extent(dataset, dims);
+    }
+    H5Dclose(dataset);
+  }
+}
+
+inline void
+SolutionSeries::write_mesh(const std::vector<double> &points,
+                           const std::vector<unsigned long long> &cells,
+                           unsigned int n_nodes_per_cell,
+                           const std::string &cell_topology) {
+  AssertThrow(file >= 0, ExcMessage(h5_file + " is closed"));
+  AssertThrow(points.size() % 3 == 0 && n_nodes_per_cell > 0 &&
+                  cells.size() % n_nodes_per_cell == 0,
+              ExcMessage("Points need 3 coordinates and cells all their nodes"));
+  if (nodes_per_cell > 0) {
+    // Appending: the mesh is already in the file
+    AssertThrow(n_points == points.size() / 3 &&
+                    n_cells == cells.size() / n_nodes_per_cell &&
+                    nodes_per_cell == n_nodes_per_cell,
+                ExcMessage("The mesh differs from the one in " + h5_file));
+    return;
+  }
+  n_points = points.size() / 3;
+  n_cells = cells.size() / n_nodes_per_cell;
+  nodes_per_cell = n_nodes_per_cell;
+  topology = cell_topology;
+
+  hsize_t dims[2] = {n_points, 3};
+  hid_t space = H5Screate_simple(2, dims, NULL);
+  hid_t dataset = H5Dcreate(file, "/mesh/points", H5T_IEEE_F64LE, space,
+                            H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+  H5Dwrite(dataset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+           points.data());
+  H5Dclose(dataset);
+  H5Sclose(space);
+
+  dims[0] = n_cells;
+  dims[1] = nodes_per_cell;
+  space = H5Screate_simple(2, dims, NULL);
+  dataset = H5Dcreate(file, "/mesh/cells", H5T_STD_U64LE, space, H5P_DEFAULT,
+                      H5P_DEFAULT, H5P_DEFAULT);
+  H5Dwrite(dataset, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+           cells.data());
+  solution_series::write_string_attribute(dataset, "topology", topology);
+  H5Dclose(dataset);
+  H5Sclose(space);
+}
+
+template <int dim>
+void SolutionSeries::write_mesh(const DoFHandler<dim> &dof_handler,
+                                const Table<2, double> &nodeLocation) {
+  std::vector<double> points(3 * nodeLocation.size(0), 0.);
+  for (unsigned int i = 0; i < nodeLocation.size(0); i++) {
+    for (unsigned int j = 0; j < dim; j++) {
+      points[3 * i + j] = nodeLocation[i][j];
+    }
+  }
+
+  // deal.II numbers the vertices of a quad/hex lexicographically, XDMF
+  // around each face; simplices are numbered the same way in both
+  const ReferenceCell reference_cell = dof_handler.get_fe().reference_cell();
+  const unsigned int n_nodes = dof_handler.get_fe().dofs_per_cell;
+  std::vector<unsigned int> order(n_nodes);
+  for (unsigned int A = 0; A < n_nodes; A++) {
+    order[A] = A;
+  }
+  std::string cell_topology;
+  if (reference_cell.is_hyper_cube()) {
+    AssertThrow(n_nodes == (1u << dim),
+                ExcMessage("Only linear elements can be written"));
+    const unsigned int hypercube_order[] = {0, 1, 3, 2, 4, 5, 7, 6};
+    std::copy(hypercube_order, hypercube_order + n_nodes, order.begin());
+    cell_topology = (dim == 2) ? "Quadrilateral" : "Hexahedron";
+  } else {
+    AssertThrow(n_nodes == dim + 1,
+                ExcMessage("Only linear elements can be written"));
+    cell_topology = (dim == 2) ? "Triangle" : "Tetrahedron";
+  }
+
+  std::vector<unsigned long long> cells;
+  cells.reserve(dof_handler.get_triangulation().n_active_cells() * n_nodes);
+  std::vector<types::global_dof_index> local_dof_indices(n_nodes);
+  typename DoFHandler<dim>::active_cell_iterator elem = dof_handler.begin_active(),
+                                                 endc = dof_handler.end();
+  for (; elem != endc; ++elem) {
+    elem->get_dof_indices(local_dof_indices);
+    for (unsigned int A = 0; A < n_nodes; A++) {
+      cells.push_back(local_dof_indices[order[A]]);
+    }
+  }
+  write_mesh(points, cells, n_nodes, cell_topology);
+}
+
+inline void SolutionSeries::write_mesh(const DoFHandler<1> &dof_handler,
+                                       const std::vector<double> &nodeLocation) {
+  std::vector<double> points(3 * nodeLocation.size(), 0.);
+  for (unsigned int i = 0; i < nodeLocation.size(); i++) {
+    points[3 * i] = nodeLocation[i];
+  }
+
+  // Segments between the nodes of each element, sorted by x
+  const unsigned int n_nodes = dof_handler.get_fe().dofs_per_cell;
+  std::vector<types::global_dof_index> local_dof_indices(n_nodes);
+  std::vector<unsigned long long> cells;
+  cells.reserve(2 * dof_handler.get_triangulation().n_active_cells() *
+                (n_nodes - 1));
+  DoFHandler<1>::active_cell_iterator elem = dof_handler.begin_active(),
+                                      endc = dof_handler.end();
+  for (; elem != endc; ++elem) {
+    elem->get_dof_indices(local_dof_indices);
+    std::sort(local_dof_indices.begin(), local_dof_indices.end(),
+              [&](types::global_dof_index a, types::global_dof_index b) {
+                return nodeLocation[a] < nodeLocation[b];
+              });
+    for (unsigned int A = 0; A + 1 < n_nodes; A++) {
+      cells.push_back(local_dof_indices[A]);
+      cells.push_back(local_dof_indices[A + 1]);
+    }
+  }
+  write_mesh(points, cells, 2, "Polyline");
+}
+
+inline void SolutionSeries::add_step(double time) {
+  AssertThrow(file >= 0, ExcMessage(h5_file + " is closed"));
+  AssertThrow(nodes_per_cell > 0,
+              ExcMessage("write_mesh() comes before the first step"));
+  if (step_open) finish_step();
+
+  hid_t dataset = H5Dopen(file, "/time", H5P_DEFAULT);
+  append_row(dataset, times.size(), 1, &time);
+  H5Dclose(dataset);
+  times.push_back(time);
+  step_fields.assign(fields.size(), false);
+  step_open = true;
+}
+
+inline void SolutionSeries::add_field(const std::string &name,
+                                      const Vector<double> &values) {
+  AssertThrow(step_open, ExcMessage("add_step() comes before the fields"));
+  AssertThrow(values.size() == n_points || values.size() == n_cells,
+              ExcMessage("Field " + name + " has neither one value per point "
+                         "nor one per cell"));
+  unsigned int k = 0;
+  while (k < fields.size() && fields[k].name != name) k++;
+  const std::string path = "/fields/" + name;
+  hid_t dataset;
+  if (k == fields.size()) {
+    AssertThrow(times.size() == 1, ExcMessage("Field " + name + " was not in "
+                                              "the first step"));
+    Field field;
+    field.name = name;
+    field.on_cells = (values.size() != n_points);
+    fields.push_back(field);
+    step_fields.push_back(false);
+    dataset = create_extendible(path, values.size());
+    solution_series::write_string_attribute(dataset, "center",
+                                            field.on_cells ? "Cell" : "Node");
+  } else {
+    AssertThrow(!step_fields[k],
+                ExcMessage("Field " + name + " was already added to this step"));
+    dataset = H5Dopen(file, path.c_str(), H5P_DEFAULT);
+  }
+  append_row(dataset, times.size() - 1, values.size(), values.begin());
+  H5Dclose(dataset);
+  step_fields[k] = true;
+}
+
+// Check that the step is complete, then flush it and describe it in the XDMF
+inline void SolutionSeries::finish_step() {
+  AssertThrow(step_complete(),
+              ExcMessage("A step of " + h5_file + " is missing fields"));
+  step_open = false;
+  H5Fflush(file, H5F_SCOPE_GLOBAL);
+  if (xdmf_steps > 0 && xdmf_steps + 1 == times.size()) {
+    append_xdmf();
+  } else {
+    write_xdmf();
+  }
+}
+
+// Empty n x columns dataset (1D if columns is 0) that grows by rows
+inline hid_t SolutionSeries::create_extendible(const std::string &path,
+                                               hsize_t columns) {
+  const int rank = (columns > 0) ? 2 : 1;
+  hsize_t dims[2] = {0, columns}, max_dims[2] = {H5S_UNLIMITED, columns};
+  hsize_t chunk[2] = {(columns > 0) ? 1 : solution_series::time_chunk,
+                      columns};
+  hid_t space = H5Screate_simple(rank, dims, max_dims);
+  hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+  H5Pset_chunk(properties, rank, chunk);
+  hid_t dataset = H5Dcreate(file, path.c_str(), H5T_IEEE_F64LE, space,
+                            H5P_DEFAULT, properties, H5P_DEFAULT);
+  H5Pclose(properties);
+  H5Sclose(space);
+  AssertThrow(dataset >= 0, ExcMessage("Could not create " + path));
+  return dataset;
+}
+
+// Write row "row" of a dataset made by create_extendible, growing it if needed
+inline void SolutionSeries::append_row(hid_t dataset, hsize_t row,
+                                       hsize_t columns, const double *values) {
+  hid_t space = H5Dget_space(dataset);
+  const int rank = H5Sget_simple_extent_ndims(space);
+  hsize_t dims[2] = {0, 0};
+  H5Sget_simple_extent_dims(space, dims, NULL);
+  H5Sclose(space);
+  if (dims[0] <= row) {
+    dims[0] = row + 1;
+    H5Dset_extent(dataset, dims);
+  }
+  hsize_t start[2] = {row, 0}, count[2] = {1, columns};
+  space = H5Dget_space(dataset);
+  H5Sselect_hyperslab(space, H5S_SELECT_SET, start, NULL, count, NULL);
+  hid_t memory_space = H5Screate_simple(1, &columns, NULL);
+  const herr_t status = H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memory_space,
+                                 space, H5P_DEFAULT, values);
+  H5Sclose(memory_space);
+  H5Sclose(space);
+  AssertThrow(status >= 0 && rank >= 1,
+              ExcMessage("Could not write to " + h5_file));
+}
+
+// All the steps, each with the final number of rows of the fields
+inline void SolutionSeries::write_xdmf() {
+  const std::string temporary_file = xdmf_file + ".tmp";
+  std::ofstream out(temporary_file);
+  out.precision(17);
+  out << "<?xml version=\"1.0\" ?>\n"
+      << "<Xdmf Version=\"3.0\">\n <Domain>\n"
+      << "  <Grid Name=\"series\" GridType=\"Collection\" "
+         "CollectionType=\"Temporal\">\n";
+  for (unsigned int step = 0; step < times.size(); step++) {
+    write_xdmf_grid(out, step, times.size());
+  }
+  out << solution_series::xdmf_tail;
+  out.close();
+  xdmf_steps = times.size();
+  if (!out || std::rename(temporary_file.c_str(), xdmf_file.c_str()) != 0) {
+    std::cout << "   Warning: could not write " << xdmf_file << std::endl;
+    xdmf_steps = 0;
+  }
+}
+
+// The last step, over the closing tags of the file written so far
+inline void SolutionSeries::append_xdmf() {
+  std::fstream out(xdmf_file, std::ios::in | std::ios::out);
+  out.seekp(-std::streamoff(solution_series::xdmf_tail.size()), std::ios::end);
+  out.precision(17);
+  write_xdmf_grid(out, times.size() - 1, times.size());
+  out << solution_series::xdmf_tail;
+  out.close();
+  if (out) {
+    xdmf_steps = times.size();
+  } else {
+    write_xdmf();
+  }
+}
+
+// The <Grid> of a step, while the fields have "rows" rows
+inline void SolutionSeries::write_xdmf_grid(std::ostream &out,
+                                            unsigned int step,
+                                            hsize_t rows) const {
+  // The HDF5 file is referred to by its name, relative to the XDMF file
+  const std::string h5_name = h5_file.substr(h5_file.find_last_of('/') + 1);
+  out << "   <Grid Name=\"step" << step << "\" GridType=\"Uniform\">\n"
+      << "    <Time Value=\"" << times[step] << "\"/>\n"
+      << "    <Topology TopologyType=\"" << topology
+      << "\" NumberOfElements=\"" << n_cells << "\" NodesPerElement=\""
+      << nodes_per_cell << "\">\n"
+      << "     <DataItem Dimensions=\"" << n_cells << " " << nodes_per_cell
+      << "\" NumberType=\"UInt\" Precision=\"8\" Format=\"HDF\">" << h5_name
+      << ":/mesh/cells</DataItem>\n"
+      << "    </Topology>\n"
+      << "    <Geometry GeometryType=\"XYZ\">\n"
+      << "     <DataItem Dimensions=\"" << n_points
+      << " 3\" NumberType=\"Float\" Precision=\"8\" Format=\"HDF\">"
+      << h5_name << ":/mesh/points</DataItem>\n"
+      << "    </Geometry>\n";
+  for (unsigned int k = 0; k < fields.size(); k++) {
+    const hsize_t n = fields[k].on_cells ? n_cells : n_points;
+    // Row "step" of the field's dataset
+    out << "    <Attribute Name=\"" << fields[k].name
+        << "\" AttributeType=\"Scalar\" Center=\""
+        << (fields[k].on_cells ? "Cell" : "Node") << "\">\n"
+        << "     <DataItem ItemType=\"HyperSlab\" Dimensions=\"1 " << n
+        << "\">\n"
+        << "      <DataItem Dimensions=\"3 2\" Format=\"XML\">" << step
+        << " 0 1 1 1 " << n << "</DataItem>\n"
+        << "      <DataItem Dimensions=\"" << rows << " " << n
+        << "\" NumberType=\"Float\" Precision=\"8\" Format=\"HDF\">"
+        << h5_name << ":/fields/" << fields[k].name << "</DataItem>\n"
+        << "     </DataItem>\n"
+        << "    </Attribute>\n";
+  }
+  out << "   </Grid>\n";
+}
+
+#endif
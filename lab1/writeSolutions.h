@@ -39,4 +39,35 @@ void writeSolutionsToFileCA1(const Vector<double>& U, double l2Norm, std::string
   status = H5Fclose(file_id);
 }
 
+//read the "U" data set written by writeSolutionsToFileCA1, e.g. to warm start a solve
+void readSolutionFromFileCA1(Vector<double>& U, std::string solutionTag){
+  hid_t file_id, dataset_id, dataspace_id;
+  herr_t      status;
+  hsize_t dimens_1d;
+  std::cout << "reading solution for Coding Assignment 1 from file : " << solutionTag.c_str() << ".h5" << std::endl;
+
+  //open HDF5 file
+  std::string solutionFileName(solutionTag); solutionFileName +=  ".h5";
+  file_id = H5Fopen (solutionFileName.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  AssertThrow(file_id >= 0, ExcMessage("Could not open " + solutionFileName));
+
+  //read solution vector from data set
+  dataset_id = H5Dopen(file_id, "U", H5P_DEFAULT);
+  AssertThrow(dataset_id >= 0, ExcMessage("No data set U in " + solutionFileName));
+  dataspace_id = H5Dget_space(dataset_id);
+  H5Sget_simple_extent_dims(dataspace_id, &dimens_1d, NULL);
+  std::vector<double> solutionVector(dimens_1d);
+  status = H5Dread(dataset_id, H5T_IEEE_F64LE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &solutionVector[0]);
+  status = H5Sclose(dataspace_id);
+  status = H5Dclose(dataset_id);
+
+  //close HDF5 file
+  status = H5Fclose(file_id);
+
+  U.reinit(dimens_1d);
+  for (unsigned int i=0; i<U.size(); i++){
+    U(i)=solutionVector[i];
+  }
+}
+
 #endif
\ No newline at end of file
@@ -2,7 +2,9 @@
 #include <deal.II/base/function.h>
 #include <deal.II/base/logstream.h>
 #include <deal.II/base/quadrature_lib.h>
+#include <deal.II/base/aligned_vector.h>
 #include <deal.II/base/tensor_function.h>
+#include <deal.II/base/work_stream.h>
 #include <deal.II/lac/full_matrix.h>
 #include <deal.II/lac/sparse_direct.h>
 #include <deal.II/lac/sparse_matrix.h>
@@ -13,29 +15,40 @@
 // Mesh related classes
 #include <deal.II/dofs/dof_accessor.h>
 #include <deal.II/dofs/dof_handler.h>
+#include <deal.II/dofs/dof_renumbering.h>
 #include <deal.II/dofs/dof_tools.h>
 #include <deal.II/grid/grid_generator.h>
 #include <deal.II/grid/grid_tools.h>
+#include <deal.II/grid/reference_cell.h>
 #include <deal.II/grid/tria.h>
 #include <deal.II/grid/tria_accessor.h>
 #include <deal.II/grid/tria_iterator.h>
 // Finite element implementation classes
 #include <deal.II/fe/fe_q.h>
+#include <deal.II/fe/fe_simplex_p.h>
 #include <deal.II/fe/fe_system.h>
 #include <deal.II/fe/fe_values.h>
 // Standard C++ libraries
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "../../lab1/dofIndices.h"
+#include "../../lab1/lanczos.h"
+#include "cellBatch.h"
+#include "asyncFileWriter.h"
+#include "geometryCache.h"
+#include "meshImport.h"
+
 using namespace dealii;
 
-template <int dim> class FEM {
+template <int dim, typename IndexType = unsigned int> class FEM {
 public:
   // Class functions
-  FEM();  // Class constructor
+  FEM(bool simplex = false); // Class constructor
   ~FEM(); // Class destructor
 
   // Define your 2D basis functions and derivatives
@@ -46,12 +59,83 @@ public:
 
   // Solution steps
   void generate_mesh(std::vector<unsigned int> numberOfElements);
+  void import_mesh(const std::string &filename);
   void define_boundary_conds();
   void setup_system();
   void assemble_system();
+  // Klocal of quads/hexes computed several elements at a time (cellBatch.h)
+  void assemble_system_batched();
+  /*F alone, for new heat sources or Dirichlet values with K (and the set of
+    Dirichlet dofs) unchanged since assemble_system(); solve() then reuses the
+    factorization of K*/
+  void assemble_rhs();
   void solve();
   void output_results();
 
+  // Nodal heat flux -kappa*grad(T), recovered from the solution D
+  void compute_heat_flux();
+  void tabulate_basis(std::vector<double> &weight,
+                      std::vector<std::vector<double>> &N,
+                      std::vector<std::vector<std::vector<double>>> &dN);
+
+  /*Adjoint sensitivities of a quantity of interest J = j.D (e.g. the average
+    temperature on a sensor boundary) to the conductivity of every element and
+    to the Dirichlet values, from one extra solve with the factorization kept
+    from solve()*/
+  Vector<double> sensor_functional(types::boundary_id sensor);
+  void compute_sensitivities(const Vector<double> &j);
+
+  /*Thermal decay modes: with the Dirichlet temperatures held, a disturbance
+    of the steady state decays as sum_k c_k*exp(-lambda_k*t)*x_k, where
+    K x_k = lambda_k M x_k. The slowest ones (closest to "shift") come from
+    shift-invert Lanczos. Call after assemble_system().*/
+  void assemble_mass_matrix();
+  void compute_modes(unsigned int n_modes, double shift = 0.);
+
+  // Conductivity of an element (from cell_conductivity or
+  // material_conductivity, if given)
+  double element_conductivity(
+      const typename DoFHandler<dim>::active_cell_iterator &elem) const;
+
+  // Heat source of an element (from material_heat_source, 0 if not given)
+  double element_heat_source(
+      const typename DoFHandler<dim>::active_cell_iterator &elem) const;
+  // Flocal of the heat source, with the Jacobians from "geometry"
+  void element_Flocal(const typename DoFHandler<dim>::active_cell_iterator &elem,
+                      const std::vector<IndexType> &local_dof_indices,
+                      Vector<double> &Flocal);
+  // Gather the faces on convection_boundaries (called by setup_system())
+  void setup_convection_faces();
+  // Kface = h*int N_a N_b dS, Fface = h*T_inf*int N_a dS of a convection face
+  void convection_face_terms(unsigned int face, FullMatrix<double> &Kface,
+                             Vector<double> &Fface) const;
+  // Add the convection terms of all convection faces to K and F
+  void assemble_convection();
+
+  // Closed-form Klocal for linear triangles/tetrahedra
+  void simplex_Klocal(const std::vector<IndexType> &local_dof_indices,
+                      const FullMatrix<double> &kappa,
+                      FullMatrix<double> &Klocal);
+  // Klocal from the full Gauss rule for quads/hexes, with the Jacobians from
+  // "geometry" (cached or recomputed)
+  void geometry_Klocal(unsigned int cell,
+                       const std::vector<IndexType> &local_dof_indices,
+                       const FullMatrix<double> &kappa,
+                       FullMatrix<double> &Klocal);
+  /*Klocal of the element with this active cell index, with whichever of the
+    above assemble_system() uses for this mesh, so K assembled elsewhere
+    (HybridSolver, TopologyOptimization) is bitwise the same*/
+  void element_Klocal(unsigned int cell,
+                      const std::vector<IndexType> &local_dof_indices,
+                      const FullMatrix<double> &kappa, FullMatrix<double> &Klocal);
+
+  // One-point (reduced) integration of Klocal with hourglass control
+  void reduced_integration_Klocal(const std::vector<IndexType> &local_dof_indices,
+                                  const FullMatrix<double> &kappa,
+                                  FullMatrix<double> &Klocal);
+  // Solve with both full and reduced integration and report the difference
+  double compare_reduced_integration();
+
   // Class objects
   Triangulation<dim> triangulation; // mesh
   FESystem<dim> fe;                 // FE element
@@ -62,6 +146,36 @@ public:
   std::vector<double> quad_points; // vector of Gauss quadrature points
   std::vector<double> quad_weight; // vector of the quadrature point weights
 
+  // Linear triangles (2D) / tetrahedra (3D) instead of quads/hexes
+  bool simplexElements;
+
+  /*Quads/hexes: assemble_system() computes the element stiffness matrices
+    VectorizedArray<double>::size() elements at a time with SIMD instructions
+    (cellBatch.h). Simplices and reduced integration keep the element by element loop.*/
+  bool batchedAssembly;
+
+  /*Jacobian data (detJ*w and the inverse Jacobian) of the elements at the
+    quadrature points of tabulate_basis, built by setup_system() (see
+    geometryCache.h). Up to geometryCacheMemory MB of it is stored, the rest
+    is recomputed when needed; 0 stores nothing.*/
+  GeometryCache<dim> geometry;
+  double geometryCacheMemory;
+
+  /*Reduced integration: Klocal from a single quadrature point at the element
+    center instead of the 2x2x2 rule, plus an hourglass stiffness scaled by
+    "hourglassStiffness" (1 reproduces full integration on rectangular boxes).*/
+  bool reducedIntegration;
+  double hourglassStiffness;
+
+  /*Set by HybridSolver (hybridSolver.h): setup_system() numbers the dofs
+    subdomain by subdomain and leaves K to the distributed solver*/
+  bool distributedSolve;
+  // With distributedSolve, the number of each dof in the serial numbering
+  std::vector<types::global_dof_index> serialDofIndex;
+  // With distributedSolve, the subdomain of this rank: the geometry cache
+  // holds its elements only, and only subdomain 0 prints the notes
+  types::subdomain_id ownedSubdomain;
+
   // Data structures
   SparsityPattern sparsity_pattern; // Sparse matrix pattern
   SparseMatrix<double> K;           // Global stiffness (sparse) matrix
@@ -69,18 +183,84 @@ public:
       F; // Global vectors - Solution vector (D) and Global force vector (F)
   Table<2, double>
       nodeLocation; // Table of the coordinates of nodes by global dof number
-  std::map<unsigned int, double>
+  std::map<IndexType, double>
       boundary_values; // Map of dirichlet boundary conditions
 
+  /*Optional, for imported meshes (or the colorized box, whose faces have the
+    boundary ids 0..2*dim-1 for x_min, x_max, y_min, ...): a fixed temperature
+    per boundary id and a conductivity per material id*/
+  std::map<types::boundary_id, double> dirichlet_temperatures;
+  std::map<types::material_id, double> material_conductivity;
+  // Optional conductivity per active cell (e.g. a design from
+  // topologyOptimization.h), used instead of material_conductivity if set
+  Vector<double> cell_conductivity;
+
+  /*Optional sources and convection: a volumetric heat source (W/m^3) per
+    material id, and on the boundaries in convection_boundaries a heat loss
+    h*(T - T_inf) per unit area, with (h, T_inf) per boundary id. Set both
+    before setup_system(), which gathers the convection faces.*/
+  std::map<types::material_id, double> material_heat_source;
+  std::map<types::boundary_id, std::pair<double, double>> convection_boundaries;
+
+  /*Faces on the convection boundaries, gathered by setup_system() with their
+    integrals int N_a N_b dS and int N_a dS, so assembly only loops over them*/
+  unsigned int n_convection_faces;
+  std::vector<IndexType> convection_face_dofs; // [face*dofs_per_face + a]
+  std::vector<types::boundary_id> convection_face_id;
+  std::vector<unsigned int> convection_face_cell; // Active cell index
+  std::vector<double> convection_face_mass; // [(face*dofs_per_face + a)*dofs_per_face + b]
+  std::vector<double> convection_face_integral; // [face*dofs_per_face + a]
+
+  // Basis functions N[q][A] at the points of tabulate_basis (setup_system())
+  std::vector<std::vector<double>> shape_values;
+
+  std::vector<Vector<double>> heat_flux; // Nodal heat flux, one vector per component
+
+  // Adjoint solution and sensitivities: dJ/dkappa by active cell index, dJ/dg
+  // by Dirichlet dof and summed over each boundary id of dirichlet_temperatures
+  Vector<double> Z;
+  Vector<double> kappa_sensitivity;
+  std::map<IndexType, double> dirichlet_sensitivity;
+  std::map<types::boundary_id, double> boundary_temperature_sensitivity;
+
+  // LU factorization of K, kept from solve() for the adjoint solve
+  SparseDirectUMFPACK K_factorization;
+  bool K_factorized;
+
+  // Heat capacity matrix and the decay modes from compute_modes
+  double heat_capacity; // Volumetric heat capacity rho*c
+  SparseMatrix<double> M;
+  std::vector<double> eigenvalues;
+  std::vector<Vector<double>> modes;
+
   // solution name array
   std::vector<std::string> nodal_solution_names;
   std::vector<DataComponentInterpretation::DataComponentInterpretation>
       nodal_data_component_interpretation;
+
+  // Writes the output files in the background; they are complete after
+  // output_writer.wait() or once the object is destroyed
+  AsyncFileWriter output_writer;
 };
 
 // Class constructor for a scalar field
-template <int dim>
-FEM<dim>::FEM() : fe(FE_Q<dim>(1), 1), dof_handler(triangulation) {
+template <int dim, typename IndexType>
+FEM<dim, IndexType>::FEM(bool simplex)
+    : fe(simplex ? static_cast<const FiniteElement<dim> &>(FE_SimplexP<dim>(1))
+                 : static_cast<const FiniteElement<dim> &>(FE_Q<dim>(1)),
+         1),
+      dof_handler(triangulation) {
+  simplexElements = simplex;
+  batchedAssembly = false;
+  geometryCacheMemory = 0.;
+  n_convection_faces = 0;
+  K_factorized = false;
+  heat_capacity = 8960. * 385.; // copper
+  reducedIntegration = false;
+  hourglassStiffness = 1.;
+  distributedSolve = false;
+  ownedSubdomain = 0;
+
   // Nodal Solution names - this is for writing the output file
   nodal_solution_names.push_back("D");
   nodal_data_component_interpretation.push_back(
@@ -88,12 +268,13 @@ FEM<dim>::FEM() : fe(FE_Q<dim>(1), 1), dof_handler(triangulation) {
 }
 
 // Class destructor
-template <int dim> FEM<dim>::~FEM() { dof_handler.clear(); }
+template <int dim, typename IndexType>
+FEM<dim, IndexType>::~FEM() { dof_handler.clear(); }
 
 // Define basis functions
-template <int dim>
-double FEM<dim>::basis_function(unsigned int node, double xi_1, double xi_2,
-                                double xi_3) {
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::basis_function(
+    unsigned int node, double xi_1, double xi_2, double xi_3) {
   /*"node" specifies which node the basis function corresponds to,
     "xi" is the point (in the bi-unit domain) where the function is being
     evaluated. You need to calculate the value of the specified basis function
@@ -124,9 +305,9 @@ double FEM<dim>::basis_function(unsigned int node, double xi_1, double xi_2,
 }
 
 // Define basis function gradient
-template <int dim>
-std::vector<double> FEM<dim>::basis_gradient(unsigned int node, double xi_1,
-                                             double xi_2, double xi_3) {
+template <int dim, typename IndexType>
+std::vector<double> FEM<dim, IndexType>::basis_gradient(
+    unsigned int node, double xi_1, double xi_2, double xi_3) {
   /*"node" specifies which node the basis function corresponds to,
     "xi" is the point (in the bi-unit domain) where the function is being
     evaluated. You need to calculate the value of the derivative of the
@@ -194,8 +375,9 @@ std::vector<double> FEM<dim>::basis_gradient(unsigned int node, double xi_1,
 }
 
 // Define the problem domain and generate the mesh
-template <int dim>
-void FEM<dim>::generate_mesh(std::vector<unsigned int> numberOfElements) {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::generate_mesh(
+    std::vector<unsigned int> numberOfElements) {
 
   // Define the limits of your domain
   double x_min =0.0, // EDIT - define the left limit of the domain, etc.
@@ -206,15 +388,56 @@ void FEM<dim>::generate_mesh(std::vector<unsigned int> numberOfElements) {
       z_max = 0.02;   // EDIT
 
   Point<dim, double> min(x_min, y_min, z_min), max(x_max, y_max, z_max);
-  GridGenerator::subdivided_hyper_rectangle(triangulation, numberOfElements,
-                                            min, max);
+  if (simplexElements) {
+    // Each box of the subdivision is split into triangles or tetrahedra
+    GridGenerator::subdivided_hyper_rectangle_with_simplices(
+        triangulation, numberOfElements, min, max, true);
+  } else {
+    GridGenerator::subdivided_hyper_rectangle(triangulation, numberOfElements,
+                                              min, max, true);
+  }
+}
+
+// Read the mesh (with material and boundary ids) from a Gmsh or VTK file
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::import_mesh(const std::string &filename) {
+
+  ImportedMesh mesh = read_mesh_file(filename);
+  AssertThrow(mesh.simplex == simplexElements,
+              ExcMessage(mesh.simplex ? "The mesh has simplex cells, construct "
+                                        "the FEM object with simplex = true"
+                                      : "The mesh has quad/hex cells, construct "
+                                        "the FEM object with simplex = false"));
+  build_triangulation(mesh, triangulation);
 }
 
 // Specify the Dirichlet boundary conditions
-template <int dim> void FEM<dim>::define_boundary_conds() {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::define_boundary_conds() {
 
   // EDIT - Define the Dirichlet boundary conditions.
 
+  // Temperatures given by boundary id: fix every dof on those boundary faces
+  if (!dirichlet_temperatures.empty()) {
+    std::vector<IndexType> face_dof_indices(fe.dofs_per_face);
+    typename DoFHandler<dim>::active_cell_iterator
+        elem = dof_handler.begin_active(),
+        endc = dof_handler.end();
+    for (; elem != endc; ++elem) {
+      for (unsigned int f = 0; f < elem->n_faces(); f++) {
+        if (!elem->face(f)->at_boundary()) continue;
+        std::map<types::boundary_id, double>::const_iterator temperature =
+            dirichlet_temperatures.find(elem->face(f)->boundary_id());
+        if (temperature == dirichlet_temperatures.end()) continue;
+        get_dof_indices(elem->face(f), face_dof_indices);
+        for (unsigned int i = 0; i < face_dof_indices.size(); i++) {
+          boundary_values[face_dof_indices[i]] = temperature->second;
+        }
+      }
+    }
+    return;
+  }
+
   /*Note: this will be very similiar to the define_boundary_conds function
     in the lab1. You will loop over all nodes and use "nodeLocations"
     to check if the node is on the boundary with a Dirichlet condition. If it
@@ -228,8 +451,8 @@ template <int dim> void FEM<dim>::define_boundary_conds() {
     component (0, 1, or 2 for 3D). e.g. nodeLocation[7][2] is the z coordinate
     of global node 7*/
 
-  const unsigned int totalNodes = dof_handler.n_dofs(); // Total number of nodes
-  for (uint i = 0; i < totalNodes ; ++i)
+  const IndexType totalNodes = dof_handler.n_dofs(); // Total number of nodes
+  for (IndexType i = 0; i < totalNodes ; ++i)
   {
       if (std::abs(nodeLocation[i][1])<1.e-8)
       {
@@ -254,19 +477,33 @@ template <int dim> void FEM<dim>::define_boundary_conds() {
 }
 
 // Setup data structures (sparse matrix, vectors)
-template <int dim> void FEM<dim>::setup_system() {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::setup_system() {
 
   // Let deal.II organize degrees of freedom
   dof_handler.distribute_dofs(fe);
+  if (distributedSolve) {
+    // Subdomain by subdomain, remembering where each dof came from
+    std::vector<types::global_dof_index> new_index(dof_handler.n_dofs());
+    DoFRenumbering::compute_subdomain_wise(new_index, dof_handler);
+    serialDofIndex.resize(dof_handler.n_dofs());
+    for (types::global_dof_index i = 0; i < new_index.size(); i++) {
+      serialDofIndex[new_index[i]] = i;
+    }
+    dof_handler.renumber_dofs(new_index);
+  }
+  check_index_range<IndexType>(dof_handler.n_dofs());
 
   // Fill in the Table "nodeLocations" with the x, y, and z coordinates of each
   // node by its global index
-  MappingQ1<dim, dim> mapping;
+  // MappingQ1 for quads/hexes, its simplex counterpart otherwise
+  const Mapping<dim> &mapping =
+      fe.reference_cell().template get_default_linear_mapping<dim, dim>();
   std::vector<Point<dim, double>> dof_coords(dof_handler.n_dofs());
   nodeLocation.reinit(dof_handler.n_dofs(), dim);
   DoFTools::map_dofs_to_support_points<dim, dim>(mapping, dof_handler,
                                                  dof_coords);
-  for (unsigned int i = 0; i < dof_coords.size(); i++) {
+  for (IndexType i = 0; i < dof_coords.size(); i++) {
     for (unsigned int j = 0; j < dim; j++) {
       nodeLocation[i][j] = dof_coords[i][j];
     }
@@ -276,11 +513,13 @@ template <int dim> void FEM<dim>::setup_system() {
   define_boundary_conds();
 
   // Define the size of the global matrices and vectors
-  sparsity_pattern.reinit(dof_handler.n_dofs(), dof_handler.n_dofs(),
-                          dof_handler.max_couplings_between_dofs());
-  DoFTools::make_sparsity_pattern(dof_handler, sparsity_pattern);
-  sparsity_pattern.compress();
-  K.reinit(sparsity_pattern);
+  if (!distributedSolve) {
+    sparsity_pattern.reinit(dof_handler.n_dofs(), dof_handler.n_dofs(),
+                            dof_handler.max_couplings_between_dofs());
+    DoFTools::make_sparsity_pattern(dof_handler, sparsity_pattern);
+    sparsity_pattern.compress();
+    K.reinit(sparsity_pattern);
+  }
   F.reinit(dof_handler.n_dofs());
   D.reinit(dof_handler.n_dofs());
 
@@ -295,26 +534,54 @@ template <int dim> void FEM<dim>::setup_system() {
   quad_weight[0] = 1.; // EDIT
   quad_weight[1] = 1.; // EDIT
 
+  // Jacobian data at the quadrature points, as much as geometryCacheMemory allows
+  std::vector<double> weight;
+  std::vector<std::vector<double>> N;
+  std::vector<std::vector<std::vector<double>>> dN;
+  tabulate_basis(weight, N, dN);
+  geometry.reinit(dof_handler, nodeLocation, weight, dN, geometryCacheMemory,
+                  distributedSolve ? ownedSubdomain
+                                   : numbers::invalid_subdomain_id);
+  shape_values = N;
+  setup_convection_faces();
+
   // Just some notes...
+  if (distributedSolve && ownedSubdomain != 0) return;
   std::cout << "   Number of active elems:       "
             << triangulation.n_active_cells() << std::endl;
   std::cout << "   Number of degrees of freedom: " << dof_handler.n_dofs()
             << std::endl;
+  if (n_convection_faces > 0) {
+    std::cout << "   Convection faces:             " << n_convection_faces
+              << std::endl;
+  }
+  if (geometry.n_cached_cells() > 0) {
+    std::cout << "   Geometry cache:               "
+              << geometry.n_cached_cells() << " elems, "
+              << geometry.memory_consumption() / 1.e6 << " MB" << std::endl;
+  }
 }
 
 // Form elmental vectors and matrices and assemble to the global vector (F) and
 // matrix (K)
-template <int dim> void FEM<dim>::assemble_system() {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_system() {
+
+  if (batchedAssembly && !simplexElements && !reducedIntegration) {
+    assemble_system_batched();
+    return;
+  }
 
   K = 0;
   F = 0;
+  K_factorized = false;
 
   const unsigned int dofs_per_elem =
       fe.dofs_per_cell; // This gives you number of degrees of freedom per
                         // element
   FullMatrix<double> Klocal(dofs_per_elem, dofs_per_elem);
   Vector<double> Flocal(dofs_per_elem);
-  std::vector<unsigned int> local_dof_indices(dofs_per_elem);
+  std::vector<IndexType> local_dof_indices(dofs_per_elem);
 
   // loop over elements
   typename DoFHandler<dim>::active_cell_iterator elem =
@@ -325,124 +592,967 @@ template <int dim> void FEM<dim>::assemble_system() {
     /*Retrieve the effective "connectivity matrix" for this element
       "local_dof_indices" relates local dofs to global dofs,
       i.e. local_dof_indices[i] gives the global dof number for local dof i.*/
-    elem->get_dof_indices(local_dof_indices);
+    get_dof_indices(elem, local_dof_indices);
 
-    // Loop over local DOFs and quadrature points to populate Flocal and Klocal.
-    FullMatrix<double> Jacobian(dim, dim);
-    double detJ;
+    FullMatrix<double> kappa(dim, dim);
 
-    // Loop over local DOFs and quadrature points to populate Flocal
-    Flocal = 0.;
-    for (unsigned int q1 = 0; q1 < quadRule; q1++) {
-      for (unsigned int q2 = 0; q2 < quadRule; q2++) {
-        for (unsigned int q3 = 0; q3 < quadRule; q3++) {
-          Jacobian = 0.;
-          for (unsigned int i = 0; i < dim; i++) {
-            for (unsigned int j = 0; j < dim; j++) {
-              for (unsigned int A = 0; A < dofs_per_elem; A++) {
-                Jacobian[i][j] +=
-                    nodeLocation[local_dof_indices[A]][i] *
-                    basis_gradient(A, quad_points[q1], quad_points[q2],
-                                   quad_points[q3])[j];
+    //"kappa" is the conductivity tensor (isotropic, per material if given)
+    double conductivity = element_conductivity(elem);
+    kappa = 0.;
+    kappa[0][0] = conductivity;
+    kappa[1][1] = conductivity;
+    kappa[2][2] = conductivity;
+
+    // Heat source, integrated with the full rule whatever the Klocal rule
+    element_Flocal(elem, local_dof_indices, Flocal);
+
+    if (simplexElements) {
+      // Constant-gradient closed form, no quadrature loop
+      simplex_Klocal(local_dof_indices, kappa, Klocal);
+    } else if (reducedIntegration) {
+      // One-point rule with hourglass stabilization
+      reduced_integration_Klocal(local_dof_indices, kappa, Klocal);
+    } else {
+      /*Klocal from the full Gauss rule, through the geometry cache whatever
+        its size (uncached elements are recomputed by the same formulas), so K
+        does not depend on geometryCacheMemory*/
+      geometry_Klocal(elem->active_cell_index(), local_dof_indices, kappa,
+                      Klocal);
+    }
+
+    // Assemble local K and F into global K and F
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      F[local_dof_indices[A]] += Flocal[A];
+      for (unsigned int B = 0; B < dofs_per_elem; B++) {
+        // EDIT - Assemble K from Klocal (you can look at lab1)
+        K.add(local_dof_indices[A],local_dof_indices[B],Klocal[A][B]);
+      }
+    }
+  }
+
+  // Convection boundaries
+  assemble_convection();
+
+  // Apply Dirichlet boundary conditions
+  apply_boundary_values(boundary_values, K, D, F, false);
+}
+
+// assemble_system() with the Klocal of Number::size() elements at a time
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_system_batched() {
+
+  K = 0;
+  F = 0;
+  K_factorized = false;
+
+  typedef typename CellBatchKernel<dim>::Number Number;
+  const unsigned int n_lanes = Number::size();
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+
+  std::vector<double> weight;
+  std::vector<std::vector<double>> N;
+  std::vector<std::vector<std::vector<double>>> dN;
+  tabulate_basis(weight, N, dN);
+  CellBatchKernel<dim> kernel;
+  kernel.reinit(weight, dN);
+
+  // One element per lane: coordinates[A*dim + i][lane], Klocal[A*dofs + B][lane]
+  AlignedVector<Number> coordinates(dofs_per_elem * dim);
+  AlignedVector<Number> Klocal(dofs_per_elem * dofs_per_elem);
+  Number conductivity;
+  std::vector<std::vector<IndexType>> batch_dofs(
+      n_lanes, std::vector<IndexType>(dofs_per_elem));
+  Vector<double> Flocal(dofs_per_elem);
+
+  typename DoFHandler<dim>::active_cell_iterator elem =
+                                                     dof_handler.begin_active(),
+                                                 endc = dof_handler.end();
+  while (elem != endc) {
+    // Gather the next batch of elements into the lanes
+    unsigned int n_filled = 0;
+    for (; n_filled < n_lanes && elem != endc; ++n_filled, ++elem) {
+      get_dof_indices(elem, batch_dofs[n_filled]);
+      conductivity[n_filled] = element_conductivity(elem);
+      element_Flocal(elem, batch_dofs[n_filled], Flocal);
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        F[batch_dofs[n_filled][A]] += Flocal[A];
+      }
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        for (unsigned int i = 0; i < dim; i++) {
+          coordinates[A * dim + i][n_filled] =
+              nodeLocation[batch_dofs[n_filled][A]][i];
+        }
+      }
+    }
+    // The last batch may be short: repeat its first element in the rest
+    for (unsigned int l = n_filled; l < n_lanes; l++) {
+      conductivity[l] = conductivity[0];
+      for (unsigned int k = 0; k < dofs_per_elem * dim; k++) {
+        coordinates[k][l] = coordinates[k][0];
+      }
+    }
+
+    kernel.stiffness(coordinates.data(), conductivity, Klocal.data());
+
+    // Assemble the Klocal of the filled lanes into K
+    for (unsigned int l = 0; l < n_filled; l++) {
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        for (unsigned int B = 0; B < dofs_per_elem; B++) {
+          K.add(batch_dofs[l][A], batch_dofs[l][B],
+                Klocal[A * dofs_per_elem + B][l]);
+        }
+      }
+    }
+  }
+
+  // Convection boundaries
+  assemble_convection();
+
+  // Apply Dirichlet boundary conditions
+  apply_boundary_values(boundary_values, K, D, F, false);
+}
+
+// F of the heat sources, convection and Dirichlet values, K left as it is
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_rhs() {
+
+  F = 0;
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  Vector<double> Flocal(dofs_per_elem);
+  std::vector<IndexType> local_dof_indices(dofs_per_elem);
+  if (!material_heat_source.empty()) {
+    typename DoFHandler<dim>::active_cell_iterator
+        elem = dof_handler.begin_active(),
+        endc = dof_handler.end();
+    for (; elem != endc; ++elem) {
+      get_dof_indices(elem, local_dof_indices);
+      element_Flocal(elem, local_dof_indices, Flocal);
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        F[local_dof_indices[A]] += Flocal[A];
+      }
+    }
+  }
+
+  const unsigned int dofs_per_face = fe.dofs_per_face;
+  FullMatrix<double> Kface(dofs_per_face, dofs_per_face);
+  Vector<double> Fface(dofs_per_face);
+  for (unsigned int face = 0; face < n_convection_faces; face++) {
+    convection_face_terms(face, Kface, Fface);
+    for (unsigned int a = 0; a < dofs_per_face; a++) {
+      F[convection_face_dofs[face * dofs_per_face + a]] += Fface[a];
+    }
+  }
+
+  /*The Dirichlet rows of K are already reduced to their diagonal, which
+    apply_boundary_values keeps, so this only sets F (and D) on those rows*/
+  apply_boundary_values(boundary_values, K, D, F, false);
+}
+
+// Element stiffness from the full Gauss rule with the cached Jacobians
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::geometry_Klocal(
+    unsigned int cell, const std::vector<IndexType> &local_dof_indices,
+    const FullMatrix<double> &kappa, FullMatrix<double> &Klocal) {
+
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  static thread_local std::vector<double> geometry_scratch;
+  static thread_local std::vector<double> grad; // [A*dim + I], at one point
+  grad.resize(dofs_per_elem * dim);
+  const typename GeometryCache<dim>::CellGeometry cell_geometry =
+      geometry.get(cell, local_dof_indices, geometry_scratch);
+
+  Klocal = 0.;
+  for (unsigned int q = 0; q < geometry.n_q_points(); q++) {
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      for (unsigned int I = 0; I < dim; I++) {
+        grad[A * dim + I] = geometry.shape_gradient(cell_geometry, q, A, I);
+      }
+    }
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      for (unsigned int B = 0; B < dofs_per_elem; B++) {
+        for (unsigned int I = 0; I < dim; I++) {
+          for (unsigned int J = 0; J < dim; J++) {
+            Klocal[A][B] += grad[A * dim + I] * kappa[I][J] *
+                            grad[B * dim + J] * cell_geometry.JxW[q];
+          }
+        }
+      }
+    }
+  }
+}
+
+// Element stiffness with the integration used by assemble_system()
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::element_Klocal(
+    unsigned int cell, const std::vector<IndexType> &local_dof_indices,
+    const FullMatrix<double> &kappa, FullMatrix<double> &Klocal) {
+  if (simplexElements) {
+    simplex_Klocal(local_dof_indices, kappa, Klocal);
+  } else if (reducedIntegration) {
+    reduced_integration_Klocal(local_dof_indices, kappa, Klocal);
+  } else {
+    geometry_Klocal(cell, local_dof_indices, kappa, Klocal);
+  }
+}
+
+// Element stiffness from one-point quadrature plus hourglass stabilization
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::reduced_integration_Klocal(
+    const std::vector<IndexType> &local_dof_indices,
+    const FullMatrix<double> &kappa, FullMatrix<double> &Klocal) {
+
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+
+  // Jacobian at the element center (xi = 0), where the weight is 2*2*2 = 8
+  std::vector<std::vector<double>> gradient_at_center(dofs_per_elem);
+  for (unsigned int A = 0; A < dofs_per_elem; A++) {
+    gradient_at_center[A] = basis_gradient(A, 0., 0., 0.);
+  }
+  FullMatrix<double> Jacobian(dim, dim), invJacob(dim, dim);
+  Jacobian = 0.;
+  for (unsigned int i = 0; i < dim; i++) {
+    for (unsigned int j = 0; j < dim; j++) {
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        Jacobian[i][j] +=
+            nodeLocation[local_dof_indices[A]][i] * gradient_at_center[A][j];
+      }
+    }
+  }
+  double volume = 8. * Jacobian.determinant();
+  invJacob.invert(Jacobian);
+
+  // Spatial gradients of the basis functions at the center, b[A][I]
+  std::vector<std::vector<double>> b(dofs_per_elem, std::vector<double>(dim, 0.));
+  for (unsigned int A = 0; A < dofs_per_elem; A++) {
+    for (unsigned int I = 0; I < dim; I++) {
+      for (unsigned int i = 0; i < dim; i++) {
+        b[A][I] += gradient_at_center[A][i] * invJacob[i][I];
+      }
+    }
+  }
+
+  // Conductivity pulled back to the bi-unit domain: G = invJacob*kappa*invJacob^T
+  FullMatrix<double> G(dim, dim);
+  G = 0.;
+  for (unsigned int i = 0; i < dim; i++) {
+    for (unsigned int j = 0; j < dim; j++) {
+      for (unsigned int I = 0; I < dim; I++) {
+        for (unsigned int J = 0; J < dim; J++) {
+          G[i][j] += invJacob[i][I] * kappa[I][J] * invJacob[j][J];
+        }
+      }
+    }
+  }
+
+  // Constant-gradient part: exact for the linear fields, blind to the rest
+  Klocal = 0.;
+  for (unsigned int A = 0; A < dofs_per_elem; A++) {
+    for (unsigned int B = 0; B < dofs_per_elem; B++) {
+      for (unsigned int I = 0; I < dim; I++) {
+        for (unsigned int J = 0; J < dim; J++) {
+          Klocal[A][B] += b[A][I] * kappa[I][J] * b[B][J] * volume;
+        }
+      }
+    }
+  }
+
+  /*The four hourglass modes (xi_2*xi_3, xi_1*xi_3, xi_1*xi_2, xi_1*xi_2*xi_3
+    sampled at the nodes) have zero gradient at the center, so they have to be
+    stiffened separately. "gamma" is each mode with its linear part removed
+    (Flanagan-Belytschko), so the stabilization never touches linear fields.
+    Each mode is scaled by its exact energy on a parallelepiped with the same
+    G, which makes the result identical to the 2x2x2 rule on (rotated)
+    rectangular boxes, i.e. on every element of subdivided_hyper_rectangle.*/
+  const double mode_energy[4] = {(G[1][1] + G[2][2]) / 3.,
+                                 (G[0][0] + G[2][2]) / 3.,
+                                 (G[0][0] + G[1][1]) / 3.,
+                                 (G[0][0] + G[1][1] + G[2][2]) / 9.};
+  for (unsigned int mode = 0; mode < 4; mode++) {
+    std::vector<double> h(dofs_per_elem), gamma(dofs_per_elem);
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      // Node A sits at xi = (s1, s2, s3) in deal.II's lexicographic numbering
+      double s1 = (A & 1) ? 1. : -1., s2 = (A & 2) ? 1. : -1.,
+             s3 = (A & 4) ? 1. : -1.;
+      if (mode == 0) h[A] = s2 * s3;
+      if (mode == 1) h[A] = s1 * s3;
+      if (mode == 2) h[A] = s1 * s2;
+      if (mode == 3) h[A] = s1 * s2 * s3;
+    }
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      gamma[A] = h[A];
+      for (unsigned int I = 0; I < dim; I++) {
+        double hx = 0.;
+        for (unsigned int B = 0; B < dofs_per_elem; B++) {
+          hx += h[B] * nodeLocation[local_dof_indices[B]][I];
+        }
+        gamma[A] -= hx * b[A][I];
+      }
+    }
+    // gamma.gamma = 8 on a box, so c*(gamma.h)^2 = 64*c is the mode energy
+    double c = hourglassStiffness * mode_energy[mode] * volume / 64.;
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      for (unsigned int B = 0; B < dofs_per_elem; B++) {
+        Klocal[A][B] += c * gamma[A] * gamma[B];
+      }
+    }
+  }
+}
+
+/*Solve the problem with full (2x2x2) and with reduced integration and report
+  the relative difference of the solutions and the assembly times, so the mode
+  can be chosen per run. The mode selected by "reducedIntegration" is run last,
+  so K and D are left consistent with it.*/
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::compare_reduced_integration() {
+
+  const bool selected = reducedIntegration;
+  Vector<double> solution[2];
+  double assembly_time[2];
+  for (unsigned int pass = 0; pass < 2; pass++) {
+    reducedIntegration = (pass == 0) ? !selected : selected;
+    D = 0.;
+    auto start = std::chrono::steady_clock::now();
+    assemble_system();
+    auto stop = std::chrono::steady_clock::now();
+    solve();
+    unsigned int mode = reducedIntegration ? 1 : 0;
+    solution[mode] = D;
+    assembly_time[mode] = std::chrono::duration<double>(stop - start).count();
+  }
+
+  Vector<double> difference(solution[1]);
+  difference -= solution[0];
+  double relative_error = difference.l2_norm() / solution[0].l2_norm();
+
+  std::cout << "   Full integration assembly time:    " << assembly_time[0]
+            << " s" << std::endl;
+  std::cout << "   Reduced integration assembly time: " << assembly_time[1]
+            << " s" << std::endl;
+  std::cout << "   Relative l2 difference (reduced vs full): " << relative_error
+            << ", max nodal difference: " << difference.linfty_norm()
+            << std::endl;
+
+  return relative_error;
+}
+
+// Element stiffness of a linear triangle/tetrahedron in closed form
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::simplex_Klocal(
+    const std::vector<IndexType> &local_dof_indices,
+    const FullMatrix<double> &kappa, FullMatrix<double> &Klocal) {
+
+  /*The basis functions of a linear simplex are its barycentric coordinates,
+    whose gradients are constant over the element, so no quadrature loop is
+    needed. With the edge vectors from vertex 0 as the columns of the
+    Jacobian, the gradient of the basis function of vertex j+1 is row j of the
+    inverse Jacobian, and the gradient for vertex 0 is minus their sum.*/
+  const unsigned int dofs_per_elem = fe.dofs_per_cell; // = dim+1
+  FullMatrix<double> Jacobian(dim, dim), invJacob(dim, dim);
+  for (unsigned int i = 0; i < dim; i++) {
+    for (unsigned int j = 0; j < dim; j++) {
+      Jacobian[i][j] = nodeLocation[local_dof_indices[j + 1]][i] -
+                       nodeLocation[local_dof_indices[0]][i];
+    }
+  }
+  invJacob.invert(Jacobian);
+
+  // Element area (2D) or volume (3D): |detJ|/dim!
+  double measure = std::abs(Jacobian.determinant()) / (dim == 2 ? 2. : 6.);
+
+  std::vector<std::vector<double>> b(dofs_per_elem, std::vector<double>(dim, 0.));
+  for (unsigned int I = 0; I < dim; I++) {
+    for (unsigned int A = 1; A < dofs_per_elem; A++) {
+      b[A][I] = invJacob[A - 1][I];
+      b[0][I] -= b[A][I];
+    }
+  }
+
+  Klocal = 0.;
+  for (unsigned int A = 0; A < dofs_per_elem; A++) {
+    for (unsigned int B = 0; B < dofs_per_elem; B++) {
+      for (unsigned int I = 0; I < dim; I++) {
+        for (unsigned int J = 0; J < dim; J++) {
+          Klocal[A][B] += b[A][I] * kappa[I][J] * b[B][J] * measure;
+        }
+      }
+    }
+  }
+}
+
+// Conductivity of an element: cell_conductivity if set, else
+// material_conductivity if it has an entry for the element's material id,
+// otherwise the default 385
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::element_conductivity(
+    const typename DoFHandler<dim>::active_cell_iterator &elem) const {
+  if (cell_conductivity.size() == triangulation.n_active_cells()) {
+    return cell_conductivity[elem->active_cell_index()];
+  }
+  std::map<types::material_id, double>::const_iterator conductivity =
+      material_conductivity.find(elem->material_id());
+  return (conductivity != material_conductivity.end()) ? conductivity->second
+                                                       : 385.;
+}
+
+// material_heat_source if it has an entry for the element's material id,
+// otherwise 0
+template <int dim, typename IndexType>
+double FEM<dim, IndexType>::element_heat_source(
+    const typename DoFHandler<dim>::active_cell_iterator &elem) const {
+  std::map<types::material_id, double>::const_iterator source =
+      material_heat_source.find(elem->material_id());
+  return (source != material_heat_source.end()) ? source->second : 0.;
+}
+
+// Flocal_A = int N_A*s dV, with the rule of tabulate_basis
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::element_Flocal(
+    const typename DoFHandler<dim>::active_cell_iterator &elem,
+    const std::vector<IndexType> &local_dof_indices, Vector<double> &Flocal) {
+
+  Flocal = 0.;
+  const double source = element_heat_source(elem);
+  if (source == 0.) return;
+
+  static thread_local std::vector<double> geometry_scratch;
+  const typename GeometryCache<dim>::CellGeometry cell_geometry = geometry.get(
+      elem->active_cell_index(), local_dof_indices, geometry_scratch);
+  for (unsigned int q = 0; q < geometry.n_q_points(); q++) {
+    const double sJxW = source * std::abs(cell_geometry.JxW[q]);
+    for (unsigned int A = 0; A < Flocal.size(); A++) {
+      Flocal[A] += shape_values[q][A] * sJxW;
+    }
+  }
+}
+
+// Faces on convection_boundaries and their integrals of the basis functions
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::setup_convection_faces() {
+
+  n_convection_faces = 0;
+  convection_face_dofs.clear();
+  convection_face_id.clear();
+  convection_face_cell.clear();
+  convection_face_mass.clear();
+  convection_face_integral.clear();
+  if (convection_boundaries.empty()) return;
+
+  const unsigned int dofs_per_face = fe.dofs_per_face;
+  std::vector<IndexType> dofs(dofs_per_face);
+  std::vector<double> mass(dofs_per_face * dofs_per_face),
+      integral(dofs_per_face);
+  typename DoFHandler<dim>::active_cell_iterator elem =
+                                                     dof_handler.begin_active(),
+                                                 endc = dof_handler.end();
+  for (; elem != endc; ++elem) {
+    for (unsigned int f = 0; f < elem->n_faces(); f++) {
+      if (!elem->face(f)->at_boundary() ||
+          !convection_boundaries.count(elem->face(f)->boundary_id()))
+        continue;
+      get_dof_indices(elem->face(f), dofs);
+
+      if (dofs_per_face == 3) {
+        // Flat triangle: int N_a N_b dS = area*(1 + delta_ab)/12
+        double edge1[3], edge2[3];
+        for (unsigned int i = 0; i < 3; i++) {
+          edge1[i] = nodeLocation[dofs[1]][i] - nodeLocation[dofs[0]][i];
+          edge2[i] = nodeLocation[dofs[2]][i] - nodeLocation[dofs[0]][i];
+        }
+        double normal[3];
+        for (unsigned int i = 0; i < 3; i++) {
+          normal[i] = edge1[(i + 1) % 3] * edge2[(i + 2) % 3] -
+                      edge1[(i + 2) % 3] * edge2[(i + 1) % 3];
+        }
+        const double area = 0.5 * std::sqrt(normal[0] * normal[0] +
+                                            normal[1] * normal[1] +
+                                            normal[2] * normal[2]);
+        for (unsigned int a = 0; a < dofs_per_face; a++) {
+          integral[a] = area / 3.;
+          for (unsigned int b = 0; b < dofs_per_face; b++) {
+            mass[a * dofs_per_face + b] = area * (a == b ? 2. : 1.) / 12.;
+          }
+        }
+      } else {
+        /*Bilinear quad (possibly warped), 2x2 Gauss rule on [0,1]^2 with the
+          face vertices in deal.II order (0,0), (1,0), (0,1), (1,1)*/
+        for (unsigned int a = 0; a < dofs_per_face; a++) {
+          integral[a] = 0.;
+          for (unsigned int b = 0; b < dofs_per_face; b++) {
+            mass[a * dofs_per_face + b] = 0.;
+          }
+        }
+        const double gauss[2] = {0.5 - 0.5 / std::sqrt(3.),
+                                 0.5 + 0.5 / std::sqrt(3.)};
+        for (unsigned int q1 = 0; q1 < 2; q1++) {
+          for (unsigned int q2 = 0; q2 < 2; q2++) {
+            const double s = gauss[q1], t = gauss[q2];
+            const double N[4] = {(1 - s) * (1 - t), s * (1 - t), (1 - s) * t,
+                                 s * t};
+            const double dNds[4] = {-(1 - t), 1 - t, -t, t};
+            const double dNdt[4] = {-(1 - s), -s, 1 - s, s};
+            double xs[3] = {0., 0., 0.}, xt[3] = {0., 0., 0.};
+            for (unsigned int a = 0; a < 4; a++) {
+              for (unsigned int i = 0; i < 3; i++) {
+                xs[i] += nodeLocation[dofs[a]][i] * dNds[a];
+                xt[i] += nodeLocation[dofs[a]][i] * dNdt[a];
+              }
+            }
+            // Surface element |x_s x x_t| times the weight 1/4
+            double normal[3];
+            for (unsigned int i = 0; i < 3; i++) {
+              normal[i] = xs[(i + 1) % 3] * xt[(i + 2) % 3] -
+                          xs[(i + 2) % 3] * xt[(i + 1) % 3];
+            }
+            const double dS = 0.25 * std::sqrt(normal[0] * normal[0] +
+                                               normal[1] * normal[1] +
+                                               normal[2] * normal[2]);
+            for (unsigned int a = 0; a < 4; a++) {
+              integral[a] += N[a] * dS;
+              for (unsigned int b = 0; b < 4; b++) {
+                mass[a * dofs_per_face + b] += N[a] * N[b] * dS;
               }
             }
-          }
-          detJ = Jacobian.determinant();
-          for (unsigned int A = 0; A < dofs_per_elem; A++) {
-            // You would define Flocal here if it were nonzero.
           }
         }
       }
+
+      n_convection_faces++;
+      convection_face_id.push_back(elem->face(f)->boundary_id());
+      convection_face_cell.push_back(elem->active_cell_index());
+      convection_face_dofs.insert(convection_face_dofs.end(), dofs.begin(),
+                                  dofs.end());
+      convection_face_mass.insert(convection_face_mass.end(), mass.begin(),
+                                  mass.end());
+      convection_face_integral.insert(convection_face_integral.end(),
+                                      integral.begin(), integral.end());
     }
+  }
+}
 
-    // Loop over local DOFs and quadrature points to populate Klocal
-    FullMatrix<double> invJacob(dim, dim), kappa(dim, dim);
+// Robin terms of one face: h*(T - T_inf) moves h*M to K and h*T_inf*m to F
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::convection_face_terms(unsigned int face,
+                                                FullMatrix<double> &Kface,
+                                                Vector<double> &Fface) const {
+  const unsigned int dofs_per_face = fe.dofs_per_face;
+  const std::pair<double, double> &coefficients =
+      convection_boundaries.find(convection_face_id[face])->second;
+  const double h = coefficients.first, T_inf = coefficients.second;
+  const double *mass = &convection_face_mass[face * dofs_per_face * dofs_per_face];
+  const double *integral = &convection_face_integral[face * dofs_per_face];
+  for (unsigned int a = 0; a < dofs_per_face; a++) {
+    Fface[a] = h * T_inf * integral[a];
+    for (unsigned int b = 0; b < dofs_per_face; b++) {
+      Kface[a][b] = h * mass[a * dofs_per_face + b];
+    }
+  }
+}
 
-    //"kappa" is the conductivity tensor
-    kappa = 0.;
-    kappa[0][0] = 385.;
-    kappa[1][1] = 385.;
-    kappa[2][2] = 385.;
+// Convection terms of all convection faces into K and F
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_convection() {
+  const unsigned int dofs_per_face = fe.dofs_per_face;
+  FullMatrix<double> Kface(dofs_per_face, dofs_per_face);
+  Vector<double> Fface(dofs_per_face);
+  for (unsigned int face = 0; face < n_convection_faces; face++) {
+    convection_face_terms(face, Kface, Fface);
+    const IndexType *dofs = &convection_face_dofs[face * dofs_per_face];
+    for (unsigned int a = 0; a < dofs_per_face; a++) {
+      F[dofs[a]] += Fface[a];
+      for (unsigned int b = 0; b < dofs_per_face; b++) {
+        K.add(dofs[a], dofs[b], Kface[a][b]);
+      }
+    }
+  }
+}
+
+// Basis functions and their xi-derivatives at the quadrature points
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::tabulate_basis(
+    std::vector<double> &weight, std::vector<std::vector<double>> &N,
+    std::vector<std::vector<std::vector<double>>> &dN) {
 
-    // Loop over local DOFs and quadrature points to populate Klocal
-    Klocal = 0.;
+  /*For simplices the gradients are constant, so one point at the centroid
+    (with the reference element measure 1/dim! as its weight) integrates the
+    products of a basis function and a gradient exactly.*/
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  const unsigned int n_q = simplexElements ? 1 : quadRule * quadRule * quadRule;
+  weight.assign(n_q, 0.);
+  N.assign(n_q, std::vector<double>(dofs_per_elem));
+  dN.assign(n_q, std::vector<std::vector<double>>(dofs_per_elem,
+                                                  std::vector<double>(dim, 0.)));
+  if (simplexElements) {
+    weight[0] = (dim == 2) ? 1. / 2. : 1. / 6.;
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      N[0][A] = 1. / (dim + 1);
+      for (unsigned int i = 0; i < dim; i++) {
+        dN[0][A][i] = (A == 0) ? -1. : (A == i + 1 ? 1. : 0.);
+      }
+    }
+  } else {
     for (unsigned int q1 = 0; q1 < quadRule; q1++) {
-      double xi1= quad_points[q1];
       for (unsigned int q2 = 0; q2 < quadRule; q2++) {
-        double xi2= quad_points[q2];
         for (unsigned int q3 = 0; q3 < quadRule; q3++) {
-          double xi3= quad_points[q3];
-          // Find the Jacobian at a quadrature point
-          Jacobian = 0.;
-          for (unsigned int i = 0; i < dim; i++) {
-            for (unsigned int j = 0; j < dim; j++) {
-              for (unsigned int A = 0; A < dofs_per_elem; A++) {
-                Jacobian[i][j] +=
-                    nodeLocation[local_dof_indices[A]][i] *
-                    basis_gradient(A, quad_points[q1], quad_points[q2],
-                                   quad_points[q3])[j];
-              }
+          unsigned int q = q1 + quadRule * (q2 + quadRule * q3);
+          weight[q] = quad_weight[q1] * quad_weight[q2] * quad_weight[q3];
+          for (unsigned int A = 0; A < dofs_per_elem; A++) {
+            N[q][A] = basis_function(A, quad_points[q1], quad_points[q2],
+                                     quad_points[q3]);
+            dN[q][A] = basis_gradient(A, quad_points[q1], quad_points[q2],
+                                      quad_points[q3]);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Recover the nodal heat flux q = -kappa*grad(T) from the solution D
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::compute_heat_flux() {
+
+  /*The flux is evaluated at the quadrature points of each element and
+    projected onto the nodal basis with a lumped L2 projection,
+      q_A = sum_e int_e N_A q dV / sum_e int_e N_A dV,
+    which averages the (discontinuous) element fluxes at shared nodes with
+    weights of the element's share of the node.
+
+    The elements are processed in parallel with WorkStream: the worker
+    computes the element integrals, the copier (which runs on one thread at a
+    time) adds them to the nodal sums.*/
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  std::vector<double> weight;
+  std::vector<std::vector<double>> N;
+  std::vector<std::vector<std::vector<double>>> dN;
+  tabulate_basis(weight, N, dN);
+  const unsigned int n_q = weight.size();
+
+  struct ScratchData {
+    std::vector<double> geometry_values; // For geometry.get
+    std::vector<double> gradT;
+  };
+  struct CopyData {
+    std::vector<IndexType> local_dof_indices;
+    FullMatrix<double> flux_integral; // [A][I]: integral of N_A*q_I
+    Vector<double> basis_integral;    // [A]: integral of N_A
+  };
+  ScratchData sample_scratch;
+  sample_scratch.gradT.resize(dim);
+  CopyData sample_copy;
+  sample_copy.local_dof_indices.resize(dofs_per_elem);
+  sample_copy.flux_integral.reinit(dofs_per_elem, dim);
+  sample_copy.basis_integral.reinit(dofs_per_elem);
+
+  heat_flux.assign(dim, Vector<double>(dof_handler.n_dofs()));
+  Vector<double> basis_integral(dof_handler.n_dofs());
+
+  WorkStream::run(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          ScratchData &scratch, CopyData &copy) {
+        get_dof_indices(elem, copy.local_dof_indices);
+        const std::vector<IndexType> &dofs = copy.local_dof_indices;
+        const double conductivity = element_conductivity(elem);
+        copy.flux_integral = 0.;
+        copy.basis_integral = 0.;
+        const typename GeometryCache<dim>::CellGeometry cell_geometry =
+            geometry.get(elem->active_cell_index(), dofs,
+                         scratch.geometry_values);
+        for (unsigned int q = 0; q < n_q; q++) {
+          double JxW = std::abs(cell_geometry.JxW[q]);
+
+          // Temperature gradient at the quadrature point
+          for (unsigned int I = 0; I < dim; I++) {
+            scratch.gradT[I] = 0.;
+            for (unsigned int A = 0; A < dofs_per_elem; A++) {
+              scratch.gradT[I] +=
+                  D[dofs[A]] * geometry.shape_gradient(cell_geometry, q, A, I);
             }
           }
-          detJ = Jacobian.determinant();
-          double weight = quad_weight[q1]*quad_weight[q2]*quad_weight[3];
-          invJacob.invert(Jacobian);
           for (unsigned int A = 0; A < dofs_per_elem; A++) {
-            for (unsigned int B = 0; B < dofs_per_elem; B++) {
-              for (unsigned int i = 0; i < dim; i++) {
-                for (unsigned int j = 0; j < dim; j++) {
-                  for (unsigned int I = 0; I < dim; I++) {
-                    for (unsigned int J = 0; J < dim; J++) {
-                      // EDIT - Define Klocal. You will need to use the inverse
-                      // Jacobian ("invJacob") and "detJ"
-                      Klocal[A][B] += basis_gradient(A,xi1, xi2,xi3)[i] * invJacob[i][I] * kappa[I][J]
-                                * basis_gradient(B,xi1,xi2,xi3)[j] * invJacob[j][J]
-                                *weight *detJ;
-                    }
-                  }
-                }
-              }
+            double NdV = N[q][A] * JxW;
+            copy.basis_integral[A] += NdV;
+            for (unsigned int I = 0; I < dim; I++) {
+              copy.flux_integral[A][I] -= conductivity * scratch.gradT[I] * NdV;
             }
           }
         }
+      },
+      [&](const CopyData &copy) {
+        for (unsigned int A = 0; A < dofs_per_elem; A++) {
+          basis_integral[copy.local_dof_indices[A]] += copy.basis_integral[A];
+          for (unsigned int I = 0; I < dim; I++) {
+            heat_flux[I][copy.local_dof_indices[A]] += copy.flux_integral[A][I];
+          }
+        }
+      },
+      sample_scratch, sample_copy);
+
+  for (unsigned int I = 0; I < dim; I++) {
+    for (IndexType i = 0; i < dof_handler.n_dofs(); i++) {
+      heat_flux[I][i] /= basis_integral[i];
+    }
+  }
+}
+
+// Average temperature over the boundary faces with the given id, as the vector
+// j of J = j.D
+template <int dim, typename IndexType>
+Vector<double> FEM<dim, IndexType>::sensor_functional(
+    types::boundary_id sensor) {
+
+  /*For linear elements the integral of a basis function over a (flat) face is
+    the face measure divided by the number of face vertices*/
+  Vector<double> j(dof_handler.n_dofs());
+  std::vector<IndexType> face_dof_indices(fe.dofs_per_face);
+  double sensor_measure = 0.;
+  typename DoFHandler<dim>::active_cell_iterator elem =
+                                                     dof_handler.begin_active(),
+                                                 endc = dof_handler.end();
+  for (; elem != endc; ++elem) {
+    for (unsigned int f = 0; f < elem->n_faces(); f++) {
+      if (!elem->face(f)->at_boundary() ||
+          elem->face(f)->boundary_id() != sensor)
+        continue;
+      get_dof_indices(elem->face(f), face_dof_indices);
+      double measure = elem->face(f)->measure();
+      for (unsigned int i = 0; i < face_dof_indices.size(); i++) {
+        j[face_dof_indices[i]] += measure / face_dof_indices.size();
       }
+      sensor_measure += measure;
     }
+  }
+  AssertThrow(sensor_measure > 0.,
+              ExcMessage("There are no boundary faces with id " +
+                         std::to_string(sensor)));
+  j /= sensor_measure;
+  return j;
+}
 
-    // Assemble local K and F into global K and F
+// Sensitivities of J = j.D to the element conductivities and Dirichlet values
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::compute_sensitivities(const Vector<double> &j) {
+
+  /*Adjoint problem K^T*Z = j, with K as it was solved: the Dirichlet rows
+    are replaced by apply_boundary_values, the columns are kept. The
+    equations of the free dofs are then the adjoint equations, and the
+    equation of a Dirichlet dof i reads
+      K(i,i)*Z_i = j_i - sum_k K(k,i)*Z_k,
+    which is dJ/dg_i: the direct effect of g_i on J minus its effect through
+    the free dofs. So the Dirichlet sensitivities come with the same solve.
+
+    With Z set to zero on the Dirichlet dofs, the conductivity sensitivity
+      dJ/dkappa_e = -Z_e.(dKlocal/dkappa_e).D_e = -int_e grad(Z).grad(T) dV
+    is one independent integral per element; these are computed in
+    parallel with WorkStream.
+    With reducedIntegration the hourglass stabilization is left out of
+    dJ/dkappa_e, i.e. it is the sensitivity of the fully integrated element.*/
+  if (!K_factorized) {
+    K_factorization.initialize(K);
+    K_factorized = true;
+  }
+  Z.reinit(dof_handler.n_dofs());
+  K_factorization.Tvmult(Z, j);
+
+  dirichlet_sensitivity.clear();
+  typename std::map<IndexType, double>::const_iterator bc;
+  for (bc = boundary_values.begin(); bc != boundary_values.end(); ++bc) {
+    dirichlet_sensitivity[bc->first] = K.diag_element(bc->first) * Z[bc->first];
+    Z[bc->first] = 0.;
+  }
+
+  // Sum over the dofs of each boundary id, assigned as in define_boundary_conds
+  boundary_temperature_sensitivity.clear();
+  if (!dirichlet_temperatures.empty()) {
+    std::map<IndexType, types::boundary_id> dof_boundary;
+    std::vector<IndexType> face_dof_indices(fe.dofs_per_face);
+    typename DoFHandler<dim>::active_cell_iterator
+        elem = dof_handler.begin_active(),
+        endc = dof_handler.end();
+    for (; elem != endc; ++elem) {
+      for (unsigned int f = 0; f < elem->n_faces(); f++) {
+        if (!elem->face(f)->at_boundary() ||
+            !dirichlet_temperatures.count(elem->face(f)->boundary_id()))
+          continue;
+        get_dof_indices(elem->face(f), face_dof_indices);
+        for (unsigned int i = 0; i < face_dof_indices.size(); i++) {
+          dof_boundary[face_dof_indices[i]] = elem->face(f)->boundary_id();
+        }
+      }
+    }
+    typename std::map<IndexType, types::boundary_id>::const_iterator dof;
+    for (dof = dof_boundary.begin(); dof != dof_boundary.end(); ++dof) {
+      boundary_temperature_sensitivity[dof->second] +=
+          dirichlet_sensitivity[dof->first];
+    }
+  }
+
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  std::vector<double> weight;
+  std::vector<std::vector<double>> N;
+  std::vector<std::vector<std::vector<double>>> dN;
+  tabulate_basis(weight, N, dN);
+  const unsigned int n_q = weight.size();
+
+  struct ScratchData {
+    std::vector<double> geometry_values; // For geometry.get
+    std::vector<double> gradT, gradZ;
+  };
+  struct CopyData {
+    std::vector<IndexType> local_dof_indices;
+    unsigned int cell;
+    double sensitivity;
+  };
+  ScratchData sample_scratch;
+  sample_scratch.gradT.resize(dim);
+  sample_scratch.gradZ.resize(dim);
+  CopyData sample_copy;
+  sample_copy.local_dof_indices.resize(dofs_per_elem);
+
+  kappa_sensitivity.reinit(triangulation.n_active_cells());
+  WorkStream::run(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          ScratchData &scratch, CopyData &copy) {
+        get_dof_indices(elem, copy.local_dof_indices);
+        const std::vector<IndexType> &dofs = copy.local_dof_indices;
+        copy.cell = elem->active_cell_index();
+        copy.sensitivity = 0.;
+        const typename GeometryCache<dim>::CellGeometry cell_geometry =
+            geometry.get(copy.cell, dofs, scratch.geometry_values);
+        for (unsigned int q = 0; q < n_q; q++) {
+          double JxW = std::abs(cell_geometry.JxW[q]);
+
+          for (unsigned int I = 0; I < dim; I++) {
+            scratch.gradT[I] = 0.;
+            scratch.gradZ[I] = 0.;
+            for (unsigned int A = 0; A < dofs_per_elem; A++) {
+              double dNdx = geometry.shape_gradient(cell_geometry, q, A, I);
+              scratch.gradT[I] += D[dofs[A]] * dNdx;
+              scratch.gradZ[I] += Z[dofs[A]] * dNdx;
+            }
+            copy.sensitivity -= scratch.gradZ[I] * scratch.gradT[I] * JxW;
+          }
+        }
+      },
+      [&](const CopyData &copy) {
+        kappa_sensitivity[copy.cell] = copy.sensitivity;
+      },
+      sample_scratch, sample_copy);
+}
+
+// Consistent heat capacity matrix M_AB = int rho*c*N_A*N_B dV
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::assemble_mass_matrix() {
+
+  /*Linear simplices in closed form, M_AB = measure*(1 + delta_AB)/((dim+1)*(dim+2)),
+    quads/hexes with the Gauss rule of assemble_system(), which is exact on
+    parallelograms/parallelepipeds*/
+  M.reinit(sparsity_pattern);
+  const unsigned int dofs_per_elem = fe.dofs_per_cell;
+  std::vector<double> weight;
+  std::vector<std::vector<double>> N;
+  std::vector<std::vector<std::vector<double>>> dN;
+  tabulate_basis(weight, N, dN);
+  FullMatrix<double> Mlocal(dofs_per_elem, dofs_per_elem);
+  std::vector<IndexType> local_dof_indices(dofs_per_elem);
+  std::vector<double> geometry_values;
+
+  typename DoFHandler<dim>::active_cell_iterator elem =
+                                                     dof_handler.begin_active(),
+                                                 endc = dof_handler.end();
+  for (; elem != endc; ++elem) {
+    get_dof_indices(elem, local_dof_indices);
+    Mlocal = 0.;
+    if (simplexElements) {
+      double measure = elem->measure();
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        for (unsigned int B = 0; B < dofs_per_elem; B++) {
+          Mlocal[A][B] = heat_capacity * measure * (A == B ? 2. : 1.) /
+                         ((dim + 1) * (dim + 2));
+        }
+      }
+    } else {
+      const typename GeometryCache<dim>::CellGeometry cell_geometry =
+          geometry.get(elem->active_cell_index(), local_dof_indices,
+                       geometry_values);
+      for (unsigned int q = 0; q < weight.size(); q++) {
+        double JxW = std::abs(cell_geometry.JxW[q]);
+        for (unsigned int A = 0; A < dofs_per_elem; A++) {
+          for (unsigned int B = 0; B < dofs_per_elem; B++) {
+            Mlocal[A][B] += heat_capacity * N[q][A] * N[q][B] * JxW;
+          }
+        }
+      }
+    }
     for (unsigned int A = 0; A < dofs_per_elem; A++) {
-      // You would assemble F here if it were nonzero.
       for (unsigned int B = 0; B < dofs_per_elem; B++) {
-        // EDIT - Assemble K from Klocal (you can look at lab1)
-        K.add(local_dof_indices[A],local_dof_indices[B],Klocal[A][B]);
+        M.add(local_dof_indices[A], local_dof_indices[B], Mlocal[A][B]);
       }
     }
   }
+}
 
-  // Apply Dirichlet boundary conditions
-  MatrixTools::apply_boundary_values(boundary_values, K, D, F, false);
+// Slowest thermal decay modes (closest to "shift") by shift-invert Lanczos
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::compute_modes(unsigned int n_modes, double shift) {
+
+  assemble_mass_matrix();
+  ShiftInvertLanczos lanczos;
+  unsigned int steps = lanczos.solve(K, M, boundary_values, shift, n_modes,
+                                     eigenvalues, modes);
+
+  std::cout << "   " << n_modes << " decay modes after " << steps
+            << " Lanczos steps" << std::endl;
+  for (unsigned int k = 0; k < eigenvalues.size(); k++) {
+    std::cout << "   Mode " << k + 1 << ": decay rate " << eigenvalues[k]
+              << " 1/s, time constant " << 1. / eigenvalues[k] << " s"
+              << std::endl;
+  }
 }
 
 // Solve for D in KD=F
-template <int dim> void FEM<dim>::solve() {
+template <int dim, typename IndexType> void FEM<dim, IndexType>::solve() {
 
-  // Solve for D
-  SparseDirectUMFPACK A;
-  A.initialize(K);
-  A.vmult(D, F); // D=K^{-1}*F
+  // Solve for D, factorizing K only if it changed since the last solve
+  if (!K_factorized) {
+    K_factorization.initialize(K);
+    K_factorized = true;
+  }
+  K_factorization.vmult(D, F); // D=K^{-1}*F
 }
 
 // Output results
-template <int dim> void FEM<dim>::output_results() {
+template <int dim, typename IndexType>
+void FEM<dim, IndexType>::output_results() {
 
-  // Write results to VTK file
-  std::ofstream output1("solution.vtk");
+  // Write results to VTK file, in the background (asyncFileWriter.h)
+  std::ostream &output1 = output_writer.open("solution.vtk");
   DataOut<dim> data_out;
   data_out.attach_dof_handler(dof_handler);
 
   // Add nodal DOF data
   data_out.add_data_vector(D, nodal_solution_names, DataOut<dim>::type_dof_data,
                            nodal_data_component_interpretation);
-  data_out.build_patches();
+
+  // Conductivity sensitivities (cell data), if compute_sensitivities was called
+  if (kappa_sensitivity.size() == triangulation.n_active_cells()) {
+    data_out.add_data_vector(kappa_sensitivity, "dJ_dkappa");
+  }
+
+  // Decay mode shapes, if compute_modes was called
+  for (unsigned int k = 0; k < modes.size(); k++) {
+    data_out.add_data_vector(modes[k], "mode_" + std::to_string(k + 1));
+  }
+
+  // Add the recovered heat flux components
+  compute_heat_flux();
+  const char *flux_names[] = {"q_x", "q_y", "q_z"};
+  for (unsigned int I = 0; I < dim; I++) {
+    data_out.add_data_vector(heat_flux[I], flux_names[I]);
+  }
+  data_out.build_patches(
+      fe.reference_cell().template get_default_linear_mapping<dim, dim>());
   data_out.write_vtk(output1);
-  output1.close();
+  output_writer.finish();
 }
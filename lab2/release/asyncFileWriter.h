@@ -0,0 +1,539 @@
+#ifndef ASYNCFILEWRITER_H_
+#define ASYNCFILEWRITER_H_
+#include <deal.II/base/exceptions.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+// io_uring (IORING_FEAT_SINGLE_MMAP) needs the headers of Linux 5.4 or later
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_SINGLE_MMAP) && defined(__NR_io_uring_setup)
+#define ASYNCFILEWRITER_IO_URING
+#endif
+#endif
+#endif
+// Standard C++ libraries
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+using namespace dealii;
+
+/*Output files written in the background, so that formatting a large file
+  (DataOut::write_vtk) overlaps with writing it, and the run goes on while
+  the last of it reaches the disk.
+
+  open() returns an std::ostream whose characters are collected in large
+  page-aligned buffers (buffer_size bytes, 4 MB by default). Each full buffer
+  is submitted as one write at its offset in the file, and the stream goes
+  on with the next free buffer; only when all n_buffers are in flight does
+  it wait for one to complete, so at most n_buffers*buffer_size bytes of
+  output are held in memory however large the file. finish() submits the
+  rest of the file and returns at once; the file is closed when its last
+  write completes, which wait() (called by the destructor) waits for.
+
+  The writes go through Linux io_uring (set up directly with the system
+  calls, so no liburing is needed): one ring with a slot per buffer, so all
+  the buffers can be queued in the kernel at once. Where io_uring is not
+  available (an old kernel, or a sandbox that forbids it) a few threads
+  write the buffers with pwrite() instead, with the same ordering and
+  memory bound. Off Linux, or with kernel headers older than 5.4, only the
+  threads are compiled (ASYNCFILEWRITER_IO_URING is not defined). With
+  direct_io the files are opened with O_DIRECT, bypassing the page cache
+  (the last buffer is padded to the page size and the file is truncated to
+  its real size afterwards); file systems (or systems) without O_DIRECT get
+  buffered writes.
+
+  A write error is reported by the next call of open(), finish() or wait()
+  that sees it (the destructor only prints it).*/
+class AsyncFileWriter : private std::streambuf {
+public:
+  AsyncFileWriter(std::size_t buffer_size = 4 << 20,
+                  unsigned int n_buffers = 8, bool direct_io = false);
+  ~AsyncFileWriter();
+
+  // Start a new file (finishing the current one, if any)
+  std::ostream &open(const std::string &filename);
+  // Submit the rest of the current file without waiting for it
+  void finish();
+  // Wait until every file is written and closed
+  void wait();
+
+  // Set to false before the first open() to use the threads
+  bool use_io_uring;
+  // "io_uring" or "threads" (after the first open())
+  const char *backend() const { return ring_fd >= 0 ? "io_uring" : "threads"; }
+  std::size_t bytes_written() const { return total_bytes; }
+
+private:
+  struct Buffer {
+    char *data;
+    std::size_t size, written; // Bytes to write, and written so far
+    off_t offset;              // In the file
+    unsigned int file;         // Index in "files"
+    int fd;
+    struct iovec iov;
+  };
+  struct File {
+    std::string name;
+    int fd;
+    off_t size;          // Bytes of output (without the O_DIRECT padding)
+    unsigned int pending; // Buffers in flight
+    bool finished, direct;
+  };
+
+  // std::streambuf: the put area is the buffer being filled
+  int overflow(int c) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+  void initialize();
+  void acquire_buffer();
+  void submit_current(bool last);
+  void submit(unsigned int b);
+  bool next_completion(unsigned int &b, long &result, bool block);
+  bool complete_one(bool block);
+  void close_finished_files();
+  void check_error();
+
+#ifdef ASYNCFILEWRITER_IO_URING
+  // io_uring
+  bool setup_ring();
+  void ring_submit(unsigned int b);
+  bool ring_completion(unsigned int &b, long &result, bool block);
+#endif
+  // Thread pool fallback
+  void worker();
+
+  std::ostream stream;
+  std::size_t buffer_size;
+  unsigned int n_buffers;
+  bool direct_io;
+  std::vector<Buffer> buffers;
+  std::vector<unsigned int> free_buffers;
+  unsigned int current; // Buffer being filled, n_buffers if none
+  unsigned int in_flight;
+  std::vector<File> files;
+  bool file_open; // files.back() is being written to
+  std::size_t total_bytes;
+  std::string error;
+
+  int ring_fd; // -1 with the threads
+#ifdef ASYNCFILEWRITER_IO_URING
+  unsigned int ring_entries;
+  void *sq_ring, *cq_ring;
+  std::size_t sq_ring_size, cq_ring_size;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+#endif
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable work_ready, work_done;
+  std::deque<unsigned int> queue;
+  std::deque<std::pair<unsigned int, long>> completed;
+  bool stopping;
+};
+
+inline AsyncFileWriter::AsyncFileWriter(std::size_t size, unsigned int n,
+                                        bool direct)
+    : use_io_uring(true), stream(this), buffer_size(size), n_buffers(n),
+      direct_io(direct), current(n), in_flight(0), file_open(false),
+      total_bytes(0), ring_fd(-1),
+#ifdef ASYNCFILEWRITER_IO_URING
+      ring_entries(0), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+      sq_ring_size(0), cq_ring_size(0), sqes(nullptr), cqes(nullptr),
+#endif
+      stopping(false) {
+  // Whole pages, so the buffers also suit O_DIRECT
+  const std::size_t page = sysconf(_SC_PAGE_SIZE);
+  buffer_size = std::max(page, (buffer_size + page - 1) / page * page);
+  n_buffers = std::max(n_buffers, 2u);
+  current = n_buffers;
+}
+
+inline AsyncFileWriter::~AsyncFileWriter() {
+  try {
+    wait();
+  } catch (std::exception &exc) {
+    std::cerr << "   Warning: " << exc.what() << std::endl;
+  }
+  if (!workers.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    work_ready.notify_all();
+    for (unsigned int k = 0; k < workers.size(); k++) {
+      workers[k].join();
+    }
+  }
+#ifdef ASYNCFILEWRITER_IO_URING
+  if (ring_fd >= 0) {
+    if (sqes != nullptr) {
+      munmap(sqes, ring_entries * sizeof(struct io_uring_sqe));
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+  }
+#endif
+  for (unsigned int b = 0; b < buffers.size(); b++) {
+    std::free(buffers[b].data);
+  }
+}
+
+// Buffers and the io_uring ring (or the threads), at the first open()
+inline void AsyncFileWriter::initialize() {
+  buffers.resize(n_buffers);
+  for (unsigned int b = 0; b < n_buffers; b++) {
+    void *data = nullptr;
+    AssertThrow(posix_memalign(&data, sysconf(_SC_PAGE_SIZE), buffer_size) == 0,
+                ExcMessage("Could not allocate the output buffers"));
+    buffers[b].data = static_cast<char *>(data);
+    free_buffers.push_back(n_buffers - 1 - b);
+  }
+#ifdef ASYNCFILEWRITER_IO_URING
+  if (use_io_uring && setup_ring()) return;
+#endif
+  const unsigned int n_workers = std::min(n_buffers, 4u);
+  for (unsigned int k = 0; k < n_workers; k++) {
+    workers.push_back(std::thread(&AsyncFileWriter::worker, this));
+  }
+}
+
+inline std::ostream &AsyncFileWriter::open(const std::string &filename) {
+  if (buffers.empty()) initialize();
+  finish();
+  check_error();
+
+  File file;
+  file.name = filename;
+  file.size = 0;
+  file.pending = 0;
+  file.finished = false;
+  file.direct = direct_io;
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+  file.fd = direct_io ? ::open(filename.c_str(), flags | O_DIRECT, 0644) : -1;
+#else
+  file.fd = -1;
+#endif
+  if (file.fd < 0) {
+    file.direct = false;
+    file.fd = ::open(filename.c_str(), flags, 0644);
+  }
+  AssertThrow(file.fd >= 0, ExcMessage("Could not open " + filename + ": " +
+                                       std::strerror(errno)));
+  files.push_back(file);
+  file_open = true;
+  acquire_buffer();
+  stream.clear();
+  return stream;
+}
+
+inline void AsyncFileWriter::finish() {
+  if (!file_open) return;
+  submit_current(true);
+  file_open = false;
+  files.back().finished = true;
+  close_finished_files();
+  check_error();
+}
+
+inline void AsyncFileWriter::wait() {
+  finish();
+  while (in_flight > 0) {
+    complete_one(true);
+  }
+  close_finished_files();
+  check_error();
+}
+
+inline int AsyncFileWriter::overflow(int c) {
+  if (!file_open) return traits_type::eof();
+  submit_current(false);
+  acquire_buffer();
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+inline std::streamsize AsyncFileWriter::xsputn(const char *s,
+                                               std::streamsize n) {
+  std::streamsize copied = 0;
+  while (copied < n) {
+    if (pptr() == epptr() &&
+        traits_type::eq_int_type(overflow(traits_type::eof()),
+                                 traits_type::eof())) {
+      break;
+    }
+    const std::streamsize chunk = std::min<std::streamsize>(
+        n - copied, epptr() - pptr());
+    std::memcpy(pptr(), s + copied, chunk);
+    pbump(int(chunk));
+    copied += chunk;
+  }
+  return copied;
+}
+
+// Make a free buffer the put area, waiting for a write to complete if needed
+inline void AsyncFileWriter::acquire_buffer() {
+  while (free_buffers.empty()) {
+    complete_one(true);
+  }
+  current = free_buffers.back();
+  free_buffers.pop_back();
+  setp(buffers[current].data, buffers[current].data + buffer_size);
+}
+
+// Submit the put area as the next piece of the current file
+inline void AsyncFileWriter::submit_current(bool last) {
+  if (current == n_buffers) return;
+  Buffer &buffer = buffers[current];
+  File &file = files.back();
+  buffer.size = pptr() - pbase();
+  setp(nullptr, nullptr);
+  if (buffer.size == 0) {
+    free_buffers.push_back(current);
+    current = n_buffers;
+    return;
+  }
+  buffer.written = 0;
+  buffer.offset = file.size;
+  buffer.file = files.size() - 1;
+  buffer.fd = file.fd;
+  file.size += buffer.size;
+  total_bytes += buffer.size;
+  if (last && file.direct) {
+    // O_DIRECT writes whole pages; the file is truncated when it is closed
+    const std::size_t page = sysconf(_SC_PAGE_SIZE);
+    const std::size_t padded = (buffer.size + page - 1) / page * page;
+    std::memset(buffer.data + buffer.size, 0, padded - buffer.size);
+    buffer.size = padded;
+  }
+  file.pending++;
+  submit(current);
+  current = n_buffers;
+}
+
+inline void AsyncFileWriter::submit(unsigned int b) {
+  in_flight++;
+#ifdef ASYNCFILEWRITER_IO_URING
+  if (ring_fd >= 0) {
+    ring_submit(b);
+    return;
+  }
+#endif
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(b);
+  }
+  work_ready.notify_one();
+}
+
+inline bool AsyncFileWriter::next_completion(unsigned int &b, long &result,
+                                             bool block) {
+#ifdef ASYNCFILEWRITER_IO_URING
+  if (ring_fd >= 0) return ring_completion(b, result, block);
+#endif
+  std::unique_lock<std::mutex> lock(mutex);
+  if (block) {
+    work_done.wait(lock, [this] { return !completed.empty(); });
+  } else if (completed.empty()) {
+    return false;
+  }
+  b = completed.front().first;
+  result = completed.front().second;
+  completed.pop_front();
+  return true;
+}
+
+// Handle one completed write: resubmit the rest of a short write, otherwise
+// free the buffer
+inline bool AsyncFileWriter::complete_one(bool block) {
+  unsigned int b;
+  long result;
+  if (!next_completion(b, result, block)) return false;
+  in_flight--;
+  Buffer &buffer = buffers[b];
+  File &file = files[buffer.file];
+  if (result == 0 && buffer.written < buffer.size) result = -EIO;
+  if (result < 0 && error.empty()) {
+    error = "Could not write " + file.name + ": " + std::strerror(-result);
+  }
+  if (result > 0 && buffer.written + result < buffer.size) {
+    buffer.written += result;
+    submit(b);
+    return true;
+  }
+  free_buffers.push_back(b);
+  file.pending--;
+  close_finished_files();
+  return true;
+}
+
+// Close the finished files with no write in flight; the files still being
+// written keep their index, which the buffers refer to
+inline void AsyncFileWriter::close_finished_files() {
+  for (unsigned int k = 0; k < files.size(); k++) {
+    File &file = files[k];
+    if (!file.finished || file.pending > 0 || file.fd < 0) continue;
+    if (file.direct && ftruncate(file.fd, file.size) != 0 && error.empty()) {
+      error = "Could not truncate " + file.name + ": " + std::strerror(errno);
+    }
+    if (close(file.fd) != 0 && error.empty()) {
+      error = "Could not close " + file.name + ": " + std::strerror(errno);
+    }
+    file.fd = -1;
+  }
+  while (!files.empty() && files.back().fd < 0) {
+    files.pop_back();
+  }
+  if (in_flight == 0 && !file_open) files.clear();
+}
+
+inline void AsyncFileWriter::check_error() {
+  if (error.empty()) return;
+  const std::string message = error;
+  error.clear();
+  AssertThrow(false, ExcMessage(message));
+}
+
+#ifdef ASYNCFILEWRITER_IO_URING
+inline bool AsyncFileWriter::setup_ring() {
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, n_buffers, &params);
+  if (ring_fd < 0) return false;
+
+  // The submission and completion rings, in one mapping on newer kernels
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cq_ring_size = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = single_mmap ? sq_ring
+                        : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring_fd,
+                               IORING_OFF_CQ_RING);
+  void *sqe_memory =
+      mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+           IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+      sqe_memory == MAP_FAILED || params.sq_entries < n_buffers) {
+    if (sqe_memory != MAP_FAILED) {
+      munmap(sqe_memory, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    sq_ring = cq_ring = MAP_FAILED;
+    close(ring_fd);
+    ring_fd = -1;
+    return false;
+  }
+  ring_entries = params.sq_entries;
+  char *sq = static_cast<char *>(sq_ring), *cq = static_cast<char *>(cq_ring);
+  sq_head = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+  cq_head = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+  sqes = static_cast<struct io_uring_sqe *>(sqe_memory);
+  cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  return true;
+}
+
+// One slot per buffer, so the submission ring never fills up
+inline void AsyncFileWriter::ring_submit(unsigned int b) {
+  Buffer &buffer = buffers[b];
+  buffer.iov.iov_base = buffer.data + buffer.written;
+  buffer.iov.iov_len = buffer.size - buffer.written;
+
+  const unsigned int tail = *sq_tail;
+  const unsigned int index = tail & *sq_mask;
+  struct io_uring_sqe &sqe = sqes[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_WRITEV;
+  sqe.fd = buffer.fd;
+  sqe.addr = reinterpret_cast<unsigned long>(&buffer.iov);
+  sqe.len = 1;
+  sqe.off = buffer.offset + buffer.written;
+  sqe.user_data = b;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  int submitted;
+  do {
+    submitted = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+  } while (submitted < 0 && (errno == EINTR || errno == EAGAIN));
+  AssertThrow(submitted >= 0, ExcMessage(std::string("io_uring_enter: ") +
+                                         std::strerror(errno)));
+}
+
+inline bool AsyncFileWriter::ring_completion(unsigned int &b, long &result,
+                                             bool block) {
+  unsigned int head = *cq_head;
+  while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    if (!block) return false;
+    const int status = syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                               IORING_ENTER_GETEVENTS, nullptr, 0);
+    AssertThrow(status >= 0 || errno == EINTR,
+                ExcMessage(std::string("io_uring_enter: ") +
+                           std::strerror(errno)));
+  }
+  const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+  b = cqe.user_data;
+  result = cqe.res;
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+#endif
+
+inline void AsyncFileWriter::worker() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    work_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty()) return;
+    const unsigned int b = queue.front();
+    queue.pop_front();
+    const Buffer buffer = buffers[b];
+    lock.unlock();
+    long result = pwrite(buffer.fd, buffer.data + buffer.written,
+                         buffer.size - buffer.written,
+                         buffer.offset + buffer.written);
+    if (result < 0) result = -errno;
+    lock.lock();
+    completed.push_back(std::make_pair(b, result));
+    work_done.notify_one();
+  }
+}
+
+#endif
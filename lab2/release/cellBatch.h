@@ -0,0 +1,142 @@
+#ifndef CELLBATCH_H_
+#define CELLBATCH_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/vectorization.h>
+// Standard C++ libraries
+#include <vector>
+using namespace dealii;
+
+/*Element stiffness matrices of several quads/hexes at once, one element per
+  SIMD lane.
+
+  A 2x2 or 3x3 Jacobian and an 8x8 Klocal are too small to keep the vector
+  units busy within one element, so VectorizedArray<double>::size() elements
+  (2 with SSE2, 4 with AVX2, 8 with AVX-512, whatever deal.II was compiled
+  for) go through the same operations side by side: lane l of every number
+  belongs to element l. The node coordinates come in an array-of-structs-of-
+  arrays layout, coordinates[A*dim + i] holding x_i of node A of all the
+  elements, and Klocal is returned the same way, Klocal[A*dofs_per_elem + B].
+
+  The basis function gradients at the quadrature points are the same for
+  every element and stay scalars (from FEM::tabulate_basis). The conductivity
+  is isotropic, kappa = conductivity*I, as in FEM::assemble_system. The result
+  equals geometry_Klocal up to rounding (the sums are in a different
+  order).*/
+template <int dim> class CellBatchKernel {
+public:
+  typedef VectorizedArray<double> Number;
+  static constexpr unsigned int n_nodes = 1u << dim; // Linear quad/hex
+
+  // Quadrature weights and basis gradients dN[q][A][j] (d N_A / d xi_j)
+  void reinit(const std::vector<double> &weight,
+              const std::vector<std::vector<std::vector<double>>> &dN);
+
+  // Klocal of the elements in the lanes of coordinates and conductivity
+  void stiffness(const Number *coordinates, const Number &conductivity,
+                 Number *Klocal) const;
+
+  unsigned int n_q;
+  std::vector<double> quad_weight;
+  std::vector<double> gradient; // [(q*n_nodes + A)*dim + j]
+};
+
+template <int dim>
+void CellBatchKernel<dim>::reinit(
+    const std::vector<double> &weight,
+    const std::vector<std::vector<std::vector<double>>> &dN) {
+  n_q = weight.size();
+  AssertThrow(n_q > 0 && dN.size() == n_q && dN[0].size() == n_nodes,
+              ExcMessage("The batched kernel is for linear quads/hexes"));
+  quad_weight = weight;
+  gradient.resize(n_q * n_nodes * dim);
+  for (unsigned int q = 0; q < n_q; q++) {
+    for (unsigned int A = 0; A < n_nodes; A++) {
+      for (unsigned int j = 0; j < dim; j++) {
+        gradient[(q * n_nodes + A) * dim + j] = dN[q][A][j];
+      }
+    }
+  }
+}
+
+template <int dim>
+void CellBatchKernel<dim>::stiffness(const Number *coordinates,
+                                     const Number &conductivity,
+                                     Number *Klocal) const {
+  for (unsigned int k = 0; k < n_nodes * n_nodes; k++) {
+    Klocal[k] = 0.;
+  }
+
+  Number Jacobian[dim][dim], invJacob[dim][dim], detJ;
+  Number grad[n_nodes][dim]; // Gradients in x of the basis functions
+  for (unsigned int q = 0; q < n_q; q++) {
+    const double *dN = &gradient[q * n_nodes * dim];
+
+    // Jacobian[i][j] = d x_i / d xi_j
+    for (unsigned int i = 0; i < dim; i++) {
+      for (unsigned int j = 0; j < dim; j++) {
+        Jacobian[i][j] = 0.;
+        for (unsigned int A = 0; A < n_nodes; A++) {
+          Jacobian[i][j] += coordinates[A * dim + i] * dN[A * dim + j];
+        }
+      }
+    }
+
+    // Determinant and inverse from the cofactors
+    if constexpr (dim == 2) {
+      detJ = Jacobian[0][0] * Jacobian[1][1] - Jacobian[0][1] * Jacobian[1][0];
+      const Number inv_det = 1. / detJ;
+      invJacob[0][0] = Jacobian[1][1] * inv_det;
+      invJacob[0][1] = -Jacobian[0][1] * inv_det;
+      invJacob[1][0] = -Jacobian[1][0] * inv_det;
+      invJacob[1][1] = Jacobian[0][0] * inv_det;
+    } else {
+      for (unsigned int i = 0; i < 3; i++) {
+        const unsigned int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+        for (unsigned int j = 0; j < 3; j++) {
+          const unsigned int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+          // Cofactor of Jacobian[j][i], i.e. the adjugate
+          invJacob[i][j] = Jacobian[j1][i1] * Jacobian[j2][i2] -
+                           Jacobian[j1][i2] * Jacobian[j2][i1];
+        }
+      }
+      detJ = Jacobian[0][0] * invJacob[0][0] + Jacobian[0][1] * invJacob[1][0] +
+             Jacobian[0][2] * invJacob[2][0];
+      const Number inv_det = 1. / detJ;
+      for (unsigned int i = 0; i < 3; i++) {
+        for (unsigned int j = 0; j < 3; j++) {
+          invJacob[i][j] *= inv_det;
+        }
+      }
+    }
+
+    for (unsigned int A = 0; A < n_nodes; A++) {
+      for (unsigned int I = 0; I < dim; I++) {
+        grad[A][I] = dN[A * dim] * invJacob[0][I];
+        for (unsigned int i = 1; i < dim; i++) {
+          grad[A][I] += dN[A * dim + i] * invJacob[i][I];
+        }
+      }
+    }
+
+    // Upper triangle of Klocal += kappa*grad(N_A).grad(N_B)*detJ*weight
+    const Number factor = conductivity * detJ * quad_weight[q];
+    for (unsigned int A = 0; A < n_nodes; A++) {
+      for (unsigned int B = A; B < n_nodes; B++) {
+        Number dot = grad[A][0] * grad[B][0];
+        for (unsigned int I = 1; I < dim; I++) {
+          dot += grad[A][I] * grad[B][I];
+        }
+        Klocal[A * n_nodes + B] += factor * dot;
+      }
+    }
+  }
+
+  // Klocal is symmetric
+  for (unsigned int A = 1; A < n_nodes; A++) {
+    for (unsigned int B = 0; B < A; B++) {
+      Klocal[A * n_nodes + B] = Klocal[B * n_nodes + A];
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,351 @@
+#ifndef COMPRESSEDSPARSEMATRIX_H_
+#define COMPRESSEDSPARSEMATRIX_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/parallel.h>
+#include <deal.II/base/types.h>
+#include <deal.II/lac/sparse_matrix.h>
+#include <deal.II/lac/vector.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../../lab1/dofIndices.h"
+
+using namespace dealii;
+
+/*Copy of a SparseMatrix<double> for matrix-vector products (e.g. the CG
+  iterations of topologyOptimization.h) with compressed column indices.
+
+  In a CSR product every nonzero costs 8 bytes of value plus 4 (or 8, with 64
+  bit indices) bytes of column index, so the indices are a third of the memory
+  traffic or more. On the FEM2a/FEM2b meshes the columns of a few neighboring
+  rows lie within a narrow band, so the rows are grouped in blocks of
+  rows_per_block and each block stores one base column (its smallest column)
+  and 16 bit offsets from it: 10 bytes per nonzero instead of 12 or 16. A block
+  whose columns span 2^16 or more (badly numbered dofs, very large meshes)
+  keeps full IndexType columns instead, so any matrix can be stored.
+
+  vmult() decodes the offsets four at a time with AVX2 gathers if the code is
+  compiled with AVX2 enabled (e.g. -mavx2 or -march=native), and with a plain
+  loop otherwise. The sums are in a different order than SparseMatrix::vmult,
+  so the results can differ in the last bits.
+
+  For square matrices precondition_SSOR() runs the SSOR sweeps on the same
+  compressed storage (see PreconditionCompressedSSOR below), so a CG solve
+  never touches the full CSR matrix. This needs the layout SparseMatrix gives
+  square matrices: the diagonal first in each row, then the other columns in
+  increasing order.*/
+template <typename IndexType = unsigned int> class CompressedSparseMatrix {
+public:
+  CompressedSparseMatrix();
+
+  // Structure and values of K (call again if the sparsity pattern changes)
+  void reinit(const SparseMatrix<double> &K);
+  // Values of K, with the sparsity pattern given to reinit()
+  void copy_values(const SparseMatrix<double> &K);
+
+  // dst = K*src
+  void vmult(Vector<double> &dst, const Vector<double> &src) const;
+  /*dst = M^-1*src for the SSOR preconditioner
+      M = omega/(2 - omega)*(D/omega + L)*D^-1*(D/omega + U)
+    (square matrices with a nonzero diagonal; the sweeps are sequential)*/
+  void precondition_SSOR(Vector<double> &dst, const Vector<double> &src,
+                         double omega) const;
+
+  types::global_dof_index m() const { return n_rows; }
+  types::global_dof_index n() const { return n_cols; }
+  std::size_t n_nonzero_elements() const { return values.size(); }
+  // Memory per nonzero (values, indices and row/block data), in bytes
+  double bytes_per_nonzero() const;
+  // Matrix bytes per nonzero read by one precondition_SSOR()
+  double SSOR_bytes_per_nonzero() const;
+  // Fraction of the nonzeros stored with 16 bit column offsets
+  double compressed_fraction() const;
+
+  static constexpr unsigned int rows_per_block = 32;
+
+private:
+  void vmult_block(unsigned int block, Vector<double> &dst,
+                   const Vector<double> &src) const;
+  // Column of entry k of this row
+  types::global_dof_index column(types::global_dof_index row,
+                                 std::size_t k) const;
+
+  types::global_dof_index n_rows, n_cols;
+  std::vector<std::size_t> row_start; // Start of each row in values
+  std::vector<double> values;
+
+  // Per block: base column, whether the 16 bit offsets are used, and the
+  // start of its columns in short_columns or wide_columns
+  std::vector<IndexType> block_base;
+  std::vector<unsigned char> block_compressed;
+  std::vector<std::size_t> block_column_start;
+  std::vector<std::uint16_t> short_columns;
+  std::vector<IndexType> wide_columns;
+  // Square matrices: entries of each row up to its first column right of the
+  // diagonal (the diagonal and the lower triangle), for the SSOR sweeps
+  std::vector<unsigned int> upper_start;
+};
+
+/*SSOR preconditioner on a CompressedSparseMatrix, used like
+  PreconditionSSOR<SparseMatrix<double>> (e.g. with SolverCG).*/
+template <typename IndexType = unsigned int> class PreconditionCompressedSSOR {
+public:
+  PreconditionCompressedSSOR() : matrix(nullptr), omega(1.) {}
+
+  void initialize(const CompressedSparseMatrix<IndexType> &A,
+                  double relaxation = 1.) {
+    matrix = &A;
+    omega = relaxation;
+  }
+  void vmult(Vector<double> &dst, const Vector<double> &src) const {
+    AssertThrow(matrix != nullptr,
+                ExcMessage("PreconditionCompressedSSOR is not initialized"));
+    matrix->precondition_SSOR(dst, src, omega);
+  }
+
+private:
+  const CompressedSparseMatrix<IndexType> *matrix;
+  double omega;
+};
+
+template <typename IndexType>
+CompressedSparseMatrix<IndexType>::CompressedSparseMatrix()
+    : n_rows(0), n_cols(0) {}
+
+template <typename IndexType>
+void CompressedSparseMatrix<IndexType>::reinit(const SparseMatrix<double> &K) {
+  check_index_range<IndexType>(K.n());
+  n_rows = K.m();
+  n_cols = K.n();
+  const unsigned int n_blocks = (n_rows + rows_per_block - 1) / rows_per_block;
+
+  row_start.resize(n_rows + 1);
+  values.resize(K.n_nonzero_elements());
+  block_base.resize(n_blocks);
+  block_compressed.resize(n_blocks);
+  block_column_start.resize(n_blocks);
+  short_columns.clear();
+  wide_columns.clear();
+  upper_start.clear();
+
+  row_start[0] = 0;
+  for (unsigned int block = 0; block < n_blocks; block++) {
+    const types::global_dof_index first_row =
+        types::global_dof_index(block) * rows_per_block;
+    const types::global_dof_index last_row =
+        std::min<types::global_dof_index>(first_row + rows_per_block, n_rows);
+
+    // Column span of the block
+    types::global_dof_index min_column = n_cols, max_column = 0;
+    for (types::global_dof_index row = first_row; row < last_row; row++) {
+      SparseMatrix<double>::const_iterator entry = K.begin(row);
+      for (; entry != K.end(row); ++entry) {
+        min_column = std::min(min_column, entry->column());
+        max_column = std::max(max_column, entry->column());
+      }
+    }
+    if (min_column > max_column) min_column = max_column = 0; // Empty rows
+    block_base[block] = IndexType(min_column);
+    block_compressed[block] = (max_column - min_column < 65536);
+    block_column_start[block] =
+        block_compressed[block] ? short_columns.size() : wide_columns.size();
+
+    std::size_t k = row_start[first_row];
+    for (types::global_dof_index row = first_row; row < last_row; row++) {
+      SparseMatrix<double>::const_iterator entry = K.begin(row);
+      for (; entry != K.end(row); ++entry, ++k) {
+        values[k] = entry->value();
+        if (block_compressed[block]) {
+          short_columns.push_back(std::uint16_t(entry->column() - min_column));
+        } else {
+          wide_columns.push_back(IndexType(entry->column()));
+        }
+      }
+      row_start[row + 1] = k;
+    }
+  }
+  AssertThrow(row_start[n_rows] == values.size(),
+              ExcMessage("Entries of the sparse matrix do not add up"));
+
+  // Rows must start with the diagonal, as in any square SparseMatrix
+  if (n_rows != n_cols) return;
+  upper_start.resize(n_rows);
+  for (types::global_dof_index row = 0; row < n_rows; row++) {
+    SparseMatrix<double>::const_iterator entry = K.begin(row);
+    if (entry == K.end(row) || entry->column() != row) {
+      upper_start.clear();
+      return;
+    }
+    unsigned int n = 1;
+    for (++entry; entry != K.end(row) && entry->column() < row; ++entry) n++;
+    upper_start[row] = n;
+  }
+}
+
+template <typename IndexType>
+void CompressedSparseMatrix<IndexType>::copy_values(
+    const SparseMatrix<double> &K) {
+  AssertThrow(K.m() == n_rows && K.n_nonzero_elements() == values.size(),
+              ExcMessage("copy_values() needs the sparsity pattern of reinit()"));
+  parallel::apply_to_subranges(
+      std::size_t(0), std::size_t(n_rows),
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t row = first; row < last; row++) {
+          std::size_t k = row_start[row];
+          SparseMatrix<double>::const_iterator entry = K.begin(row);
+          for (; entry != K.end(row); ++entry, ++k) {
+            values[k] = entry->value();
+          }
+        }
+      },
+      4096);
+}
+
+template <typename IndexType>
+void CompressedSparseMatrix<IndexType>::vmult(Vector<double> &dst,
+                                              const Vector<double> &src) const {
+  AssertThrow(dst.size() == n_rows && src.size() == n_cols,
+              ExcMessage("Vector sizes do not match the matrix"));
+  const unsigned int n_blocks = block_base.size();
+  parallel::apply_to_subranges(
+      std::size_t(0), std::size_t(n_blocks),
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t block = first; block < last; block++) {
+          vmult_block(block, dst, src);
+        }
+      },
+      64);
+}
+
+template <typename IndexType>
+void CompressedSparseMatrix<IndexType>::vmult_block(
+    unsigned int block, Vector<double> &dst, const Vector<double> &src) const {
+  const types::global_dof_index first_row =
+      types::global_dof_index(block) * rows_per_block;
+  const types::global_dof_index last_row =
+      std::min<types::global_dof_index>(first_row + rows_per_block, n_rows);
+  // Position of the block's first entry, to index its columns
+  const std::size_t first_entry = row_start[first_row];
+
+  if (!block_compressed[block]) {
+    const IndexType *column = wide_columns.data() + block_column_start[block];
+    for (types::global_dof_index row = first_row; row < last_row; row++) {
+      double sum = 0.;
+      for (std::size_t k = row_start[row]; k < row_start[row + 1]; k++) {
+        sum += values[k] * src[column[k - first_entry]];
+      }
+      dst[row] = sum;
+    }
+    return;
+  }
+
+  // src shifted to the base column, so the offsets index it directly
+  const double *x = src.begin() + block_base[block];
+  const std::uint16_t *offset = short_columns.data() + block_column_start[block];
+  for (types::global_dof_index row = first_row; row < last_row; row++) {
+    std::size_t k = row_start[row];
+    const std::size_t end = row_start[row + 1];
+    double sum = 0.;
+#ifdef __AVX2__
+    // Four offsets widened to 32 bit, four gathered entries of src
+    __m256d sum4 = _mm256_setzero_pd();
+    for (; k + 4 <= end; k += 4) {
+      __m128i offset4 = _mm_cvtepu16_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(offset + k - first_entry)));
+      __m256d x4 = _mm256_i32gather_pd(x, offset4, 8);
+      sum4 = _mm256_add_pd(sum4, _mm256_mul_pd(_mm256_loadu_pd(&values[k]), x4));
+    }
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4),
+                              _mm256_extractf128_pd(sum4, 1));
+    sum = _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+#endif
+    for (; k < end; k++) {
+      sum += values[k] * x[offset[k - first_entry]];
+    }
+    dst[row] = sum;
+  }
+}
+
+template <typename IndexType>
+types::global_dof_index
+CompressedSparseMatrix<IndexType>::column(types::global_dof_index row,
+                                          std::size_t k) const {
+  const unsigned int block = row / rows_per_block;
+  const std::size_t position =
+      block_column_start[block] + k -
+      row_start[types::global_dof_index(block) * rows_per_block];
+  if (block_compressed[block]) {
+    return types::global_dof_index(block_base[block]) + short_columns[position];
+  }
+  return wide_columns[position];
+}
+
+template <typename IndexType>
+void CompressedSparseMatrix<IndexType>::precondition_SSOR(
+    Vector<double> &dst, const Vector<double> &src, double omega) const {
+  AssertThrow(upper_start.size() == n_rows && dst.size() == n_rows &&
+                  src.size() == n_rows,
+              ExcMessage("SSOR needs a square matrix with its diagonal and "
+                         "matching vectors"));
+
+  // (D/omega + L)*dst = src
+  for (types::global_dof_index row = 0; row < n_rows; row++) {
+    const std::size_t first = row_start[row];
+    double sum = src[row];
+    for (std::size_t k = first + 1; k < first + upper_start[row]; k++) {
+      sum -= values[k] * dst[column(row, k)];
+    }
+    dst[row] = sum * omega / values[first];
+  }
+  // dst = (2 - omega)/omega*D*dst
+  for (types::global_dof_index row = 0; row < n_rows; row++) {
+    dst[row] *= (2. - omega) / omega * values[row_start[row]];
+  }
+  // (D/omega + U)*dst = dst
+  for (types::global_dof_index row = n_rows; row-- > 0;) {
+    const std::size_t first = row_start[row];
+    double sum = dst[row];
+    for (std::size_t k = first + upper_start[row]; k < row_start[row + 1];
+         k++) {
+      sum -= values[k] * dst[column(row, k)];
+    }
+    dst[row] = sum * omega / values[first];
+  }
+}
+
+template <typename IndexType>
+double CompressedSparseMatrix<IndexType>::bytes_per_nonzero() const {
+  if (values.empty()) return 0.;
+  const std::size_t bytes =
+      values.size() * sizeof(double) +
+      short_columns.size() * sizeof(std::uint16_t) +
+      wide_columns.size() * sizeof(IndexType) +
+      row_start.size() * sizeof(std::size_t) +
+      block_base.size() *
+          (sizeof(IndexType) + sizeof(unsigned char) + sizeof(std::size_t));
+  return double(bytes) / values.size();
+}
+
+template <typename IndexType>
+double CompressedSparseMatrix<IndexType>::SSOR_bytes_per_nonzero() const {
+  if (values.empty()) return 0.;
+  // The sweeps read every entry once and the diagonal three times, plus the
+  // row starts twice and upper_start
+  const double diagonal_bytes = 2. * n_rows * sizeof(double);
+  const double row_bytes =
+      n_rows * (2. * sizeof(std::size_t) + sizeof(unsigned int));
+  return bytes_per_nonzero() + (diagonal_bytes + row_bytes) / values.size();
+}
+
+template <typename IndexType>
+double CompressedSparseMatrix<IndexType>::compressed_fraction() const {
+  if (values.empty()) return 1.;
+  return double(short_columns.size()) / values.size();
+}
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef DRYRUN_H_
+#define DRYRUN_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/lac/precondition.h>
+#include <deal.II/lac/solver_cg.h>
+#include <deal.II/lac/solver_control.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+using namespace dealii;
+
+/*Size, memory and runtime of a run on the generated box mesh
+  (FEM::generate_mesh), predicted from the number of elements along each
+  direction before any of it is allocated, so a job that cannot fit is
+  refused in seconds instead of failing (or swapping) hours later. The
+  elements are the linear quads/hexes or simplices of FEM; the solver is
+  the UMFPACK factorization of FEM::solve or the SSOR preconditioned CG of
+  the topology optimization.
+
+  The counts follow from the structured grid: (n_1+1)...(n_dim+1) dofs, and
+  for quads/hexes (3 n_1+1)...(3 n_dim+1) nonzeros in K exactly (a node
+  couples to the 3^dim nodes around it). For simplices every edge of the
+  grid and one diagonal per face of a box are counted, which the
+  calibration corrects. The memory is the largest of two moments:
+    setup: the mesh and the sparsity pattern before compress(), which has
+           room for max_couplings_between_dofs() entries in every row and is
+           often the real peak of a run;
+    solve: the mesh, K and its pattern, the vectors, the geometry cache and
+           either the LU factors or the CG vectors.
+  The LU factors follow the fill of a nested dissection ordering of a grid,
+  fill_coefficient*N^(4/3) entries in 3D and fill_coefficient*N log2 N in
+  2D, with 16 bytes per entry (a value and a 64 bit index), and take
+  about N^2 (3D) or N^1.5 (2D) operations.
+
+  The runtimes scale the per-phase times of a calibration run: calibrate()
+  solves a small box with a problem configured like the real one and
+  measures cells per second for setup and assembly, the factorization time,
+  the CG iterations and time per nonzero, and the factor memory (from the
+  resident set size). Until then only the memory is estimated, from the
+  default constants. Extrapolating from a small run is rough: take the
+  estimate as an order of magnitude, with a safety margin (memory_fraction)
+  on the memory.*/
+template <int dim> class DryRun {
+public:
+  enum Solver { direct, iterative };
+
+  struct Estimate {
+    std::vector<unsigned int> n_elements;
+    bool simplex;
+    Solver solver;
+    double n_cells, n_dofs, nonzeros, sparsity; // Sparsity: nonzeros/N^2
+    double matrix_bytes;   // K and its compressed pattern
+    double pattern_bytes;  // Pattern before compress()
+    double mesh_bytes, vector_bytes, geometry_bytes;
+    double factor_entries, factor_bytes; // LU fill (direct solver)
+    double setup_peak_bytes, solve_peak_bytes, peak_bytes;
+    double cg_iterations;
+    double setup_seconds, assembly_seconds, solve_seconds; // 0: not calibrated
+  };
+
+  DryRun();
+
+  // Estimate for a box of n_elements[i] elements along direction i
+  Estimate estimate(const std::vector<unsigned int> &n_elements, bool simplex,
+                    Solver solver, double geometry_cache_memory = 0.) const;
+
+  /*Calibrate on a small box, solved with "problem" (a FEM configured like the
+    real run, on which no mesh was generated yet) by both solvers*/
+  template <typename Problem> void calibrate(Problem &problem);
+
+  void print(const Estimate &estimate) const;
+  // Throw if the peak memory is above memory_fraction of the available memory
+  void check_memory(const Estimate &estimate) const;
+
+  // Bytes this process can still allocate without swapping (MemAvailable,
+  // capped by the cgroup limit), or 0 if unknown
+  static double available_memory();
+  // Resident set size of this process in bytes, or 0 if unknown
+  static double resident_memory();
+
+  // Model constants: defaults, or measured by calibrate()
+  double simplices_per_box;   // Simplices generated per box of the grid
+  double simplex_nonzero_ratio; // Measured/counted nonzeros for simplices
+  double max_couplings;       // Row length of the pattern before compress()
+  double mesh_bytes_per_cell; // Triangulation and DoFHandler
+  double fill_coefficient;
+  double setup_cells_per_second, assembly_cells_per_second;
+  double factorization_coefficient; // Seconds per N^2 (3D) or N^1.5 (2D)
+  double cg_iterations_per_element; // CG iterations per element along the box
+  double cg_seconds_per_nonzero;    // One iteration costs this per nonzero
+  bool calibrated, calibrated_simplex;
+
+  double memory_fraction; // Part of the available memory a run may use
+
+private:
+  double nested_dissection_fill(double n_dofs) const {
+    return (dim == 3) ? std::pow(n_dofs, 4. / 3.)
+                      : n_dofs * std::max(std::log2(n_dofs), 1.);
+  }
+  double factorization_work(double n_dofs) const {
+    return std::pow(n_dofs, (dim == 3) ? 2. : 1.5);
+  }
+};
+
+template <int dim> DryRun<dim>::DryRun() {
+  simplices_per_box = (dim == 2) ? 2. : 5.;
+  simplex_nonzero_ratio = 1.;
+  // deal.II's bound for linear elements on a mesh with up to 2^dim cells at
+  // a vertex
+  max_couplings = (dim == 2) ? 19. : 343.;
+  mesh_bytes_per_cell = (dim == 2) ? 400. : 1000.;
+  fill_coefficient = (dim == 2) ? 5. : 30.;
+  setup_cells_per_second = 0.;
+  assembly_cells_per_second = 0.;
+  factorization_coefficient = 0.;
+  cg_iterations_per_element = 0.;
+  cg_seconds_per_nonzero = 0.;
+  calibrated = false;
+  calibrated_simplex = false;
+  memory_fraction = 0.8;
+}
+
+template <int dim>
+typename DryRun<dim>::Estimate
+DryRun<dim>::estimate(const std::vector<unsigned int> &n_elements,
+                      bool simplex, Solver solver,
+                      double geometry_cache_memory) const {
+  AssertThrow(n_elements.size() == dim,
+              ExcMessage("One number of elements per direction is needed"));
+  Estimate e;
+  e.n_elements = n_elements;
+  e.simplex = simplex;
+  e.solver = solver;
+
+  double boxes = 1., nodes = 1., hex_nonzeros = 1., max_elements = 0.;
+  for (unsigned int i = 0; i < dim; i++) {
+    boxes *= n_elements[i];
+    nodes *= n_elements[i] + 1.;
+    hex_nonzeros *= 3. * n_elements[i] + 1.;
+    max_elements = std::max(max_elements, double(n_elements[i]));
+  }
+  e.n_cells = simplex ? simplices_per_box * boxes : boxes;
+  e.n_dofs = nodes;
+  if (!simplex) {
+    e.nonzeros = hex_nonzeros;
+  } else {
+    // Edges along the grid lines and one diagonal per face of a box
+    double edges = 0.;
+    for (unsigned int i = 0; i < dim; i++) {
+      double grid_edges = n_elements[i];
+      for (unsigned int j = 0; j < dim; j++) {
+        if (j != i) grid_edges *= n_elements[j] + 1.;
+      }
+      edges += grid_edges;
+      for (unsigned int j = i + 1; j < dim; j++) {
+        double diagonals = double(n_elements[i]) * n_elements[j];
+        for (unsigned int k = 0; k < dim; k++) {
+          if (k != i && k != j) diagonals *= n_elements[k] + 1.;
+        }
+        edges += diagonals;
+      }
+    }
+    e.nonzeros = simplex_nonzero_ratio * (nodes + 2. * edges);
+  }
+  e.sparsity = e.nonzeros / (e.n_dofs * e.n_dofs);
+
+  // SparsityPattern: 4 byte column indices, 8 byte row starts
+  e.pattern_bytes = e.n_dofs * (max_couplings * 4. + 8.);
+  e.matrix_bytes = e.nonzeros * (8. + 4.) + e.n_dofs * 8.;
+  e.mesh_bytes = mesh_bytes_per_cell * e.n_cells;
+  // nodeLocation, D and F
+  e.vector_bytes = e.n_dofs * (dim + 2) * 8.;
+  const double n_q = simplex ? 1. : double(1u << dim);
+  e.geometry_bytes = std::min(std::max(geometry_cache_memory, 0.) * 1.e6,
+                              e.n_cells * n_q * (1. + dim * dim) * 8.);
+
+  e.factor_entries = 0.;
+  e.factor_bytes = 0.;
+  e.cg_iterations = 0.;
+  double solver_bytes;
+  if (solver == direct) {
+    e.factor_entries = fill_coefficient * nested_dissection_fill(e.n_dofs);
+    e.factor_bytes = 16. * e.factor_entries;
+    solver_bytes = e.factor_bytes;
+  } else {
+    // Residual, direction, product and solution
+    e.cg_iterations = cg_iterations_per_element * max_elements;
+    solver_bytes = 4. * e.n_dofs * 8.;
+  }
+  // The support points are collected in a temporary during setup
+  e.setup_peak_bytes =
+      e.mesh_bytes + e.pattern_bytes + 2. * e.n_dofs * dim * 8.;
+  e.solve_peak_bytes = e.mesh_bytes + e.matrix_bytes + e.vector_bytes +
+                       e.geometry_bytes + solver_bytes;
+  e.peak_bytes = std::max(e.setup_peak_bytes, e.solve_peak_bytes);
+
+  e.setup_seconds = 0.;
+  e.assembly_seconds = 0.;
+  e.solve_seconds = 0.;
+  if (calibrated) {
+    e.setup_seconds = e.n_cells / setup_cells_per_second;
+    e.assembly_seconds = e.n_cells / assembly_cells_per_second;
+    if (solver == direct) {
+      e.solve_seconds =
+          factorization_coefficient * factorization_work(e.n_dofs);
+    } else {
+      e.solve_seconds = e.cg_iterations * e.nonzeros * cg_seconds_per_nonzero;
+    }
+  }
+  return e;
+}
+
+template <int dim>
+template <typename Problem>
+void DryRun<dim>::calibrate(Problem &problem) {
+  typedef std::chrono::steady_clock Clock;
+  const std::vector<unsigned int> n_elements(dim, (dim == 2) ? 64 : 12);
+  std::cout << "Calibrating the dry run on a " << n_elements[0];
+  for (unsigned int i = 1; i < dim; i++) {
+    std::cout << " x " << n_elements[i];
+  }
+  std::cout << " box" << std::endl;
+
+  const Clock::time_point start = Clock::now();
+  problem.generate_mesh(n_elements);
+  problem.setup_system();
+  const Clock::time_point setup_end = Clock::now();
+  problem.assemble_system();
+  const Clock::time_point assembly_end = Clock::now();
+  const double memory_before = resident_memory();
+  problem.solve();
+  const Clock::time_point solve_end = Clock::now();
+  const double factor_memory = resident_memory() - memory_before;
+
+  const double n_cells = problem.triangulation.n_active_cells();
+  const double n_dofs = problem.dof_handler.n_dofs();
+  const double seconds = 1.e-9; // Floor for the timer resolution
+  calibrated_simplex = problem.simplexElements;
+  if (calibrated_simplex) {
+    double boxes = 1.;
+    for (unsigned int i = 0; i < dim; i++) {
+      boxes *= n_elements[i];
+    }
+    simplices_per_box = n_cells / boxes;
+    simplex_nonzero_ratio = 1.;
+    simplex_nonzero_ratio =
+        problem.sparsity_pattern.n_nonzero_elements() /
+        estimate(n_elements, true, direct).nonzeros;
+  }
+  max_couplings = problem.dof_handler.max_couplings_between_dofs();
+  mesh_bytes_per_cell = (problem.triangulation.memory_consumption() +
+                         problem.dof_handler.memory_consumption()) /
+                        n_cells;
+  if (factor_memory > 0.) {
+    fill_coefficient = factor_memory / 16. / nested_dissection_fill(n_dofs);
+  }
+  setup_cells_per_second =
+      n_cells /
+      std::max(std::chrono::duration<double>(setup_end - start).count(),
+               seconds);
+  assembly_cells_per_second =
+      n_cells / std::max(std::chrono::duration<double>(assembly_end -
+                                                       setup_end).count(),
+                         seconds);
+  factorization_coefficient =
+      std::max(std::chrono::duration<double>(solve_end - assembly_end).count(),
+               seconds) /
+      factorization_work(n_dofs);
+
+  // The same system with the CG solver and preconditioner of the topology
+  // optimization
+  Vector<double> x(problem.D.size());
+  SolverControl control(10 * problem.D.size(), 1.e-10 * problem.F.l2_norm());
+  SolverCG<Vector<double>> solver(control);
+  PreconditionSSOR<SparseMatrix<double>> preconditioner;
+  preconditioner.initialize(problem.K, 1.2);
+  const Clock::time_point cg_start = Clock::now();
+  solver.solve(problem.K, x, problem.F, preconditioner);
+  const double cg_seconds = std::max(
+      std::chrono::duration<double>(Clock::now() - cg_start).count(), seconds);
+  const double iterations = std::max(control.last_step(), 1u);
+  cg_iterations_per_element = iterations / n_elements[0];
+  cg_seconds_per_nonzero =
+      cg_seconds / iterations / problem.sparsity_pattern.n_nonzero_elements();
+  calibrated = true;
+}
+
+template <int dim> void DryRun<dim>::print(const Estimate &e) const {
+  const double MB = 1.e6;
+  std::cout << "Dry run estimate for a " << e.n_elements[0];
+  for (unsigned int i = 1; i < dim; i++) {
+    std::cout << " x " << e.n_elements[i];
+  }
+  std::cout << (e.simplex ? " simplex" : "") << " box, "
+            << (e.solver == direct ? "direct" : "CG") << " solver"
+            << std::endl;
+  std::cout << "   Elements:                     " << e.n_cells << std::endl;
+  std::cout << "   Degrees of freedom:           " << e.n_dofs << std::endl;
+  std::cout << "   Nonzeros in K:                " << e.nonzeros << " ("
+            << 100. * e.sparsity << "% of the entries)" << std::endl;
+  std::cout << "   K and its pattern:            " << e.matrix_bytes / MB
+            << " MB" << std::endl;
+  std::cout << "   Pattern before compress():    " << e.pattern_bytes / MB
+            << " MB" << std::endl;
+  std::cout << "   Mesh and dof handler:         " << e.mesh_bytes / MB
+            << " MB" << std::endl;
+  if (e.geometry_bytes > 0.) {
+    std::cout << "   Geometry cache:               " << e.geometry_bytes / MB
+              << " MB" << std::endl;
+  }
+  if (e.solver == direct) {
+    std::cout << "   LU factors:                   " << e.factor_entries
+              << " entries, " << e.factor_bytes / MB << " MB" << std::endl;
+  }
+  std::cout << "   Peak memory:                  " << e.peak_bytes / MB
+            << " MB (setup " << e.setup_peak_bytes / MB << ", solve "
+            << e.solve_peak_bytes / MB << ")" << std::endl;
+  const double available = available_memory();
+  if (available > 0.) {
+    std::cout << "   Available memory:             " << available / MB
+              << " MB" << std::endl;
+  }
+  if (calibrated && calibrated_simplex == e.simplex) {
+    if (e.solver == iterative) {
+      std::cout << "   CG iterations:                " << e.cg_iterations
+                << std::endl;
+    }
+    std::cout << "   Setup:                        " << e.setup_seconds
+              << " s" << std::endl;
+    std::cout << "   Assembly:                     " << e.assembly_seconds
+              << " s" << std::endl;
+    std::cout << "   Solve:                        " << e.solve_seconds
+              << " s" << std::endl;
+  } else {
+    std::cout << "   Runtime: call calibrate() with this element type"
+              << std::endl;
+  }
+}
+
+template <int dim> void DryRun<dim>::check_memory(const Estimate &e) const {
+  const double available = available_memory();
+  if (available <= 0.) return;
+  std::ostringstream message;
+  message << "The run needs about " << e.peak_bytes / 1.e6 << " MB, more than "
+          << memory_fraction * 100. << "% of the " << available / 1.e6
+          << " MB available: use fewer elements"
+          << (e.solver == direct ? " or an iterative solver" : "");
+  AssertThrow(e.peak_bytes <= memory_fraction * available,
+              ExcMessage(message.str()));
+}
+
+template <int dim> double DryRun<dim>::available_memory() {
+  double available = 0.;
+  std::ifstream meminfo("/proc/meminfo");
+  std::string name;
+  double kB;
+  while (meminfo >> name >> kB) {
+    if (name == "MemAvailable:") {
+      available = kB * 1024.;
+      break;
+    }
+    meminfo.ignore(256, '\n');
+  }
+  if (available <= 0.) {
+    available = double(sysconf(_SC_AVPHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+  }
+  // A container may allow less than the machine has free ("max": no limit)
+  std::ifstream cgroup_limit("/sys/fs/cgroup/memory.max");
+  std::ifstream cgroup_usage("/sys/fs/cgroup/memory.current");
+  double limit, used;
+  if (cgroup_limit >> limit && cgroup_usage >> used) {
+    available = std::min(available, std::max(limit - used, 0.));
+  }
+  return std::max(available, 0.);
+}
+
+template <int dim> double DryRun<dim>::resident_memory() {
+  std::ifstream statm("/proc/self/statm");
+  double size, resident;
+  if (!(statm >> size >> resident)) return 0.;
+  return resident * sysconf(_SC_PAGE_SIZE);
+}
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef GEOMETRYCACHE_H_
+#define GEOMETRYCACHE_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/table.h>
+#include <deal.II/base/types.h>
+#include <deal.II/base/work_stream.h>
+#include <deal.II/dofs/dof_handler.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace dealii;
+
+/*Jacobian data of every element at the quadrature points of
+  FEM::tabulate_basis, computed once and reused by assembly, flux recovery,
+  sensitivities and the mass matrix instead of being rebuilt from nodeLocation
+  in each of them.
+
+  Per element and quadrature point q the cache holds detJ*w (signed; take the
+  absolute value where the loops used |detJ|) and the inverse Jacobian, with
+  each quantity contiguous over the quadrature points of the element:
+    JxW[q], inverse_jacobian[(i*dim + I)*n_q + q] = d xi_i / d x_I.
+  A 3D hex with the 2x2x2 rule takes 8*(1 + 9) doubles, 640 bytes.
+
+  The memory is capped by memory_limit (in MB): the elements with an active
+  cell index below the cap are stored, the others (all of them for a limit of
+  0) are computed on the fly by get(), from the same formulas, so the results
+  do not depend on the limit. Given a subdomain id, only the elements of that
+  subdomain are stored (for a distributed solve, the ones this rank owns).
+
+  The cache refers to the nodeLocation table it was built from; call reinit()
+  again if the nodes move or the dofs are renumbered.*/
+template <int dim> class GeometryCache {
+public:
+  GeometryCache();
+
+  // Pointers to the data of one element (see above)
+  struct CellGeometry {
+    const double *JxW;
+    const double *inverse_jacobian;
+  };
+
+  // weight[q] and dN[q][A][j] as from FEM::tabulate_basis
+  void reinit(const DoFHandler<dim> &dof_handler,
+              const Table<2, double> &nodeLocation,
+              const std::vector<double> &weight,
+              const std::vector<std::vector<std::vector<double>>> &dN,
+              double memory_limit,
+              types::subdomain_id subdomain = numbers::invalid_subdomain_id);
+
+  /*Data of the element with this active cell index and these dofs; from the
+    cache if stored, otherwise computed into "scratch", which the result
+    points into until the next call with the same scratch*/
+  template <typename IndexType>
+  CellGeometry get(unsigned int cell, const std::vector<IndexType> &dofs,
+                   std::vector<double> &scratch) const;
+
+  // d N_A / d x_I at quadrature point q of an element
+  double shape_gradient(const CellGeometry &geometry, unsigned int q,
+                        unsigned int A, unsigned int I) const;
+
+  unsigned int n_q_points() const { return n_q; }
+  unsigned int n_cached_cells() const { return n_cached; }
+  // Bytes of the stored elements
+  std::size_t memory_consumption() const;
+
+private:
+  // Position of an element in the cache, or invalid_unsigned_int
+  unsigned int cached_entry(unsigned int cell) const {
+    if (!cache_slot.empty()) {
+      return cell < cache_slot.size() ? cache_slot[cell]
+                                      : numbers::invalid_unsigned_int;
+    }
+    return cell < n_cached ? cell : numbers::invalid_unsigned_int;
+  }
+
+  template <typename IndexType>
+  void compute(const std::vector<IndexType> &dofs, double *JxW,
+               double *inverse_jacobian) const;
+
+  const Table<2, double> *node_location;
+  unsigned int n_q, n_nodes, n_cached;
+  // Entry of each active cell, for a cache restricted to a subdomain (empty
+  // otherwise: the first n_cached cells are stored in order)
+  std::vector<unsigned int> cache_slot;
+  std::vector<double> quad_weight;
+  std::vector<double> gradient; // [(q*n_nodes + A)*dim + j]
+  std::vector<double> JxW_values;        // [cell*n_q + q]
+  std::vector<double> inverse_jacobians; // [(cell*dim*dim + i*dim + I)*n_q + q]
+};
+
+template <int dim>
+GeometryCache<dim>::GeometryCache()
+    : node_location(nullptr), n_q(0), n_nodes(0), n_cached(0) {}
+
+template <int dim>
+void GeometryCache<dim>::reinit(
+    const DoFHandler<dim> &dof_handler, const Table<2, double> &nodeLocation,
+    const std::vector<double> &weight,
+    const std::vector<std::vector<std::vector<double>>> &dN,
+    double memory_limit, types::subdomain_id subdomain) {
+
+  node_location = &nodeLocation;
+  n_q = weight.size();
+  AssertThrow(n_q > 0 && dN.size() == n_q,
+              ExcMessage("Quadrature weights and basis gradients do not match"));
+  n_nodes = dN[0].size();
+  quad_weight = weight;
+  gradient.resize(n_q * n_nodes * dim);
+  for (unsigned int q = 0; q < n_q; q++) {
+    for (unsigned int A = 0; A < n_nodes; A++) {
+      for (unsigned int j = 0; j < dim; j++) {
+        gradient[(q * n_nodes + A) * dim + j] = dN[q][A][j];
+      }
+    }
+  }
+
+  // As many elements as fit in the memory limit
+  const std::size_t bytes_per_cell = n_q * (1 + dim * dim) * sizeof(double);
+  const double max_cells = std::max(memory_limit, 0.) * 1.e6 / bytes_per_cell;
+  n_cached = (unsigned int)std::min<double>(
+      max_cells, dof_handler.get_triangulation().n_active_cells());
+  cache_slot.clear();
+  if (subdomain != numbers::invalid_subdomain_id) {
+    const unsigned int cap = n_cached;
+    n_cached = 0;
+    cache_slot.assign(dof_handler.get_triangulation().n_active_cells(),
+                      numbers::invalid_unsigned_int);
+    typename DoFHandler<dim>::active_cell_iterator
+        elem = dof_handler.begin_active(),
+        endc = dof_handler.end();
+    for (; elem != endc; ++elem) {
+      if (elem->subdomain_id() == subdomain && n_cached < cap) {
+        cache_slot[elem->active_cell_index()] = n_cached++;
+      }
+    }
+  }
+  JxW_values.assign(std::size_t(n_cached) * n_q, 0.);
+  inverse_jacobians.assign(std::size_t(n_cached) * dim * dim * n_q, 0.);
+  if (n_cached == 0) return;
+
+  // Each element writes only its own entries, so the copier has nothing to do
+  struct ScratchData {
+    std::vector<types::global_dof_index> local_dof_indices;
+  };
+  struct CopyData {};
+  ScratchData sample_scratch;
+  sample_scratch.local_dof_indices.resize(n_nodes);
+  WorkStream::run(
+      dof_handler.begin_active(), dof_handler.end(),
+      [&](const typename DoFHandler<dim>::active_cell_iterator &elem,
+          ScratchData &scratch, CopyData &) {
+        const unsigned int slot = cached_entry(elem->active_cell_index());
+        if (slot == numbers::invalid_unsigned_int) return;
+        elem->get_dof_indices(scratch.local_dof_indices);
+        compute(scratch.local_dof_indices, &JxW_values[std::size_t(slot) * n_q],
+                &inverse_jacobians[std::size_t(slot) * dim * dim * n_q]);
+      },
+      [](const CopyData &) {}, sample_scratch, CopyData());
+}
+
+template <int dim>
+template <typename IndexType>
+typename GeometryCache<dim>::CellGeometry
+GeometryCache<dim>::get(unsigned int cell, const std::vector<IndexType> &dofs,
+                        std::vector<double> &scratch) const {
+  CellGeometry geometry;
+  const unsigned int slot = cached_entry(cell);
+  if (slot != numbers::invalid_unsigned_int) {
+    geometry.JxW = &JxW_values[std::size_t(slot) * n_q];
+    geometry.inverse_jacobian =
+        &inverse_jacobians[std::size_t(slot) * dim * dim * n_q];
+  } else {
+    scratch.resize((1 + dim * dim) * n_q);
+    compute(dofs, &scratch[0], &scratch[n_q]);
+    geometry.JxW = &scratch[0];
+    geometry.inverse_jacobian = &scratch[n_q];
+  }
+  return geometry;
+}
+
+template <int dim>
+double GeometryCache<dim>::shape_gradient(const CellGeometry &geometry,
+                                          unsigned int q, unsigned int A,
+                                          unsigned int I) const {
+  const double *dN = &gradient[(q * n_nodes + A) * dim];
+  double value = 0.;
+  for (unsigned int i = 0; i < dim; i++) {
+    value += dN[i] * geometry.inverse_jacobian[(i * dim + I) * n_q + q];
+  }
+  return value;
+}
+
+template <int dim>
+std::size_t GeometryCache<dim>::memory_consumption() const {
+  return (JxW_values.size() + inverse_jacobians.size()) * sizeof(double) +
+         cache_slot.size() * sizeof(unsigned int);
+}
+
+template <int dim>
+template <typename IndexType>
+void GeometryCache<dim>::compute(const std::vector<IndexType> &dofs,
+                                 double *JxW, double *inverse_jacobian) const {
+  AssertThrow(node_location != nullptr && dofs.size() == n_nodes,
+              ExcMessage("GeometryCache::reinit() was not called for this mesh"));
+  double Jacobian[dim][dim], invJacob[dim][dim], detJ;
+  for (unsigned int q = 0; q < n_q; q++) {
+    const double *dN = &gradient[q * n_nodes * dim];
+
+    // Jacobian[i][j] = d x_i / d xi_j
+    for (unsigned int i = 0; i < dim; i++) {
+      for (unsigned int j = 0; j < dim; j++) {
+        Jacobian[i][j] = 0.;
+        for (unsigned int A = 0; A < n_nodes; A++) {
+          Jacobian[i][j] += (*node_location)[dofs[A]][i] * dN[A * dim + j];
+        }
+      }
+    }
+
+    // Determinant and inverse from the cofactors
+    if constexpr (dim == 2) {
+      detJ = Jacobian[0][0] * Jacobian[1][1] - Jacobian[0][1] * Jacobian[1][0];
+      invJacob[0][0] = Jacobian[1][1] / detJ;
+      invJacob[0][1] = -Jacobian[0][1] / detJ;
+      invJacob[1][0] = -Jacobian[1][0] / detJ;
+      invJacob[1][1] = Jacobian[0][0] / detJ;
+    } else {
+      for (unsigned int i = 0; i < 3; i++) {
+        const unsigned int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+        for (unsigned int j = 0; j < 3; j++) {
+          const unsigned int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+          // Cofactor of Jacobian[j][i], i.e. the adjugate
+          invJacob[i][j] = Jacobian[j1][i1] * Jacobian[j2][i2] -
+                           Jacobian[j1][i2] * Jacobian[j2][i1];
+        }
+      }
+      detJ = Jacobian[0][0] * invJacob[0][0] + Jacobian[0][1] * invJacob[1][0] +
+             Jacobian[0][2] * invJacob[2][0];
+      for (unsigned int i = 0; i < 3; i++) {
+        for (unsigned int j = 0; j < 3; j++) {
+          invJacob[i][j] /= detJ;
+        }
+      }
+    }
+
+    JxW[q] = detJ * quad_weight[q];
+    for (unsigned int i = 0; i < dim; i++) {
+      for (unsigned int I = 0; I < dim; I++) {
+        inverse_jacobian[(i * dim + I) * n_q + q] = invJacob[i][I];
+      }
+    }
+  }
+}
+
+#endif
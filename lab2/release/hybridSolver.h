@@ -0,0 +1,305 @@
+#ifndef HYBRIDSOLVER_H_
+#define HYBRIDSOLVER_H_
+#include <deal.II/base/config.h>
+#if !defined(DEAL_II_WITH_MPI) || !defined(DEAL_II_WITH_TRILINOS)
+#error "hybridSolver.h needs a deal.II configured with MPI and Trilinos"
+#endif
+#include <deal.II/base/conditional_ostream.h>
+#include <deal.II/base/index_set.h>
+#include <deal.II/base/mpi.h>
+#include <deal.II/base/multithread_info.h>
+#include <deal.II/base/work_stream.h>
+#include <deal.II/dofs/dof_tools.h>
+#include <deal.II/grid/filtered_iterator.h>
+#include <deal.II/grid/grid_tools.h>
+#include <deal.II/lac/affine_constraints.h>
+#include <deal.II/lac/dynamic_sparsity_pattern.h>
+#include <deal.II/lac/solver_cg.h>
+#include <deal.II/lac/solver_control.h>
+#include <deal.II/lac/sparsity_tools.h>
+#include <deal.II/lac/trilinos_precondition.h>
+#include <deal.II/lac/trilinos_sparse_matrix.h>
+#include <deal.II/lac/trilinos_vector.h>
+#include <mpi.h>
+// Standard C++ libraries
+#include <chrono>
+#include <iostream>
+#include <vector>
+using namespace dealii;
+
+/*Hybrid MPI + threads solve of the steady conduction problem of a FEM object
+  (FEM2b.h), for main2b_hybrid.cc.
+
+  The mesh is split into one subdomain per MPI rank along a z-order curve of
+  the elements (so the subdomains are compact), and the dofs are numbered
+  subdomain by subdomain. Each rank assembles the elements of its subdomain
+  into its rows of a Trilinos matrix, with its own threads (WorkStream over
+  its elements), and the ranks solve together with CG and algebraic
+  multigrid. Dirichlet values are imposed with AffineConstraints, which keeps
+  K symmetric; entries for rows owned by a neighbor are sent to it by
+  compress(). Heat sources and convection faces are assembled with the
+  elements they belong to.
+
+  Every rank keeps the triangulation and the nodal coordinates, as the serial
+  code does, but only its own rows of K plus the couplings across its
+  subdomain boundary. With one rank per socket (or node) and one thread per
+  core, the replicated mesh and the ghost layers are paid once per socket
+  instead of once per core.
+
+  The number of ranks comes from mpirun and the threads per rank from
+  MPI_InitFinalize in main2b_hybrid.cc.*/
+template <int dim, typename IndexType = unsigned int> class HybridSolver {
+public:
+  // Class functions
+  HybridSolver(FEM<dim, IndexType> &fem_problem,
+               MPI_Comm communicator = MPI_COMM_WORLD); // Class constructor
+
+  // Call after the mesh is generated or imported (instead of
+  // problem.setup_system())
+  void setup();
+  void assemble_system();
+  unsigned int solve();
+  // Gather the solution into problem.D on rank 0 only, and write it there
+  void output_results();
+
+  // Class objects
+  FEM<dim, IndexType> &problem;
+  MPI_Comm mpi_communicator;
+  unsigned int n_ranks, this_rank;
+  ConditionalOStream pcout; // std::cout on rank 0 only
+
+  // Dofs of this rank's rows, and all dofs of its elements
+  IndexSet locally_owned_dofs, locally_relevant_dofs;
+  AffineConstraints<double> constraints; // Dirichlet values
+  TrilinosWrappers::SparseMatrix K;
+  TrilinosWrappers::MPI::Vector D, F;
+  TrilinosWrappers::PreconditionAMG preconditioner;
+
+  double solver_tolerance; // CG tolerance, relative to the right hand side
+  unsigned int solver_iterations;
+};
+
+// Class constructor
+template <int dim, typename IndexType>
+HybridSolver<dim, IndexType>::HybridSolver(FEM<dim, IndexType> &fem_problem,
+                                           MPI_Comm communicator)
+    : problem(fem_problem), mpi_communicator(communicator),
+      n_ranks(Utilities::MPI::n_mpi_processes(communicator)),
+      this_rank(Utilities::MPI::this_mpi_process(communicator)),
+      pcout(std::cout, this_rank == 0) {
+  solver_tolerance = 1.e-10;
+  solver_iterations = 0;
+}
+
+// Partition the mesh, number the dofs and set up this rank's part of K
+template <int dim, typename IndexType>
+void HybridSolver<dim, IndexType>::setup() {
+
+  AssertThrow(problem.triangulation.n_active_cells() >= n_ranks,
+              ExcMessage("Fewer elements than MPI ranks"));
+  GridTools::partition_triangulation_zorder(n_ranks, problem.triangulation);
+  problem.distributedSolve = true;
+  problem.ownedSubdomain = this_rank;
+  problem.setup_system();
+
+  /*After the subdomain-wise numbering each rank owns a contiguous range of
+    dofs; the relevant dofs add those it shares with other subdomains*/
+  locally_owned_dofs =
+      DoFTools::locally_owned_dofs_per_subdomain(problem.dof_handler)[this_rank];
+  locally_relevant_dofs = IndexSet(problem.dof_handler.n_dofs());
+  std::vector<types::global_dof_index> local_dof_indices(
+      problem.fe.dofs_per_cell);
+  typename DoFHandler<dim>::active_cell_iterator
+      elem = problem.dof_handler.begin_active(),
+      endc = problem.dof_handler.end();
+  for (; elem != endc; ++elem) {
+    if (elem->subdomain_id() != this_rank) continue;
+    elem->get_dof_indices(local_dof_indices);
+    locally_relevant_dofs.add_indices(local_dof_indices.begin(),
+                                      local_dof_indices.end());
+  }
+  locally_relevant_dofs.compress();
+
+  // Inhomogeneous constraints for the Dirichlet dofs this rank touches
+  constraints.clear();
+  constraints.reinit(locally_relevant_dofs);
+  typename std::map<IndexType, double>::const_iterator bc;
+  for (bc = problem.boundary_values.begin();
+       bc != problem.boundary_values.end(); ++bc) {
+    if (!locally_relevant_dofs.is_element(bc->first)) continue;
+    constraints.add_line(bc->first);
+    constraints.set_inhomogeneity(bc->first, bc->second);
+  }
+  constraints.close();
+
+  DynamicSparsityPattern dsp(locally_relevant_dofs);
+  DoFTools::make_sparsity_pattern(problem.dof_handler, dsp, constraints, false,
+                                  this_rank);
+  SparsityTools::distribute_sparsity_pattern(dsp, locally_owned_dofs,
+                                             mpi_communicator,
+                                             locally_relevant_dofs);
+  K.reinit(locally_owned_dofs, locally_owned_dofs, dsp, mpi_communicator);
+  D.reinit(locally_owned_dofs, mpi_communicator);
+  F.reinit(locally_owned_dofs, mpi_communicator);
+
+  pcout << "   MPI ranks:                    " << n_ranks << std::endl;
+  pcout << "   Threads per rank:             " << MultithreadInfo::n_threads()
+        << std::endl;
+  const unsigned int n_owned = locally_owned_dofs.n_elements();
+  pcout << "   Dofs per rank:                "
+        << Utilities::MPI::min(n_owned, mpi_communicator) << " to "
+        << Utilities::MPI::max(n_owned, mpi_communicator) << std::endl;
+}
+
+// K and F of this rank's elements, assembled by its threads
+template <int dim, typename IndexType>
+void HybridSolver<dim, IndexType>::assemble_system() {
+
+  K = 0.;
+  F = 0.;
+
+  const unsigned int dofs_per_elem = problem.fe.dofs_per_cell;
+  struct ScratchData {
+    std::vector<IndexType> local_dof_indices; // For problem.element_Klocal
+    FullMatrix<double> kappa;
+  };
+  struct CopyData {
+    std::vector<types::global_dof_index> local_dof_indices;
+    FullMatrix<double> Klocal;
+    Vector<double> Flocal;
+  };
+  ScratchData sample_scratch;
+  sample_scratch.local_dof_indices.resize(dofs_per_elem);
+  sample_scratch.kappa.reinit(dim, dim);
+  CopyData sample_copy;
+  sample_copy.local_dof_indices.resize(dofs_per_elem);
+  sample_copy.Klocal.reinit(dofs_per_elem, dofs_per_elem);
+  sample_copy.Flocal.reinit(dofs_per_elem);
+
+  typedef FilteredIterator<typename DoFHandler<dim>::active_cell_iterator>
+      OwnedCell;
+  const IteratorFilters::SubdomainEqualTo owned(this_rank);
+  WorkStream::run(
+      OwnedCell(owned, problem.dof_handler.begin_active()),
+      OwnedCell(owned, problem.dof_handler.end()),
+      [&](const OwnedCell &elem, ScratchData &scratch, CopyData &copy) {
+        get_dof_indices(elem, scratch.local_dof_indices);
+        elem->get_dof_indices(copy.local_dof_indices);
+        const double conductivity = problem.element_conductivity(elem);
+        scratch.kappa = 0.;
+        for (unsigned int I = 0; I < dim; I++) {
+          scratch.kappa[I][I] = conductivity;
+        }
+        problem.element_Klocal(elem->active_cell_index(),
+                               scratch.local_dof_indices, scratch.kappa,
+                               copy.Klocal);
+        problem.element_Flocal(elem, scratch.local_dof_indices, copy.Flocal);
+      },
+      [&](const CopyData &copy) {
+        // Moves the Dirichlet values to the right hand side
+        constraints.distribute_local_to_global(
+            copy.Klocal, copy.Flocal, copy.local_dof_indices, K, F);
+      },
+      sample_scratch, sample_copy);
+
+  // Convection faces of this rank's elements
+  if (problem.n_convection_faces > 0) {
+    std::vector<bool> owned_cell(problem.triangulation.n_active_cells());
+    typename DoFHandler<dim>::active_cell_iterator
+        elem = problem.dof_handler.begin_active(),
+        endc = problem.dof_handler.end();
+    for (; elem != endc; ++elem) {
+      owned_cell[elem->active_cell_index()] =
+          (elem->subdomain_id() == this_rank);
+    }
+    const unsigned int dofs_per_face = problem.fe.dofs_per_face;
+    FullMatrix<double> Kface(dofs_per_face, dofs_per_face);
+    Vector<double> Fface(dofs_per_face);
+    std::vector<types::global_dof_index> face_dofs(dofs_per_face);
+    for (unsigned int face = 0; face < problem.n_convection_faces; face++) {
+      if (!owned_cell[problem.convection_face_cell[face]]) continue;
+      problem.convection_face_terms(face, Kface, Fface);
+      for (unsigned int a = 0; a < dofs_per_face; a++) {
+        face_dofs[a] = problem.convection_face_dofs[face * dofs_per_face + a];
+      }
+      constraints.distribute_local_to_global(Kface, Fface, face_dofs, K, F);
+    }
+  }
+
+  // Send the entries of rows owned by other ranks
+  K.compress(VectorOperation::add);
+  F.compress(VectorOperation::add);
+}
+
+// AMG preconditioned CG on all ranks; returns the iterations
+template <int dim, typename IndexType>
+unsigned int HybridSolver<dim, IndexType>::solve() {
+
+  const auto start = std::chrono::steady_clock::now();
+  D = 0.;
+  const double rhs_norm = F.l2_norm();
+  solver_iterations = 0;
+  if (rhs_norm > 0.) {
+    TrilinosWrappers::PreconditionAMG::AdditionalData amg_data;
+    amg_data.elliptic = true;
+    amg_data.higher_order_elements = false;
+    preconditioner.initialize(K, amg_data);
+
+    SolverControl solver_control(problem.dof_handler.n_dofs(),
+                                 solver_tolerance * rhs_norm);
+    SolverCG<TrilinosWrappers::MPI::Vector> solver(solver_control);
+    solver.solve(K, D, F, preconditioner);
+    solver_iterations = solver_control.last_step();
+  }
+  constraints.distribute(D);
+
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  pcout << "   CG iterations: " << solver_iterations << " (" << seconds
+        << " s)" << std::endl;
+  return solver_iterations;
+}
+
+/*Collective. Each rank sends its owned dofs and their values to rank 0, which
+  alone assembles the whole solution (in problem.D) and writes it: the other
+  ranks never hold more of D than their own part*/
+template <int dim, typename IndexType>
+void HybridSolver<dim, IndexType>::output_results() {
+  std::vector<unsigned long long> owned_indices;
+  owned_indices.reserve(locally_owned_dofs.n_elements());
+  for (IndexSet::ElementIterator i = locally_owned_dofs.begin();
+       i != locally_owned_dofs.end(); ++i) {
+    owned_indices.push_back(*i);
+  }
+  // The local values of D are in the order of its owned dofs
+  int n_owned = owned_indices.size();
+  std::vector<int> counts(n_ranks), offsets(n_ranks, 0);
+  MPI_Gather(&n_owned, 1, MPI_INT, counts.data(), 1, MPI_INT, 0,
+             mpi_communicator);
+  std::vector<unsigned long long> all_indices;
+  std::vector<double> all_values;
+  if (this_rank == 0) {
+    for (unsigned int r = 1; r < n_ranks; r++) {
+      offsets[r] = offsets[r - 1] + counts[r - 1];
+    }
+    all_indices.resize(offsets[n_ranks - 1] + counts[n_ranks - 1]);
+    all_values.resize(all_indices.size());
+  }
+  MPI_Gatherv(owned_indices.data(), n_owned, MPI_UNSIGNED_LONG_LONG,
+              all_indices.data(), counts.data(), offsets.data(),
+              MPI_UNSIGNED_LONG_LONG, 0, mpi_communicator);
+  MPI_Gatherv(n_owned > 0 ? &*D.begin() : nullptr, n_owned, MPI_DOUBLE,
+              all_values.data(), counts.data(), offsets.data(), MPI_DOUBLE, 0,
+              mpi_communicator);
+
+  if (this_rank == 0) {
+    problem.D.reinit(problem.dof_handler.n_dofs());
+    for (unsigned int j = 0; j < all_indices.size(); j++) {
+      problem.D[all_indices[j]] = all_values[j];
+    }
+    problem.output_results();
+  }
+}
+
+#endif
@@ -4,8 +4,11 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 #include "FEM2b.h"
+#include "topologyOptimization.h"
+#include "dryRun.h"
 #include "writeSolutions.h"
 
 using namespace dealii;
@@ -17,7 +20,13 @@ int main (){
 		
 		const int dimension = 3;
 
-    FEM<dimension> problemObject;
+		//Element type: false (quadrilaterals/hexahedra) or true (triangles/tetrahedra)
+		bool simplex = false;
+
+		//Global dof indices are 32 bit; for meshes past 2^32 - 1 dofs use
+		//FEM<dimension, types::global_dof_index> (and the same for
+		//TopologyOptimization) with a deal.II built with 64 bit indices
+    FEM<dimension> problemObject(simplex);
 
 		//NOTE: This is where you define the number of elements in the mesh
 		std::vector<unsigned int> num_of_elems(dimension);
@@ -25,10 +34,117 @@ int main (){
 		num_of_elems[1] = 8;
 		num_of_elems[2] = 2; //For example, a 4 x 8 x 2 element mesh in 3D
 
-		problemObject.generate_mesh(num_of_elems);
+		//Element integration: false (full 2x2x2 rule) or true (one point with hourglass control)
+		problemObject.reducedIntegration = false;
+		//Hex stiffness matrices computed several elements at a time with SIMD instructions
+		//(full integration only)
+		problemObject.batchedAssembly = false;
+		//Memory (MB) for the Jacobians at the quadrature points, kept from setup_system()
+		//for assembly, heat flux, sensitivities and modes (0: recompute them each time)
+		problemObject.geometryCacheMemory = 0.;
+		//Set to true to solve with both integrations and report their difference
+		bool compareIntegration = false;
+
+		//Mesh file: empty to generate the box above, or a Gmsh (.msh, format 4.1
+		//binary) or legacy VTK unstructured grid (.vtk) file. For imported meshes,
+		//fixed temperatures can be given per boundary id, e.g.
+		//problemObject.dirichlet_temperatures[1] = 300.;
+		std::string meshFile = "";
+
+		//Heat sources (W/m^3) per material id and convection h*(T - T_inf) per boundary
+		//id, e.g. 1 MW/m^3 in material 0 and h = 25 W/m^2K to air at 293 K on y_max:
+		//problemObject.material_heat_source[0] = 1.e6;
+		//problemObject.convection_boundaries[3] = std::make_pair(25., 293.);
+
+		//Adjoint sensitivities of the average temperature on the boundary with this id
+		//(generated box: 0..2*dim-1 for x_min, x_max, y_min, ...) to the conductivity of
+		//every element and to the Dirichlet values: -1 for none
+		int sensorBoundary = -1;
+
+		//Thermal topology optimization (topologyOptimization.h): place conductive
+		//material in this fraction of the volume so the temperature under a uniform
+		//heat source is lowest (minimum thermal compliance): 0 for a plain solve.
+		//Not combined with the heat sources and convection above
+		double topologyVolumeFraction = 0.;
+		//Store K with 16 bit column offsets for the CG products and SSOR sweeps of the optimization
+		//(compressedSparseMatrix.h): less memory traffic per iteration
+		bool compressedMatrix = false;
+		//Tag of an HDF5/XDMF series (solutionSeries.h) with the temperature and density of
+		//every iteration, e.g. "topology" for topology.h5 and topology.xdmf: empty for none
+		std::string topologyHistory = "";
+
+		//Number of thermal decay modes to compute after the solve (shift-invert
+		//Lanczos, see lab1/lanczos.h), written to solution.vtk: 0 for none
+		unsigned int decayModes = 0;
+
+		//Dry run (dryRun.h): print the dofs, nonzeros, memory and runtime predicted for the
+		//box above (the runtime from a small calibration solve) instead of running it.
+		//Box runs predicted to need more than the available memory are always refused
+		bool dryRun = false;
+
+		if(meshFile.empty()){
+		  DryRun<dimension> estimator;
+		  DryRun<dimension>::Solver solver = (topologyVolumeFraction > 0.) ?
+		    DryRun<dimension>::iterative : DryRun<dimension>::direct;
+		  if(dryRun){
+		    FEM<dimension> calibrationObject(simplex);
+		    calibrationObject.reducedIntegration = problemObject.reducedIntegration;
+		    calibrationObject.batchedAssembly = problemObject.batchedAssembly;
+		    calibrationObject.geometryCacheMemory = problemObject.geometryCacheMemory;
+		    estimator.calibrate(calibrationObject);
+		  }
+		  DryRun<dimension>::Estimate estimate = estimator.estimate(num_of_elems, simplex,
+		    solver, problemObject.geometryCacheMemory);
+		  if(dryRun){
+		    estimator.print(estimate);
+		    return 0;
+		  }
+		  estimator.check_memory(estimate);
+		}
+
+		if(meshFile.empty()){
+			problemObject.generate_mesh(num_of_elems);
+		}
+		else{
+			problemObject.import_mesh(meshFile);
+		}
 	  problemObject.setup_system();
-	  problemObject.assemble_system();
-	  problemObject.solve();
+	  if(topologyVolumeFraction > 0.){
+	    TopologyOptimization<dimension> optimizer(problemObject);
+	    optimizer.volume_fraction = topologyVolumeFraction;
+	    optimizer.compressed_matrix = compressedMatrix;
+	    std::unique_ptr<SolutionSeries> history;
+	    if(!topologyHistory.empty()){
+	      history.reset(new SolutionSeries(topologyHistory));
+	      optimizer.history = history.get();
+	    }
+	    optimizer.setup();
+	    optimizer.run();
+	    optimizer.output_results();
+	  }
+	  else if(compareIntegration){
+	    problemObject.compare_reduced_integration();
+	  }
+	  else{
+	    problemObject.assemble_system();
+	    problemObject.solve();
+	  }
+		//(not after a topology optimization, which leaves K with the Dirichlet columns eliminated)
+		if(sensorBoundary >= 0 && topologyVolumeFraction <= 0.){
+		  Vector<double> j = problemObject.sensor_functional(sensorBoundary);
+		  problemObject.compute_sensitivities(j);
+		  std::cout << "   Sensor temperature: " << j*problemObject.D << std::endl;
+		  std::cout << "   Largest |dJ/dkappa| of an element: "
+		            << problemObject.kappa_sensitivity.linfty_norm() << std::endl;
+		  std::map<types::boundary_id, double>::const_iterator it;
+		  for(it = problemObject.boundary_temperature_sensitivity.begin();
+		      it != problemObject.boundary_temperature_sensitivity.end(); ++it){
+		    std::cout << "   dJ/dT on boundary " << it->first << ": " << it->second << std::endl;
+		  }
+		}
+		if(decayModes > 0){
+		  problemObject.compute_modes(decayModes);
+		}
 		problemObject.output_results();
     
     //write solutions to h5 file
@@ -0,0 +1,96 @@
+
+//Hybrid MPI + threads version of main2b.cc (see hybridSolver.h). Needs a
+//deal.II configured with MPI and Trilinos. The layout is set on the command
+//line: the number of ranks by mpirun, the threads per rank by the first
+//argument (default: the cores of the machine shared evenly by its ranks).
+//For example, on one machine, 2 ranks with 4 threads each:
+//  mpirun -np 2 ./main2b_hybrid 4
+//or one rank per socket with a thread per core of the socket:
+//  mpirun -np 2 --map-by socket --bind-to socket ./main2b_hybrid 16
+
+//Include files
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+
+#include "FEM2b.h"
+#include "hybridSolver.h"
+#include "writeSolutionsParallel.h"
+
+using namespace dealii;
+
+//The main program, using the FEM class with the hybrid solver
+int main (int argc, char *argv[]){
+  //Threads per rank (set before any thread is started)
+  unsigned int threadsPerRank = numbers::invalid_unsigned_int;
+  if(argc > 1){
+    threadsPerRank = atoi(argv[1]);
+  }
+  Utilities::MPI::MPI_InitFinalize mpi_initialization(argc, argv, threadsPerRank);
+
+  try{
+    deallog.depth_console (0);
+
+		const int dimension = 3;
+
+		//Element type: false (quadrilaterals/hexahedra) or true (triangles/tetrahedra)
+		bool simplex = false;
+
+    FEM<dimension> problemObject(simplex);
+
+		//NOTE: This is where you define the number of elements in the mesh
+		std::vector<unsigned int> num_of_elems(dimension);
+		num_of_elems[0] = 40;
+		num_of_elems[1] = 80;
+		num_of_elems[2] = 20; //Every rank needs at least one element
+
+		//Element integration: false (full 2x2x2 rule) or true (one point with hourglass control)
+		problemObject.reducedIntegration = false;
+
+		//Mesh file: empty to generate the box above, or a Gmsh (.msh, format 4.1
+		//binary) or legacy VTK unstructured grid (.vtk) file
+		std::string meshFile = "";
+
+		if(meshFile.empty()){
+			problemObject.generate_mesh(num_of_elems);
+		}
+		else{
+			problemObject.import_mesh(meshFile);
+		}
+	  HybridSolver<dimension> hybridObject(problemObject);
+	  hybridObject.setup();
+	  hybridObject.assemble_system();
+	  hybridObject.solve();
+	  hybridObject.output_results(); //gathered on rank 0 only, for the vtk file
+
+	  //write solutions to h5 file, each rank its own dofs, without gathering D,
+	  //in the serial dof numbering (the same file for any number of ranks)
+	  writeSolutionsToFileParallel(hybridObject.D, "CA2b",
+	                               problemObject.serialDofIndex);
+  }
+  catch (std::exception &exc){
+    std::cerr << std::endl << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+    std::cerr << "Exception on processing: " << std::endl
+	      << exc.what() << std::endl
+	      << "Aborting!" << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+
+    return 1;
+  }
+  catch (...){
+    std::cerr << std::endl << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+    std::cerr << "Unknown exception!" << std::endl
+	      << "Aborting!" << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,67 @@
+
+//Solver service for the 3D conduction problem of main2b.cc (see
+//solverService.h): meshes, sparsity patterns and factorizations stay in memory
+//between requests, which come over a Unix domain socket. Start it with the
+//socket path (default /tmp/fem2b.sock):
+//  ./main2b_service /tmp/fem2b.sock &
+//and send requests, one per line, e.g.
+//  echo "solve box 40 80 20 temperature 0 300 temperature 1 310 average 3" |
+//    socat - UNIX-CONNECT:/tmp/fem2b.sock
+//  echo "shutdown" | socat - UNIX-CONNECT:/tmp/fem2b.sock
+
+//Include files
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+
+#include "FEM2b.h"
+#include "solverService.h"
+
+using namespace dealii;
+
+//The main program, serving FEM objects until a "shutdown" request
+int main (int argc, char *argv[]){
+  try{
+    deallog.depth_console (0);
+
+		const int dimension = 3;
+
+		std::string socketPath = "/tmp/fem2b.sock";
+		if(argc > 1){
+			socketPath = argv[1];
+		}
+
+		SolverService<dimension> service(socketPath);
+		//Number of meshes kept set up in memory (the least recently used is dropped)
+		service.max_problems = 4;
+		//Seconds a connected client may stay silent before it is dropped (the
+		//requests are served one at a time)
+		service.client_timeout = 10.;
+		service.run();
+  }
+  catch (std::exception &exc){
+    std::cerr << std::endl << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+    std::cerr << "Exception on processing: " << std::endl
+	      << exc.what() << std::endl
+	      << "Aborting!" << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+
+    return 1;
+  }
+  catch (...){
+    std::cerr << std::endl << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+    std::cerr << "Unknown exception!" << std::endl
+	      << "Aborting!" << std::endl
+	      << "----------------------------------------------------"
+	      << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,738 @@
+#ifndef MESHIMPORT_H_
+#define MESHIMPORT_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/parallel.h>
+#include <deal.II/grid/grid_tools.h>
+#include <deal.II/grid/tria.h>
+// Memory mapping (POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// Standard C++ libraries
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+using namespace dealii;
+
+/*Import of external meshes: Gmsh .msh (format 4.1, binary) and legacy VTK
+  unstructured grids (.vtk, ASCII or BINARY, classic CELLS layout or the
+  OFFSETS/CONNECTIVITY layout of version 5).
+
+  The file is memory mapped instead of streamed. A cheap sequential pass only
+  locates the sections/blocks (for binary data their size follows from their
+  headers, for ASCII data the tokens are counted per chunk), after which the
+  nodes, cells and faces are decoded in parallel chunks straight into
+  preallocated arrays.
+
+  The cells of the highest dimension become the triangulation; their Gmsh
+  physical tag (or entity tag if there is none) or their VTK cell data value
+  becomes the material id. The cells one dimension lower become boundary
+  faces with their tag as boundary id, for use in define_boundary_conds().*/
+
+// Mesh as read from the file, before it is turned into a Triangulation
+struct ImportedMesh {
+  unsigned int dim = 0;
+  bool simplex = false;
+  unsigned int vertices_per_cell = 0, vertices_per_face = 0;
+  std::vector<double> vertices;    // x, y, z of each vertex
+  std::vector<unsigned int> cells; // vertices_per_cell indices per cell
+  std::vector<unsigned int> cell_material_ids;
+  std::vector<unsigned int> faces; // vertices_per_face indices per face
+  std::vector<unsigned int> face_boundary_ids;
+};
+
+namespace MeshImport {
+
+// Read-only memory map of a whole file
+class MappedFile {
+public:
+  MappedFile(const std::string &filename) : data(NULL), size(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    AssertThrow(fd >= 0, ExcMessage("Could not open mesh file " + filename));
+    struct stat file_status;
+    fstat(fd, &file_status);
+    size = file_status.st_size;
+    if (size > 0) {
+      void *address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      AssertThrow(address != MAP_FAILED,
+                  ExcMessage("Could not memory map mesh file " + filename));
+      data = static_cast<const char *>(address);
+      madvise(address, size, MADV_WILLNEED);
+    } else {
+      close(fd);
+    }
+  }
+  ~MappedFile() {
+    if (data != NULL) munmap(const_cast<char *>(data), size);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data;
+  std::size_t size;
+};
+
+// Records are decoded in chunks of this many items, one chunk per task
+const std::size_t chunk_size = 1 << 16;
+
+// Run f(begin, end) over [0, n) in parallel chunks
+template <typename Function>
+void parallel_for(std::size_t n, const Function &f) {
+  parallel::apply_to_subranges(std::size_t(0), n, f, chunk_size);
+}
+
+// Element types: dimension, vertices and file -> deal.II vertex order
+struct ElementKind {
+  int dim;
+  unsigned int n_vertices;
+  bool simplex;
+  unsigned int to_deal[8]; // deal.II vertex i is file vertex to_deal[i]
+};
+const ElementKind unknown_kind = {-1, 0, false, {0}};
+const ElementKind point_kind = {0, 1, true, {0}};
+const ElementKind line_kind = {1, 2, true, {0, 1}};
+const ElementKind triangle_kind = {2, 3, true, {0, 1, 2}};
+// Gmsh and VTK number quads and hexes counter-clockwise, deal.II
+// lexicographically
+const ElementKind quad_kind = {2, 4, false, {0, 1, 3, 2}};
+const ElementKind tetrahedron_kind = {3, 4, true, {0, 1, 2, 3}};
+const ElementKind hexahedron_kind = {3, 8, false, {0, 1, 3, 2, 4, 5, 7, 6}};
+
+inline const ElementKind &gmsh_element_kind(int type) {
+  switch (type) {
+  case 15: return point_kind;
+  case 1: return line_kind;
+  case 2: return triangle_kind;
+  case 3: return quad_kind;
+  case 4: return tetrahedron_kind;
+  case 5: return hexahedron_kind;
+  default: return unknown_kind;
+  }
+}
+
+inline const ElementKind &vtk_element_kind(int type) {
+  switch (type) {
+  case 1: return point_kind;
+  case 3: return line_kind;
+  case 5: return triangle_kind;
+  case 9: return quad_kind;
+  case 10: return tetrahedron_kind;
+  case 12: return hexahedron_kind;
+  default: return unknown_kind;
+  }
+}
+
+// Unaligned little-endian (native) and big-endian reads
+template <typename T> inline T read_native(const char *p) {
+  T value;
+  std::memcpy(&value, p, sizeof(T));
+  return value;
+}
+template <typename T> inline T read_big_endian(const char *p) {
+  unsigned char bytes[sizeof(T)];
+  for (unsigned int i = 0; i < sizeof(T); i++) {
+    bytes[i] = p[sizeof(T) - 1 - i];
+  }
+  T value;
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// Return the line starting at p (without line ending) and advance p past it
+inline std::string read_line(const char *&p, const char *end) {
+  const char *line_end = static_cast<const char *>(memchr(p, '\n', end - p));
+  if (line_end == NULL) line_end = end;
+  std::string line(p, line_end);
+  if (!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+  p = (line_end < end) ? line_end + 1 : end;
+  return line;
+}
+
+// Skip blank lines
+inline void skip_blank_lines(const char *&p, const char *end) {
+  while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t')) ++p;
+}
+
+// Find the line "line" at or after p and return the position after it
+inline const char *find_line(const char *p, const char *end,
+                             const std::string &line) {
+  while (p < end) {
+    const char *match = static_cast<const char *>(
+        memmem(p, end - p, line.c_str(), line.size()));
+    if (match == NULL) return end;
+    const char *after = match + line.size();
+    if ((match == p || match[-1] == '\n') &&
+        (after == end || *after == '\n' || *after == '\r')) {
+      return (after < end && *after == '\r') ? after + 2 : after + 1;
+    }
+    p = after;
+  }
+  return end;
+}
+
+inline bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/*Parse "count" whitespace separated numbers from [begin, end). The range is
+  cut into chunks at whitespace, the tokens of each chunk are counted in
+  parallel, and after a prefix sum each chunk is parsed in parallel into its
+  own slice of "values".*/
+template <typename T>
+void parse_ascii_numbers(const char *begin, const char *end, std::size_t count,
+                         std::vector<T> &values) {
+  const std::size_t bytes_per_chunk = 1 << 20;
+  const std::size_t n_chunks = (end - begin) / bytes_per_chunk + 1;
+  std::vector<const char *> chunk_begin(n_chunks + 1);
+  for (std::size_t c = 0; c < n_chunks; c++) {
+    const char *p = begin + c * ((end - begin) / n_chunks);
+    if (c > 0) {
+      while (p < end && !is_space(*p)) ++p;
+    }
+    chunk_begin[c] = p;
+  }
+  chunk_begin[n_chunks] = end;
+
+  std::vector<std::size_t> chunk_offset(n_chunks + 1, 0);
+  parallel::apply_to_subranges(
+      std::size_t(0), n_chunks,
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t c = first; c < last; c++) {
+          std::size_t n = 0;
+          for (const char *p = chunk_begin[c]; p < chunk_begin[c + 1];) {
+            while (p < chunk_begin[c + 1] && is_space(*p)) ++p;
+            if (p == chunk_begin[c + 1]) break;
+            n++;
+            while (p < chunk_begin[c + 1] && !is_space(*p)) ++p;
+          }
+          chunk_offset[c + 1] = n;
+        }
+      },
+      1);
+  for (std::size_t c = 0; c < n_chunks; c++) {
+    chunk_offset[c + 1] += chunk_offset[c];
+  }
+  AssertThrow(chunk_offset[n_chunks] >= count,
+              ExcMessage("Mesh file ended before all values were read"));
+
+  values.resize(count);
+  parallel::apply_to_subranges(
+      std::size_t(0), n_chunks,
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t c = first; c < last; c++) {
+          std::size_t i = chunk_offset[c];
+          for (const char *p = chunk_begin[c]; p < chunk_begin[c + 1] && i < count;) {
+            while (p < chunk_begin[c + 1] && is_space(*p)) ++p;
+            if (p == chunk_begin[c + 1]) break;
+            std::from_chars_result result = std::from_chars(p, chunk_begin[c + 1], values[i]);
+            AssertThrow(result.ec == std::errc(),
+                        ExcMessage("Could not parse a number in the mesh file"));
+            p = result.ptr;
+            i++;
+          }
+        }
+      },
+      1);
+}
+
+// End of the ASCII data starting at p: the next line that starts with a letter
+inline const char *end_of_ascii_data(const char *p, const char *end) {
+  while (p < end) {
+    const char *line_end = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (line_end == NULL) return end;
+    p = line_end + 1;
+    if (p < end && ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))) {
+      return p;
+    }
+  }
+  return end;
+}
+
+/*Reorder the cells/faces of one element kind into deal.II vertex order.
+  "file_vertices(e, v)" returns vertex v of element e as a vertex index.*/
+template <typename VertexFunction>
+void copy_elements(const ElementKind &kind, std::size_t n_elements,
+                   const VertexFunction &file_vertices, unsigned int *out) {
+  parallel_for(n_elements, [&](std::size_t first, std::size_t last) {
+    for (std::size_t e = first; e < last; e++) {
+      for (unsigned int v = 0; v < kind.n_vertices; v++) {
+        out[e * kind.n_vertices + v] = file_vertices(e, kind.to_deal[v]);
+      }
+    }
+  });
+}
+
+// ---------------------------------------------------------------------------
+// Gmsh .msh 4.1, binary
+// ---------------------------------------------------------------------------
+inline void read_gmsh(const MappedFile &file, ImportedMesh &mesh) {
+  const char *p = file.data, *end = file.data + file.size;
+  const unsigned int invalid = static_cast<unsigned int>(-1);
+
+  AssertThrow(read_line(p, end) == "$MeshFormat",
+              ExcMessage("Not a Gmsh mesh file"));
+  std::string format = read_line(p, end);
+  double version = 0.;
+  int file_type = 0, data_size = 0;
+  sscanf(format.c_str(), "%lf %d %d", &version, &file_type, &data_size);
+  AssertThrow(version >= 4.1 && file_type == 1 && data_size == 8,
+              ExcMessage("Only binary Gmsh files of format 4.1 with 8 byte "
+                         "size_t are supported (gmsh -format msh41 -bin)"));
+  AssertThrow(read_native<int>(p) == 1,
+              ExcMessage("Gmsh file was written with a different byte order"));
+  p = find_line(p, end, "$EndMeshFormat");
+
+  // Physical tag of each entity, indexed by entity dimension
+  std::map<int, int> physical_tag[4];
+  // Node blocks and element blocks are located first and decoded afterwards
+  struct Block {
+    int dim, tag, type;
+    std::size_t n;
+    const char *data;
+    std::size_t stride; // bytes per record
+  };
+  std::vector<Block> node_blocks, element_blocks;
+  std::size_t n_nodes = 0, min_node_tag = 0, max_node_tag = 0;
+
+  while (p < end) {
+    skip_blank_lines(p, end);
+    if (p >= end) break;
+    std::string section = read_line(p, end);
+    std::string section_end = "$End" + section.substr(1);
+
+    if (section == "$Entities") {
+      std::size_t n_entities[4];
+      for (unsigned int d = 0; d < 4; d++) {
+        n_entities[d] = read_native<std::size_t>(p);
+        p += 8;
+      }
+      for (int d = 0; d < 4; d++) {
+        for (std::size_t e = 0; e < n_entities[d]; e++) {
+          int tag = read_native<int>(p);
+          p += 4;
+          p += (d == 0 ? 3 : 6) * sizeof(double); // point or bounding box
+          std::size_t n_physical = read_native<std::size_t>(p);
+          p += 8;
+          if (n_physical > 0) physical_tag[d][tag] = read_native<int>(p);
+          p += n_physical * 4;
+          if (d > 0) {
+            std::size_t n_bounding = read_native<std::size_t>(p);
+            p += 8 + n_bounding * 4;
+          }
+        }
+      }
+    } else if (section == "$Nodes") {
+      std::size_t n_blocks = read_native<std::size_t>(p);
+      n_nodes = read_native<std::size_t>(p + 8);
+      min_node_tag = read_native<std::size_t>(p + 16);
+      max_node_tag = read_native<std::size_t>(p + 24);
+      p += 32;
+      for (std::size_t b = 0; b < n_blocks; b++) {
+        Block block;
+        block.dim = read_native<int>(p);
+        block.tag = read_native<int>(p + 4);
+        int parametric = read_native<int>(p + 8);
+        block.n = read_native<std::size_t>(p + 12);
+        block.type = 0;
+        p += 20;
+        block.data = p; // node tags, then coordinates
+        block.stride = (3 + (parametric ? block.dim : 0)) * sizeof(double);
+        p += block.n * (8 + block.stride);
+        node_blocks.push_back(block);
+      }
+    } else if (section == "$Elements") {
+      std::size_t n_blocks = read_native<std::size_t>(p);
+      p += 32;
+      for (std::size_t b = 0; b < n_blocks; b++) {
+        Block block;
+        block.dim = read_native<int>(p);
+        block.tag = read_native<int>(p + 4);
+        block.type = read_native<int>(p + 8);
+        block.n = read_native<std::size_t>(p + 12);
+        p += 20;
+        const ElementKind &kind = gmsh_element_kind(block.type);
+        AssertThrow(kind.dim >= 0,
+                    ExcMessage("Unsupported Gmsh element type " +
+                               std::to_string(block.type) +
+                               " (only linear elements are supported)"));
+        block.data = p;
+        block.stride = (1 + kind.n_vertices) * 8;
+        p += block.n * block.stride;
+        element_blocks.push_back(block);
+      }
+    }
+    // Sections not needed here ($PhysicalNames, $NodeData, ...) are skipped
+    p = find_line(p, end, section_end);
+  }
+  AssertThrow(n_nodes > 0 && !element_blocks.empty(),
+              ExcMessage("Gmsh file has no $Nodes or $Elements section"));
+
+  // Decode the nodes and the node tag -> vertex index map
+  mesh.vertices.resize(3 * n_nodes);
+  std::vector<unsigned int> vertex_of_tag(max_node_tag - min_node_tag + 1, invalid);
+  std::size_t first_node = 0;
+  for (unsigned int b = 0; b < node_blocks.size(); b++) {
+    const Block &block = node_blocks[b];
+    const char *coordinates = block.data + block.n * 8;
+    parallel_for(block.n, [&](std::size_t first, std::size_t last) {
+      for (std::size_t i = first; i < last; i++) {
+        std::size_t tag = read_native<std::size_t>(block.data + i * 8);
+        vertex_of_tag[tag - min_node_tag] = first_node + i;
+        std::memcpy(&mesh.vertices[3 * (first_node + i)],
+                    coordinates + i * block.stride, 3 * sizeof(double));
+      }
+    });
+    first_node += block.n;
+  }
+
+  // The highest element dimension defines the cells, one lower the faces
+  int dim = 0;
+  for (unsigned int b = 0; b < element_blocks.size(); b++) {
+    dim = std::max(dim, element_blocks[b].dim);
+  }
+  AssertThrow(dim >= 2, ExcMessage("Gmsh file contains no 2D or 3D elements"));
+  mesh.dim = dim;
+
+  const ElementKind *cell_kind = NULL, *face_kind = NULL;
+  std::size_t n_cells = 0, n_faces = 0;
+  for (unsigned int b = 0; b < element_blocks.size(); b++) {
+    const Block &block = element_blocks[b];
+    const ElementKind &kind = gmsh_element_kind(block.type);
+    if (block.dim == dim) {
+      AssertThrow(cell_kind == NULL || cell_kind == &kind,
+                  ExcMessage("Meshes with mixed cell types are not supported"));
+      cell_kind = &kind;
+      n_cells += block.n;
+    } else if (block.dim == dim - 1) {
+      AssertThrow(face_kind == NULL || face_kind == &kind,
+                  ExcMessage("Meshes with mixed face types are not supported"));
+      face_kind = &kind;
+      n_faces += block.n;
+    }
+  }
+  mesh.simplex = cell_kind->simplex;
+  mesh.vertices_per_cell = cell_kind->n_vertices;
+  mesh.vertices_per_face = (face_kind != NULL) ? face_kind->n_vertices : 0;
+  mesh.cells.resize(n_cells * mesh.vertices_per_cell);
+  mesh.cell_material_ids.resize(n_cells);
+  mesh.faces.resize(n_faces * mesh.vertices_per_face);
+  mesh.face_boundary_ids.resize(n_faces);
+
+  // Decode the element blocks into the cell or face arrays
+  std::size_t first_cell = 0, first_face = 0;
+  for (unsigned int b = 0; b < element_blocks.size(); b++) {
+    const Block &block = element_blocks[b];
+    if (block.dim != dim && block.dim != dim - 1) continue;
+    const ElementKind &kind = gmsh_element_kind(block.type);
+    const bool is_cell = (block.dim == dim);
+    std::size_t &first = is_cell ? first_cell : first_face;
+    unsigned int *out = is_cell ? &mesh.cells[first * kind.n_vertices]
+                                : &mesh.faces[first * kind.n_vertices];
+    unsigned int *ids = is_cell ? &mesh.cell_material_ids[first]
+                                : &mesh.face_boundary_ids[first];
+
+    std::map<int, int>::const_iterator physical =
+        physical_tag[block.dim].find(block.tag);
+    const unsigned int id =
+        (physical != physical_tag[block.dim].end()) ? physical->second : block.tag;
+    std::fill(ids, ids + block.n, id);
+
+    copy_elements(kind, block.n,
+                  [&](std::size_t e, unsigned int v) {
+                    std::size_t tag = read_native<std::size_t>(
+                        block.data + e * block.stride + (1 + v) * 8);
+                    return vertex_of_tag[tag - min_node_tag];
+                  },
+                  out);
+    first += block.n;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Legacy VTK unstructured grid, ASCII or BINARY (big-endian)
+// ---------------------------------------------------------------------------
+
+// Read "count" values of "type" (ASCII or big-endian binary) starting at p
+template <typename T>
+void read_vtk_array(const char *&p, const char *end, bool binary,
+                    const std::string &type, std::size_t count,
+                    std::vector<T> &values) {
+  if (!binary) {
+    const char *data_end = end_of_ascii_data(p, end);
+    parse_ascii_numbers(p, data_end, count, values);
+    p = data_end;
+    return;
+  }
+
+  std::size_t bytes;
+  if (type == "double" || type == "vtktypeint64" || type == "long" ||
+      type == "vtktypeuint64" || type == "unsigned_long") {
+    bytes = 8;
+  } else if (type == "float" || type == "int" || type == "vtktypeint32" ||
+             type == "unsigned_int" || type == "vtktypeuint32") {
+    bytes = 4;
+  } else {
+    AssertThrow(false, ExcMessage("Unsupported VTK data type " + type));
+  }
+  AssertThrow(p + count * bytes <= end,
+              ExcMessage("VTK file ended before all values were read"));
+
+  values.resize(count);
+  const char *data = p;
+  const int kind = (type == "double") ? 0 : (type == "float") ? 1 : (bytes == 8) ? 2 : 3;
+  parallel_for(count, [&](std::size_t first, std::size_t last) {
+    for (std::size_t i = first; i < last; i++) {
+      const char *q = data + i * bytes;
+      switch (kind) {
+      case 0: values[i] = read_big_endian<double>(q); break;
+      case 1: values[i] = read_big_endian<float>(q); break;
+      case 2: values[i] = read_big_endian<std::int64_t>(q); break;
+      default: values[i] = read_big_endian<std::int32_t>(q);
+      }
+    }
+  });
+  p += count * bytes;
+}
+
+inline void read_vtk(const MappedFile &file, ImportedMesh &mesh) {
+  const char *p = file.data, *end = file.data + file.size;
+
+  AssertThrow(read_line(p, end).compare(0, 5, "# vtk") == 0,
+              ExcMessage("Not a legacy VTK file"));
+  read_line(p, end); // title
+  std::string encoding = read_line(p, end);
+  const bool binary = (encoding.compare(0, 6, "BINARY") == 0);
+  skip_blank_lines(p, end);
+  AssertThrow(read_line(p, end).find("UNSTRUCTURED_GRID") != std::string::npos,
+              ExcMessage("Only VTK UNSTRUCTURED_GRID datasets are supported"));
+
+  std::size_t n_points = 0, n_cells = 0;
+  std::vector<double> points;
+  std::vector<std::size_t> offsets, connectivity; // cell i: [offsets[i], offsets[i+1])
+  std::vector<int> cell_types;
+  std::vector<double> cell_data;
+  std::string cell_data_name;
+
+  while (p < end) {
+    skip_blank_lines(p, end);
+    if (p >= end) break;
+    std::string line = read_line(p, end);
+    char keyword[64] = "", type[64] = "";
+    std::size_t n = 0, m = 0;
+    sscanf(line.c_str(), "%63s", keyword);
+    std::string key(keyword);
+
+    if (key == "POINTS") {
+      sscanf(line.c_str(), "%*s %zu %63s", &n_points, type);
+      read_vtk_array(p, end, binary, type, 3 * n_points, points);
+    } else if (key == "CELLS") {
+      sscanf(line.c_str(), "%*s %zu %zu", &n, &m);
+      skip_blank_lines(p, end);
+      if (std::strncmp(p, "OFFSETS", 7) == 0) {
+        // Version 5 layout: offsets (n_cells+1 of them) and connectivity
+        line = read_line(p, end);
+        sscanf(line.c_str(), "%*s %63s", type);
+        read_vtk_array(p, end, binary, type, n, offsets);
+        skip_blank_lines(p, end);
+        line = read_line(p, end);
+        sscanf(line.c_str(), "%*s %63s", type);
+        read_vtk_array(p, end, binary, type, m, connectivity);
+        n_cells = n - 1;
+      } else {
+        // Classic layout: for every cell its vertex count and vertices
+        std::vector<std::size_t> cell_list;
+        read_vtk_array(p, end, binary, "int", m, cell_list);
+        n_cells = n;
+        offsets.resize(n_cells + 1);
+        offsets[0] = 0;
+        std::size_t position = 0;
+        for (std::size_t c = 0; c < n_cells; c++) {
+          offsets[c + 1] = offsets[c] + cell_list[position];
+          position += cell_list[position] + 1;
+        }
+        connectivity.resize(offsets[n_cells]);
+        parallel_for(n_cells, [&](std::size_t first, std::size_t last) {
+          for (std::size_t c = first; c < last; c++) {
+            // entries of cell c start after the c+1 vertex counts before them
+            for (std::size_t k = offsets[c]; k < offsets[c + 1]; k++) {
+              connectivity[k] = cell_list[k + c + 1];
+            }
+          }
+        });
+      }
+    } else if (key == "CELL_TYPES") {
+      sscanf(line.c_str(), "%*s %zu", &n);
+      read_vtk_array(p, end, binary, "int", n, cell_types);
+    } else if (key == "CELL_DATA") {
+      sscanf(line.c_str(), "%*s %zu", &n);
+      // Use the array named material_id, otherwise the first scalar array
+      while (p < end) {
+        skip_blank_lines(p, end);
+        const char *line_begin = p;
+        line = read_line(p, end);
+        char name[64] = "";
+        sscanf(line.c_str(), "%63s %63s %63s", keyword, name, type);
+        if (std::string(keyword) != "SCALARS") {
+          p = line_begin;
+          break;
+        }
+        skip_blank_lines(p, end);
+        if (std::strncmp(p, "LOOKUP_TABLE", 12) == 0) read_line(p, end);
+        std::vector<double> values;
+        read_vtk_array(p, end, binary, type, n, values);
+        if (cell_data_name.empty() || std::string(name) == "material_id") {
+          cell_data.swap(values);
+          cell_data_name = name;
+        }
+      }
+    } else if (key == "METADATA") {
+      // Information blocks end with an empty line
+      while (p < end && read_line(p, end).size() > 0) {
+      }
+    } else if (key == "POINT_DATA") {
+      break; // Nothing after this is needed
+    } else {
+      AssertThrow(!binary,
+                  ExcMessage("Unsupported binary VTK section " + key));
+    }
+  }
+  AssertThrow(n_points > 0 && n_cells > 0 && cell_types.size() == n_cells,
+              ExcMessage("VTK file has no POINTS, CELLS or CELL_TYPES"));
+
+  mesh.vertices.swap(points);
+
+  // Split the cells into the (highest dimensional) cells and the faces
+  int dim = 0;
+  for (std::size_t c = 0; c < n_cells; c++) {
+    dim = std::max(dim, vtk_element_kind(cell_types[c]).dim);
+  }
+  AssertThrow(dim >= 2, ExcMessage("VTK file contains no 2D or 3D cells"));
+  mesh.dim = dim;
+
+  const ElementKind *cell_kind = NULL, *face_kind = NULL;
+  std::vector<std::size_t> cell_list, face_list;
+  for (std::size_t c = 0; c < n_cells; c++) {
+    const ElementKind &kind = vtk_element_kind(cell_types[c]);
+    AssertThrow(kind.dim >= 0, ExcMessage("Unsupported VTK cell type " +
+                                          std::to_string(cell_types[c])));
+    if (kind.dim == dim) {
+      AssertThrow(cell_kind == NULL || cell_kind == &kind,
+                  ExcMessage("Meshes with mixed cell types are not supported"));
+      cell_kind = &kind;
+      cell_list.push_back(c);
+    } else if (kind.dim == dim - 1) {
+      AssertThrow(face_kind == NULL || face_kind == &kind,
+                  ExcMessage("Meshes with mixed face types are not supported"));
+      face_kind = &kind;
+      face_list.push_back(c);
+    }
+  }
+  mesh.simplex = cell_kind->simplex;
+  mesh.vertices_per_cell = cell_kind->n_vertices;
+  mesh.vertices_per_face = (face_kind != NULL) ? face_kind->n_vertices : 0;
+
+  for (unsigned int pass = 0; pass < 2; pass++) {
+    const std::vector<std::size_t> &list = (pass == 0) ? cell_list : face_list;
+    if (list.empty()) continue;
+    const ElementKind &kind = (pass == 0) ? *cell_kind : *face_kind;
+    std::vector<unsigned int> &out = (pass == 0) ? mesh.cells : mesh.faces;
+    std::vector<unsigned int> &ids =
+        (pass == 0) ? mesh.cell_material_ids : mesh.face_boundary_ids;
+    out.resize(list.size() * kind.n_vertices);
+    ids.resize(list.size());
+    copy_elements(kind, list.size(),
+                  [&](std::size_t e, unsigned int v) {
+                    return static_cast<unsigned int>(connectivity[offsets[list[e]] + v]);
+                  },
+                  &out[0]);
+    parallel_for(list.size(), [&](std::size_t first, std::size_t last) {
+      for (std::size_t e = first; e < last; e++) {
+        ids[e] = cell_data.empty() ? 0 : static_cast<unsigned int>(cell_data[list[e]]);
+      }
+    });
+  }
+}
+
+} // namespace MeshImport
+
+// Read a .msh (Gmsh 4.1 binary) or .vtk (legacy unstructured grid) file
+inline ImportedMesh read_mesh_file(const std::string &filename) {
+  MeshImport::MappedFile file(filename);
+  ImportedMesh mesh;
+  std::string extension = filename.substr(filename.find_last_of('.') + 1);
+  if (extension == "msh") {
+    MeshImport::read_gmsh(file, mesh);
+  } else if (extension == "vtk") {
+    MeshImport::read_vtk(file, mesh);
+  } else {
+    AssertThrow(false, ExcMessage("Unknown mesh file extension: " + filename));
+  }
+  return mesh;
+}
+
+// Build a triangulation (with material and boundary ids) from an imported mesh
+template <int dim>
+void build_triangulation(const ImportedMesh &mesh,
+                         Triangulation<dim> &triangulation) {
+  AssertThrow(mesh.dim == dim,
+              ExcMessage("The mesh file contains a " + std::to_string(mesh.dim) +
+                         "D mesh, but a " + std::to_string(dim) +
+                         "D mesh is needed"));
+
+  const std::size_t n_vertices = mesh.vertices.size() / 3;
+  const std::size_t n_cells = mesh.cell_material_ids.size();
+  const std::size_t n_faces = mesh.face_boundary_ids.size();
+
+  std::vector<Point<dim>> vertices(n_vertices);
+  std::vector<CellData<dim>> cells(n_cells, CellData<dim>(mesh.vertices_per_cell));
+  MeshImport::parallel_for(n_vertices, [&](std::size_t first, std::size_t last) {
+    for (std::size_t i = first; i < last; i++) {
+      for (unsigned int d = 0; d < dim; d++) {
+        vertices[i][d] = mesh.vertices[3 * i + d];
+      }
+    }
+  });
+  MeshImport::parallel_for(n_cells, [&](std::size_t first, std::size_t last) {
+    for (std::size_t c = first; c < last; c++) {
+      for (unsigned int v = 0; v < mesh.vertices_per_cell; v++) {
+        cells[c].vertices[v] = mesh.cells[c * mesh.vertices_per_cell + v];
+      }
+      cells[c].material_id = mesh.cell_material_ids[c];
+    }
+  });
+
+  // Boundary faces: lines in 2D, triangles or quads in 3D
+  SubCellData subcell_data;
+  for (std::size_t f = 0; f < n_faces; f++) {
+    if (dim == 2) {
+      CellData<1> face(2);
+      face.vertices[0] = mesh.faces[2 * f];
+      face.vertices[1] = mesh.faces[2 * f + 1];
+      face.boundary_id = mesh.face_boundary_ids[f];
+      subcell_data.boundary_lines.push_back(face);
+    } else {
+      CellData<2> face(mesh.vertices_per_face);
+      for (unsigned int v = 0; v < mesh.vertices_per_face; v++) {
+        face.vertices[v] = mesh.faces[f * mesh.vertices_per_face + v];
+      }
+      face.boundary_id = mesh.face_boundary_ids[f];
+      subcell_data.boundary_quads.push_back(face);
+    }
+  }
+
+  // Mesh generators usually write points that no cell uses
+  GridTools::delete_unused_vertices(vertices, cells, subcell_data);
+  if (!mesh.simplex) GridTools::consistently_order_cells(cells);
+  GridTools::invert_all_negative_measure_cells(vertices, cells);
+  triangulation.create_triangulation(vertices, cells, subcell_data);
+
+  std::cout << "   Imported mesh: " << n_cells << " cells, " << vertices.size()
+            << " vertices, " << n_faces << " boundary faces" << std::endl;
+}
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef SOLVERSERVICE_H_
+#define SOLVERSERVICE_H_
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/types.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+// POSIX sockets
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace dealii;
+
+/*Long-running solver for repeated queries on the same meshes
+  (main2b_service.cc).
+
+  A process per solve pays for the mesh, the dof numbering, the sparsity
+  pattern, the geometry cache and the LU factorization of K every time, while
+  a design tool changing boundary temperatures or heat loads only changes F.
+  The service keeps up to max_problems FEM objects alive, keyed by their mesh
+  ("box 40 80 20", "file part.msh", plus " simplex"), and listens on a Unix
+  domain socket for requests, one per line, each answered by one line.
+
+    solve <mesh> [temperature <boundary id> <T>]... [source <material id> <s>]...
+          [convection <boundary id> <h> <T_inf>]...
+          [conductivity <material id> <kappa>]...
+          [average <boundary id>]... [field]
+      Solves the problem with these settings (the ones not given have the FEM
+      defaults; without temperatures the Dirichlet values of
+      define_boundary_conds() apply). If the settings that enter K (the
+      Dirichlet boundary ids, the convection and the conductivities) are those
+      of the previous solve on the same mesh, only F is rebuilt and the
+      factorization of K is reused. Reply:
+        ok dofs=<n> min=<T> max=<T> mean=<T> [average_<id>=<T>]...
+           refactorized=<0|1> ms=<time> [field <T_0> <T_1> ...]
+      with the nodal temperatures by dof number after "field".
+    stats     Warm meshes and the number of solves.
+    shutdown  Replies "ok" and stops the service.
+
+  Anything that fails is answered with "error <message>" and the service
+  goes on. Requests are handled one at a time, in the order they arrive; the
+  FEM routines use the threads of the machine inside each request. A client
+  that sends nothing (or reads nothing) for client_timeout seconds is
+  disconnected, so it cannot hold up the others. The socket is made
+  accessible to the user running the service only (mode 0600), as the
+  requests can read any mesh file of that user and stop the service.
+
+  From a shell, for example:
+    echo "solve box 40 80 20 temperature 0 300 temperature 1 310 average 3" |
+      socat - UNIX-CONNECT:/tmp/fem2b.sock*/
+template <int dim, typename IndexType = unsigned int> class SolverService {
+public:
+  SolverService(const std::string &socket_path);
+  ~SolverService();
+
+  // Accept connections and answer requests until "shutdown"
+  void run();
+  // Answer one request line (also usable without the socket)
+  std::string handle_request(const std::string &request);
+
+  std::string socket_path;
+  unsigned int max_problems; // Warm meshes kept; the least recently used goes
+  double client_timeout;     // Seconds of silence before a client is dropped
+
+private:
+  struct WarmProblem {
+    std::unique_ptr<FEM<dim, IndexType>> problem;
+    std::string matrix_settings; // What K was assembled with
+    unsigned long last_used;
+    unsigned long n_solves;
+  };
+
+  std::string solve(std::istringstream &request);
+  WarmProblem &warm_problem(const std::string &mesh_key,
+                            const std::vector<std::string> &mesh_spec,
+                            bool simplex);
+  void serve_client(int client);
+
+  std::map<std::string, WarmProblem> problems;
+  unsigned long n_requests;
+  bool stop;
+  int server;
+};
+
+template <int dim, typename IndexType>
+SolverService<dim, IndexType>::SolverService(const std::string &path)
+    : socket_path(path), max_problems(4), client_timeout(10.), n_requests(0),
+      stop(false), server(-1) {}
+
+template <int dim, typename IndexType>
+SolverService<dim, IndexType>::~SolverService() {
+  if (server >= 0) {
+    close(server);
+    unlink(socket_path.c_str());
+  }
+}
+
+template <int dim, typename IndexType>
+void SolverService<dim, IndexType>::run() {
+
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  AssertThrow(socket_path.size() < sizeof(address.sun_path),
+              ExcMessage("Socket path too long: " + socket_path));
+  std::strncpy(address.sun_path, socket_path.c_str(),
+               sizeof(address.sun_path) - 1);
+
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  AssertThrow(server >= 0, ExcMessage("Cannot create a Unix domain socket"));
+  unlink(socket_path.c_str()); // Left over from a previous run
+  // Owner only before anyone can connect (listen)
+  AssertThrow(bind(server, (sockaddr *)&address, sizeof(address)) == 0 &&
+                  chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) == 0 &&
+                  listen(server, 16) == 0,
+              ExcMessage("Cannot listen on " + socket_path + ": " +
+                         std::strerror(errno)));
+  std::cout << "   Solver service listening on " << socket_path << std::endl;
+
+  while (!stop) {
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    // recv() and send() give up after client_timeout (serve_client returns)
+    timeval timeout;
+    timeout.tv_sec = time_t(client_timeout);
+    timeout.tv_usec = suseconds_t((client_timeout - timeout.tv_sec) * 1.e6);
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    serve_client(client);
+    close(client);
+  }
+}
+
+// Read request lines from a client until it disconnects (or "shutdown")
+template <int dim, typename IndexType>
+void SolverService<dim, IndexType>::serve_client(int client) {
+  std::string buffer;
+  char chunk[4096];
+  while (!stop) {
+    std::size_t end_of_line;
+    while ((end_of_line = buffer.find('\n')) == std::string::npos) {
+      ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+      if (n <= 0) return;
+      buffer.append(chunk, n);
+    }
+    std::string request = buffer.substr(0, end_of_line);
+    buffer.erase(0, end_of_line + 1);
+    if (!request.empty() && request.back() == '\r') request.pop_back();
+    if (request.empty()) continue;
+
+    std::string reply = handle_request(request) + "\n";
+    for (std::size_t sent = 0; sent < reply.size();) {
+      // MSG_NOSIGNAL: a client that went away is not a reason to stop
+      ssize_t n = send(client, reply.data() + sent, reply.size() - sent,
+                       MSG_NOSIGNAL);
+      if (n <= 0) return;
+      sent += n;
+    }
+  }
+}
+
+template <int dim, typename IndexType>
+std::string
+SolverService<dim, IndexType>::handle_request(const std::string &request) {
+  n_requests++;
+  std::istringstream tokens(request);
+  std::string command;
+  tokens >> command;
+  try {
+    if (command == "solve") return solve(tokens);
+    if (command == "shutdown") {
+      stop = true;
+      return "ok";
+    }
+    if (command == "stats") {
+      std::ostringstream reply;
+      reply << "ok requests=" << n_requests << " meshes=" << problems.size();
+      typename std::map<std::string, WarmProblem>::const_iterator p;
+      for (p = problems.begin(); p != problems.end(); ++p) {
+        reply << " [" << p->first << "]=" << p->second.n_solves;
+      }
+      return reply.str();
+    }
+    return "error unknown command \"" + command + "\"";
+  } catch (std::exception &exc) {
+    // One line per reply
+    std::string message = exc.what();
+    std::replace(message.begin(), message.end(), '\n', ' ');
+    return "error " + message;
+  }
+}
+
+template <int dim, typename IndexType>
+std::string SolverService<dim, IndexType>::solve(std::istringstream &tokens) {
+  const auto start = std::chrono::steady_clock::now();
+
+  // Mesh: "box n_1 .. n_dim" or "file <name>", then optionally "simplex"
+  std::vector<std::string> mesh_spec(1);
+  tokens >> mesh_spec[0];
+  const unsigned int n_words =
+      (mesh_spec[0] == "box") ? dim : (mesh_spec[0] == "file" ? 1 : 0);
+  AssertThrow(n_words > 0, ExcMessage("The mesh must be \"box\" or \"file\""));
+  mesh_spec.resize(1 + n_words);
+  for (unsigned int i = 1; i <= n_words; i++) {
+    AssertThrow(tokens >> mesh_spec[i], ExcMessage("Incomplete mesh"));
+  }
+  std::string word;
+  bool simplex = false;
+  std::vector<std::string> options;
+  while (tokens >> word) {
+    if (word == "simplex") {
+      simplex = true;
+    } else {
+      options.push_back(word);
+    }
+  }
+
+  // Settings of this request
+  std::map<types::boundary_id, double> temperatures;
+  std::map<types::material_id, double> sources, conductivities;
+  std::map<types::boundary_id, std::pair<double, double>> convection;
+  std::vector<types::boundary_id> averages;
+  bool field = false;
+  for (unsigned int k = 0; k < options.size(); k++) {
+    const std::string &name = options[k];
+    const unsigned int n_values = (name == "field") ? 0
+                                  : (name == "average") ? 1
+                                  : (name == "convection") ? 3
+                                                          : 2;
+    AssertThrow(k + n_values < options.size(),
+                ExcMessage("Missing values after \"" + name + "\""));
+    std::vector<double> value(n_values);
+    for (unsigned int i = 0; i < n_values; i++) {
+      value[i] = std::stod(options[k + 1 + i]);
+    }
+    k += n_values;
+    if (name == "temperature") {
+      temperatures[types::boundary_id(value[0])] = value[1];
+    } else if (name == "source") {
+      sources[types::material_id(value[0])] = value[1];
+    } else if (name == "conductivity") {
+      conductivities[types::material_id(value[0])] = value[1];
+    } else if (name == "convection") {
+      convection[types::boundary_id(value[0])] =
+          std::make_pair(value[1], value[2]);
+    } else if (name == "average") {
+      averages.push_back(types::boundary_id(value[0]));
+    } else if (name == "field") {
+      field = true;
+    } else {
+      AssertThrow(false, ExcMessage("Unknown option \"" + name + "\""));
+    }
+  }
+
+  std::string mesh_key = mesh_spec[0];
+  for (unsigned int i = 1; i < mesh_spec.size(); i++) {
+    mesh_key += " " + mesh_spec[i];
+  }
+  if (simplex) mesh_key += " simplex";
+  WarmProblem &warm = warm_problem(mesh_key, mesh_spec, simplex);
+  FEM<dim, IndexType> &problem = *warm.problem;
+
+  // Everything K depends on, besides the mesh
+  std::ostringstream settings;
+  settings << std::setprecision(17) << "dirichlet";
+  typename std::map<types::boundary_id, double>::const_iterator t;
+  for (t = temperatures.begin(); t != temperatures.end(); ++t) {
+    settings << " " << t->first;
+  }
+  settings << " conductivity";
+  typename std::map<types::material_id, double>::const_iterator c;
+  for (c = conductivities.begin(); c != conductivities.end(); ++c) {
+    settings << " " << int(c->first) << ":" << c->second;
+  }
+  settings << " convection";
+  typename std::map<types::boundary_id,
+                    std::pair<double, double>>::const_iterator h;
+  for (h = convection.begin(); h != convection.end(); ++h) {
+    settings << " " << h->first << ":" << h->second.first;
+  }
+
+  problem.dirichlet_temperatures = temperatures;
+  problem.material_heat_source = sources;
+  problem.material_conductivity = conductivities;
+  problem.convection_boundaries = convection;
+  problem.boundary_values.clear();
+  problem.define_boundary_conds();
+
+  const bool refactorize = (settings.str() != warm.matrix_settings);
+  if (refactorize) {
+    warm.matrix_settings.clear(); // In case the assembly fails
+    problem.setup_convection_faces();
+    problem.assemble_system(); // Also drops the old factorization
+    warm.matrix_settings = settings.str();
+  } else {
+    problem.assemble_rhs();
+  }
+  problem.solve();
+  warm.n_solves++;
+
+  const Vector<double> &D = problem.D;
+  std::ostringstream reply;
+  reply << std::setprecision(10) << "ok dofs=" << D.size()
+        << " min=" << *std::min_element(D.begin(), D.end())
+        << " max=" << *std::max_element(D.begin(), D.end())
+        << " mean=" << D.mean_value();
+  for (unsigned int k = 0; k < averages.size(); k++) {
+    reply << " average_" << int(averages[k]) << "="
+          << problem.sensor_functional(averages[k]) * D;
+  }
+  const double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  reply << " refactorized=" << refactorize << " ms=" << ms;
+  if (field) {
+    reply << " field";
+    for (unsigned int i = 0; i < D.size(); i++) {
+      reply << " " << D[i];
+    }
+  }
+  return reply.str();
+}
+
+// The FEM object for a mesh, set up on first use
+template <int dim, typename IndexType>
+typename SolverService<dim, IndexType>::WarmProblem &
+SolverService<dim, IndexType>::warm_problem(
+    const std::string &mesh_key, const std::vector<std::string> &mesh_spec,
+    bool simplex) {
+
+  typename std::map<std::string, WarmProblem>::iterator p =
+      problems.find(mesh_key);
+  if (p == problems.end()) {
+    // Make room by dropping the least recently used mesh
+    if (problems.size() >= std::max(max_problems, 1u)) {
+      typename std::map<std::string, WarmProblem>::iterator oldest =
+          problems.begin();
+      for (p = problems.begin(); p != problems.end(); ++p) {
+        if (p->second.last_used < oldest->second.last_used) oldest = p;
+      }
+      std::cout << "   Dropping mesh [" << oldest->first << "]" << std::endl;
+      problems.erase(oldest);
+    }
+
+    std::unique_ptr<FEM<dim, IndexType>> problem(
+        new FEM<dim, IndexType>(simplex));
+    if (mesh_spec[0] == "box") {
+      std::vector<unsigned int> num_of_elems(dim);
+      for (unsigned int i = 0; i < dim; i++) {
+        num_of_elems[i] = std::stoul(mesh_spec[1 + i]);
+        AssertThrow(num_of_elems[i] > 0,
+                    ExcMessage("A box needs at least one element per direction"));
+      }
+      problem->generate_mesh(num_of_elems);
+    } else {
+      problem->import_mesh(mesh_spec[1]);
+    }
+    problem->setup_system();
+
+    p = problems.insert(std::make_pair(mesh_key, WarmProblem())).first;
+    p->second.problem = std::move(problem);
+    p->second.n_solves = 0;
+  }
+  p->second.last_used = n_requests;
+  return p->second;
+}
+
+#endif
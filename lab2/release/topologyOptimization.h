@@ -0,0 +1,630 @@
+#ifndef TOPOLOGYOPTIMIZATION_H_
+#define TOPOLOGYOPTIMIZATION_H_
+#include <deal.II/base/parallel.h>
+#include <deal.II/lac/precondition.h>
+#include <deal.II/lac/solver_cg.h>
+#include <deal.II/lac/solver_control.h>
+// Standard C++ libraries
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "compressedSparseMatrix.h"
+#include "../../lab1/solutionSeries.h"
+
+using namespace dealii;
+
+/*Density-based thermal topology optimization on the mesh of a FEM object
+  (FEM2a.h or FEM2b.h, whichever is included before this file).
+
+  Every active cell e gets a density 0 <= rho_e <= 1. The filtered density
+  (a cone-weighted average over the cells within "filter_radius") sets the
+  conductivity with the SIMP interpolation
+    kappa_e = kappa_solid_e*(void_conductivity + (1 - void_conductivity)*rho_e^p),
+  where kappa_solid_e is the conductivity the FEM object gives the cell. Under
+  a uniform heat source the thermal compliance c = F.T (the heat source
+  weighted temperature) is minimized for a given fraction of the volume, with
+  optimality criteria (OC) updates of the densities.
+
+  Everything that does not depend on the densities is set up once in setup():
+  the element matrices for unit conductivity (so K is re-assembled as
+  sum_e kappa_e*Klocal_e without any quadrature), the heat source vector, the
+  sparsity of K (from the FEM object) and the neighbor lists of the filter.
+  Each iteration then assembles K, eliminates the Dirichlet columns so K stays
+  symmetric, and solves with SSOR preconditioned CG started from the previous
+  iteration's temperatures, which are close to the new ones once the design
+  settles. With compressed_matrix both the products and the SSOR sweeps of CG
+  run on K_compressed; run() reports the time per CG iteration and the bytes
+  per nonzero each iteration reads.
+
+  The problem optimized is conduction under the uniform heat_source with the
+  Dirichlet values of the FEM object. Its convection boundaries and material
+  heat sources are not part of it, so setup() refuses a FEM object that has
+  any.*/
+template <int dim, typename IndexType = unsigned int>
+class TopologyOptimization {
+public:
+  // Class functions
+  TopologyOptimization(FEM<dim, IndexType> &fem_problem); // Class constructor
+
+  // Call after problem.setup_system()
+  void setup();
+  void run();
+  // Write the temperature and the filtered density to topology.vtk
+  void output_results();
+
+  // Steps of one iteration
+  void assemble_system();
+  unsigned int solve(Vector<double> &x, const Vector<double> &b);
+  void compute_sensitivities();
+  void update_density();
+  /*Memory read by one CG iteration per nonzero of K: the matrix in the
+    product and in the SSOR sweeps, plus the vector work of SolverCG*/
+  double iteration_bytes_per_nonzero() const;
+
+  // SIMP conductivity of a cell for its current filtered density
+  double design_conductivity(unsigned int e) const;
+
+  // Density filter and its transpose (for the chain rule of the sensitivities)
+  void setup_filter();
+  void apply_filter(const Vector<double> &rho, Vector<double> &rho_filtered) const;
+  void apply_filter_transpose(const Vector<double> &d_filtered,
+                              Vector<double> &d) const;
+
+  // Class objects
+  FEM<dim, IndexType> &problem;
+
+  // Parameters (set before setup())
+  double volume_fraction;   // Allowed fraction of the total volume
+  double penalty;           // SIMP exponent p
+  double void_conductivity; // Conductivity of void, relative to the solid
+  double filter_radius;     // Filter radius (0: 1.5 times the mean element size)
+  double move_limit;        // Largest density change per iteration
+  double heat_source;       // Uniform volumetric heat source
+  unsigned int max_iterations;
+  double tolerance;        // Stop when no density changes more than this
+  double solver_tolerance; // CG tolerance, relative to the right hand side
+  bool compressed_matrix;  // CG products with K_compressed (set before setup())
+  // If set, run() appends the temperature and the filtered density of every
+  // iteration to it, as step "iteration"
+  SolutionSeries *history;
+
+  // Design, by active cell index
+  Vector<double> density, filtered_density;
+  double compliance;
+
+  // Per-cell data for the re-assembly: dofs, Klocal for unit conductivity
+  // (dofs_per_elem^2 values per cell), solid conductivity and volume
+  unsigned int dofs_per_elem;
+  std::vector<IndexType> cell_dofs;
+  std::vector<double> unit_Klocal;
+  Vector<double> solid_conductivity, cell_volume;
+
+  Vector<double> load; // Heat source vector, before the Dirichlet elimination
+  Vector<double> adjoint_load, Z; // Adjoint, if the Dirichlet values are not all zero
+  bool self_adjoint;
+  PreconditionSSOR<SparseMatrix<double>> preconditioner;
+  CompressedSparseMatrix<IndexType> K_compressed; // If compressed_matrix
+  PreconditionCompressedSSOR<IndexType> compressed_preconditioner;
+
+  // Filter: cells within filter_radius of each cell (compressed rows), the
+  // weights filter_radius - distance and their volume weighted row sums
+  std::vector<unsigned int> filter_row_start, filter_column;
+  std::vector<double> filter_weight;
+  Vector<double> filter_normalization;
+
+  // dc/drho and dV/drho (after the filter chain rule)
+  Vector<double> compliance_sensitivity, volume_sensitivity;
+  unsigned int solver_iterations;
+  // All CG iterations of run() and their time in seconds
+  unsigned long long total_iterations;
+  double solver_time;
+};
+
+// Class constructor
+template <int dim, typename IndexType>
+TopologyOptimization<dim, IndexType>::TopologyOptimization(
+    FEM<dim, IndexType> &fem_problem)
+    : problem(fem_problem) {
+  volume_fraction = 0.4;
+  penalty = 3.;
+  void_conductivity = 1.e-3;
+  filter_radius = 0.;
+  move_limit = 0.2;
+  heat_source = 1.e6;
+  max_iterations = 200;
+  tolerance = 0.01;
+  solver_tolerance = 1.e-8;
+  compressed_matrix = false;
+  history = nullptr;
+  compliance = 0.;
+  solver_iterations = 0;
+  total_iterations = 0;
+  solver_time = 0.;
+}
+
+// Element matrices, heat source vector and filter, computed once
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::setup() {
+
+  AssertThrow(problem.convection_boundaries.empty(),
+              ExcMessage("Topology optimization does not include convection "
+                         "boundaries; clear convection_boundaries"));
+  AssertThrow(problem.material_heat_source.empty(),
+              ExcMessage("Topology optimization uses its own uniform "
+                         "heat_source; clear material_heat_source"));
+
+  // The solid conductivity comes from the FEM object's own per-cell data
+  problem.cell_conductivity.reinit(0);
+
+  const unsigned int n_cells = problem.triangulation.n_active_cells();
+  dofs_per_elem = problem.fe.dofs_per_cell;
+  cell_dofs.resize(n_cells * dofs_per_elem);
+  unit_Klocal.resize(n_cells * dofs_per_elem * dofs_per_elem);
+  solid_conductivity.reinit(n_cells);
+  cell_volume.reinit(n_cells);
+  load.reinit(problem.dof_handler.n_dofs());
+
+  std::vector<double> weight;
+  std::vector<std::vector<double>> N;
+  std::vector<std::vector<std::vector<double>>> dN;
+  problem.tabulate_basis(weight, N, dN);
+
+  FullMatrix<double> kappa(dim, dim), Klocal(dofs_per_elem, dofs_per_elem),
+      Jacobian(dim, dim);
+  kappa = 0.;
+  for (unsigned int I = 0; I < dim; I++) {
+    kappa[I][I] = 1.;
+  }
+  std::vector<IndexType> local_dof_indices(dofs_per_elem);
+  typename DoFHandler<dim>::active_cell_iterator
+      elem = problem.dof_handler.begin_active(),
+      endc = problem.dof_handler.end();
+  for (; elem != endc; ++elem) {
+    const unsigned int e = elem->active_cell_index();
+    get_dof_indices(elem, local_dof_indices);
+    problem.element_Klocal(e, local_dof_indices, kappa, Klocal);
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      cell_dofs[e * dofs_per_elem + A] = local_dof_indices[A];
+      for (unsigned int B = 0; B < dofs_per_elem; B++) {
+        unit_Klocal[(e * dofs_per_elem + A) * dofs_per_elem + B] = Klocal[A][B];
+      }
+    }
+    solid_conductivity[e] = problem.element_conductivity(elem);
+
+    // Heat source vector, F_A = heat_source * int_e N_A dV
+    for (unsigned int q = 0; q < weight.size(); q++) {
+      Jacobian = 0.;
+      for (unsigned int i = 0; i < dim; i++) {
+        for (unsigned int j = 0; j < dim; j++) {
+          for (unsigned int A = 0; A < dofs_per_elem; A++) {
+            Jacobian[i][j] +=
+                problem.nodeLocation[local_dof_indices[A]][i] * dN[q][A][j];
+          }
+        }
+      }
+      double dV = std::abs(Jacobian.determinant()) * weight[q];
+      cell_volume[e] += dV;
+      for (unsigned int A = 0; A < dofs_per_elem; A++) {
+        load[local_dof_indices[A]] += heat_source * N[q][A] * dV;
+      }
+    }
+  }
+
+  /*With all Dirichlet values zero the compliance is self-adjoint (the adjoint
+    solution is T itself), otherwise the adjoint has its own solve with the
+    heat source on the free dofs as right hand side (and Z = 0 on the
+    Dirichlet dofs)*/
+  self_adjoint = true;
+  adjoint_load = load;
+  typename std::map<IndexType, double>::const_iterator bc;
+  for (bc = problem.boundary_values.begin(); bc != problem.boundary_values.end();
+       ++bc) {
+    if (bc->second != 0.) self_adjoint = false;
+    adjoint_load[bc->first] = 0.;
+  }
+  Z.reinit(problem.dof_handler.n_dofs());
+
+  density.reinit(n_cells);
+  density = volume_fraction;
+  filtered_density.reinit(n_cells);
+  compliance_sensitivity.reinit(n_cells);
+  volume_sensitivity.reinit(n_cells);
+  setup_filter();
+
+  // The volume constraint is linear, so dV/drho is fixed: H^T*volume
+  apply_filter_transpose(cell_volume, volume_sensitivity);
+
+  // The sparsity of K is fixed, so the compressed copy's structure is too
+  if (compressed_matrix) {
+    K_compressed.reinit(problem.K);
+    std::cout << "   Compressed K: " << K_compressed.bytes_per_nonzero()
+              << " bytes per nonzero, "
+              << 100. * K_compressed.compressed_fraction()
+              << "% of the columns as 16 bit offsets" << std::endl;
+  }
+}
+
+// kappa_solid*(void_conductivity + (1 - void_conductivity)*rho_filtered^p)
+template <int dim, typename IndexType>
+double
+TopologyOptimization<dim, IndexType>::design_conductivity(unsigned int e) const {
+  return solid_conductivity[e] *
+         (void_conductivity +
+          (1. - void_conductivity) * std::pow(filtered_density[e], penalty));
+}
+
+// Neighbor lists of the density filter
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::setup_filter() {
+
+  const unsigned int n_cells = problem.triangulation.n_active_cells();
+  std::vector<Point<dim>> centers(n_cells);
+  typename DoFHandler<dim>::active_cell_iterator
+      elem = problem.dof_handler.begin_active(),
+      endc = problem.dof_handler.end();
+  for (; elem != endc; ++elem) {
+    centers[elem->active_cell_index()] = elem->center();
+  }
+  if (filter_radius <= 0.) {
+    filter_radius = 1.5 * std::pow(cell_volume.l1_norm() / n_cells, 1. / dim);
+  }
+
+  /*The cell centers are sorted into bins of size filter_radius, so the cells
+    within the radius of a cell are in its own bin or the adjacent ones
+    (3^dim bins in all) instead of anywhere in the mesh*/
+  Point<dim> lower = centers[0], upper = centers[0];
+  for (unsigned int e = 0; e < n_cells; e++) {
+    for (unsigned int I = 0; I < dim; I++) {
+      lower[I] = std::min(lower[I], centers[e][I]);
+      upper[I] = std::max(upper[I], centers[e][I]);
+    }
+  }
+  unsigned int n_bins[dim], total_bins = 1;
+  for (unsigned int I = 0; I < dim; I++) {
+    n_bins[I] = (unsigned int)((upper[I] - lower[I]) / filter_radius) + 1;
+    total_bins *= n_bins[I];
+  }
+  auto bin_of = [&](const Point<dim> &x, unsigned int *b) {
+    for (unsigned int I = 0; I < dim; I++) {
+      b[I] = std::min((unsigned int)((x[I] - lower[I]) / filter_radius),
+                      n_bins[I] - 1);
+    }
+  };
+  auto bin_index = [&](const unsigned int *b) {
+    unsigned int index = 0;
+    for (int I = dim - 1; I >= 0; I--) {
+      index = index * n_bins[I] + b[I];
+    }
+    return index;
+  };
+
+  // Counting sort of the cells by bin
+  std::vector<unsigned int> bin_start(total_bins + 1, 0), bin_cells(n_cells);
+  std::vector<unsigned int> cell_bin(n_cells);
+  for (unsigned int e = 0; e < n_cells; e++) {
+    unsigned int b[dim];
+    bin_of(centers[e], b);
+    cell_bin[e] = bin_index(b);
+    bin_start[cell_bin[e] + 1]++;
+  }
+  for (unsigned int b = 0; b < total_bins; b++) {
+    bin_start[b + 1] += bin_start[b];
+  }
+  std::vector<unsigned int> bin_fill(bin_start.begin(), bin_start.end() - 1);
+  for (unsigned int e = 0; e < n_cells; e++) {
+    bin_cells[bin_fill[cell_bin[e]]++] = e;
+  }
+
+  filter_row_start.assign(1, 0);
+  filter_column.clear();
+  filter_weight.clear();
+  filter_normalization.reinit(n_cells);
+  const unsigned int n_neighbor_bins = (dim == 2) ? 9 : 27;
+  for (unsigned int e = 0; e < n_cells; e++) {
+    unsigned int b[dim], neighbor[dim];
+    bin_of(centers[e], b);
+    for (unsigned int k = 0; k < n_neighbor_bins; k++) {
+      bool inside = true;
+      for (unsigned int I = 0, code = k; I < dim; I++, code /= 3) {
+        int n = int(b[I]) + int(code % 3) - 1;
+        inside = inside && (n >= 0) && (n < int(n_bins[I]));
+        neighbor[I] = (unsigned int)n;
+      }
+      if (!inside) continue;
+      unsigned int bin = bin_index(neighbor);
+      for (unsigned int c = bin_start[bin]; c < bin_start[bin + 1]; c++) {
+        unsigned int f = bin_cells[c];
+        double w = filter_radius - centers[e].distance(centers[f]);
+        if (w <= 0.) continue;
+        filter_column.push_back(f);
+        filter_weight.push_back(w);
+        filter_normalization[e] += w * cell_volume[f];
+      }
+    }
+    filter_row_start.push_back(filter_column.size());
+  }
+  std::cout << "   Density filter radius " << filter_radius << ", "
+            << double(filter_column.size()) / n_cells
+            << " neighbors per element" << std::endl;
+}
+
+// rho_filtered_e = sum_f w_ef*V_f*rho_f / sum_f w_ef*V_f
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::apply_filter(
+    const Vector<double> &rho, Vector<double> &rho_filtered) const {
+  parallel::apply_to_subranges(
+      std::size_t(0), std::size_t(rho.size()),
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t e = first; e < last; e++) {
+          double sum = 0.;
+          for (unsigned int k = filter_row_start[e]; k < filter_row_start[e + 1];
+               k++) {
+            sum += filter_weight[k] * cell_volume[filter_column[k]] *
+                   rho[filter_column[k]];
+          }
+          rho_filtered[e] = sum / filter_normalization[e];
+        }
+      },
+      4096);
+}
+
+// Transpose of apply_filter. The weights are symmetric (w_ef = w_fe), so this
+// is a gather over the same neighbor lists as well
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::apply_filter_transpose(
+    const Vector<double> &d_filtered, Vector<double> &d) const {
+  parallel::apply_to_subranges(
+      std::size_t(0), std::size_t(d_filtered.size()),
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t f = first; f < last; f++) {
+          double sum = 0.;
+          for (unsigned int k = filter_row_start[f]; k < filter_row_start[f + 1];
+               k++) {
+            unsigned int e = filter_column[k];
+            sum += filter_weight[k] * d_filtered[e] / filter_normalization[e];
+          }
+          d[f] = cell_volume[f] * sum;
+        }
+      },
+      4096);
+}
+
+// K = sum_e kappa_e*Klocal_e, with the Dirichlet columns eliminated
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::assemble_system() {
+
+  SparseMatrix<double> &K = problem.K;
+  K = 0;
+  problem.K_factorized = false;
+  const unsigned int n_cells = density.size();
+  for (unsigned int e = 0; e < n_cells; e++) {
+    double kappa = design_conductivity(e);
+    const IndexType *dofs = &cell_dofs[e * dofs_per_elem];
+    const double *Klocal = &unit_Klocal[e * dofs_per_elem * dofs_per_elem];
+    for (unsigned int A = 0; A < dofs_per_elem; A++) {
+      for (unsigned int B = 0; B < dofs_per_elem; B++) {
+        K.add(dofs[A], dofs[B], kappa * Klocal[A * dofs_per_elem + B]);
+      }
+    }
+  }
+
+  /*Unlike FEM::assemble_system, the Dirichlet columns are moved to the right
+    hand side as well, which keeps K symmetric for CG. D keeps the previous
+    temperatures as the initial guess.*/
+  problem.F = load;
+  apply_boundary_values(problem.boundary_values, K, problem.D, problem.F,
+                        true);
+  if (compressed_matrix) {
+    K_compressed.copy_values(K);
+    compressed_preconditioner.initialize(K_compressed, 1.2);
+  } else {
+    preconditioner.initialize(K, 1.2);
+  }
+}
+
+// CG solve of K*x = b starting from the given x; returns the iterations
+template <int dim, typename IndexType>
+unsigned int TopologyOptimization<dim, IndexType>::solve(
+    Vector<double> &x, const Vector<double> &b) {
+  if (b.l2_norm() == 0.) {
+    x = 0.;
+    return 0;
+  }
+  SolverControl solver_control(problem.dof_handler.n_dofs(),
+                               solver_tolerance * b.l2_norm());
+  SolverCG<Vector<double>> solver(solver_control);
+  auto start = std::chrono::steady_clock::now();
+  if (compressed_matrix) {
+    solver.solve(K_compressed, x, b, compressed_preconditioner);
+  } else {
+    solver.solve(problem.K, x, b, preconditioner);
+  }
+  solver_time += std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  total_iterations += solver_control.last_step();
+  return solver_control.last_step();
+}
+
+template <int dim, typename IndexType>
+double TopologyOptimization<dim, IndexType>::iteration_bytes_per_nonzero() const {
+  const double n_rows = problem.K.m();
+  const double n_nonzero = problem.K.n_nonzero_elements();
+  if (n_nonzero == 0.) return 0.;
+  double matrix_bytes;
+  if (compressed_matrix) {
+    matrix_bytes = K_compressed.bytes_per_nonzero() +
+                   K_compressed.SSOR_bytes_per_nonzero();
+  } else {
+    /*SparseMatrix: value and column of every entry plus the row starts, once
+      for vmult and once for the SSOR sweeps (which also read the diagonal
+      three times and PreconditionSSOR's position right of the diagonal)*/
+    const double csr_bytes =
+        sizeof(double) + sizeof(types::global_dof_index) +
+        (n_rows + 1) * sizeof(std::size_t) / n_nonzero;
+    matrix_bytes = 2. * csr_bytes + n_rows *
+                                        (2. * sizeof(double) +
+                                         2. * sizeof(std::size_t)) /
+                                        n_nonzero;
+  }
+  /*SolverCG per iteration, in vectors of n_rows doubles read or written:
+    the product (2), p.v (2), the x and r updates (6), |r| (1), the
+    preconditioner input, output and two sweeps (6), r.g (2) and the new
+    search direction (3)*/
+  const double vector_bytes = 22. * n_rows * sizeof(double) / n_nonzero;
+  return matrix_bytes + vector_bytes;
+}
+
+// Compliance and its sensitivities to the (unfiltered) densities
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::compute_sensitivities() {
+
+  /*c = load.T, and with the adjoint K*Z = load (on the free dofs)
+      dc/dkappa_e = -Z_e.Klocal_e.T_e
+    (Klocal_e here for unit conductivity). The chain rule through the SIMP
+    interpolation gives dc/drho_filtered, and the filter transpose dc/drho.*/
+  const Vector<double> &T = problem.D;
+  const Vector<double> &adjoint = self_adjoint ? T : Z;
+  compliance = load * T;
+
+  Vector<double> dc_filtered(density.size());
+  parallel::apply_to_subranges(
+      std::size_t(0), std::size_t(density.size()),
+      [&](std::size_t first, std::size_t last) {
+        for (std::size_t e = first; e < last; e++) {
+          const IndexType *dofs = &cell_dofs[e * dofs_per_elem];
+          const double *Klocal = &unit_Klocal[e * dofs_per_elem * dofs_per_elem];
+          double ZKT = 0.;
+          for (unsigned int A = 0; A < dofs_per_elem; A++) {
+            for (unsigned int B = 0; B < dofs_per_elem; B++) {
+              ZKT += adjoint[dofs[A]] * Klocal[A * dofs_per_elem + B] * T[dofs[B]];
+            }
+          }
+          double dkappa = solid_conductivity[e] * (1. - void_conductivity) *
+                          penalty * std::pow(filtered_density[e], penalty - 1.);
+          dc_filtered[e] = -dkappa * ZKT;
+        }
+      },
+      4096);
+  apply_filter_transpose(dc_filtered, compliance_sensitivity);
+}
+
+// Optimality criteria update, with bisection for the volume constraint
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::update_density() {
+
+  /*rho_new = rho*sqrt(-dc/drho / (lambda*dV/drho)), limited to the move
+    limit and [0,1], with the Lagrange multiplier lambda found by bisection
+    so the filtered volume is volume_fraction of the total*/
+  const unsigned int n_cells = density.size();
+  const double target_volume = volume_fraction * cell_volume.l1_norm();
+  double largest_ratio = 0.;
+  for (unsigned int e = 0; e < n_cells; e++) {
+    largest_ratio = std::max(largest_ratio, -compliance_sensitivity[e] /
+                                                volume_sensitivity[e]);
+  }
+  double lambda_low = 0., lambda_high = 1.e9 * std::max(largest_ratio, 1.e-300);
+
+  Vector<double> trial(n_cells), trial_filtered(n_cells);
+  while ((lambda_high - lambda_low) / (lambda_high + lambda_low) > 1.e-4) {
+    double lambda = 0.5 * (lambda_low + lambda_high);
+    for (unsigned int e = 0; e < n_cells; e++) {
+      double B = std::max(0., -compliance_sensitivity[e]) /
+                 (lambda * volume_sensitivity[e]);
+      trial[e] = std::min(std::min(1., density[e] + move_limit),
+                          std::max(std::max(0., density[e] - move_limit),
+                                   density[e] * std::sqrt(B)));
+    }
+    apply_filter(trial, trial_filtered);
+    if (trial_filtered * cell_volume > target_volume) {
+      lambda_low = lambda;
+    } else {
+      lambda_high = lambda;
+    }
+  }
+  density = trial;
+}
+
+// Optimization loop
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::run() {
+
+  auto start = std::chrono::steady_clock::now();
+  Vector<double> previous_density(density.size());
+  if (history) history->write_mesh(problem.dof_handler, problem.nodeLocation);
+  for (unsigned int iteration = 1; iteration <= max_iterations; iteration++) {
+    apply_filter(density, filtered_density);
+    assemble_system();
+    solver_iterations = solve(problem.D, problem.F);
+    if (!self_adjoint) {
+      solver_iterations += solve(Z, adjoint_load);
+    }
+    compute_sensitivities();
+
+    previous_density = density;
+    update_density();
+    previous_density -= density;
+    double change = previous_density.linfty_norm();
+
+    std::cout << "   Iteration " << iteration << ": compliance " << compliance
+              << ", volume fraction "
+              << (filtered_density * cell_volume) / cell_volume.l1_norm()
+              << ", change " << change << ", CG iterations "
+              << solver_iterations << std::endl;
+    if (history) {
+      history->add_step(iteration);
+      history->add_field("D", problem.D);
+      history->add_field("density", filtered_density);
+    }
+    if (change < tolerance) break;
+  }
+
+  /*Temperatures of the final design, which is also left in the FEM object as
+    its cell_conductivity (for output_results, compute_heat_flux, ...)*/
+  apply_filter(density, filtered_density);
+  assemble_system();
+  solve(problem.D, problem.F);
+  compliance = load * problem.D;
+  problem.cell_conductivity.reinit(density.size());
+  for (unsigned int e = 0; e < density.size(); e++) {
+    problem.cell_conductivity[e] = design_conductivity(e);
+  }
+  std::cout << "   Final compliance: " << compliance << ", optimization time: "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start)
+                   .count()
+            << " s" << std::endl;
+  if (total_iterations > 0) {
+    const double bytes =
+        iteration_bytes_per_nonzero() * problem.K.n_nonzero_elements();
+    const double iteration_time = solver_time / total_iterations;
+    std::cout << "   CG: " << total_iterations << " iterations, "
+              << 1.e6 * iteration_time << " us and "
+              << iteration_bytes_per_nonzero()
+              << " bytes per nonzero each (matrix, SSOR and vectors), "
+              << bytes / iteration_time / 1.e9 << " GB/s" << std::endl;
+  }
+}
+
+// Write the temperature and the filtered density
+template <int dim, typename IndexType>
+void TopologyOptimization<dim, IndexType>::output_results() {
+
+  std::ostream &output1 = problem.output_writer.open("topology.vtk");
+  DataOut<dim> data_out;
+  data_out.attach_dof_handler(problem.dof_handler);
+  data_out.add_data_vector(problem.D, problem.nodal_solution_names,
+                           DataOut<dim>::type_dof_data,
+                           problem.nodal_data_component_interpretation);
+  data_out.add_data_vector(filtered_density, "density");
+  data_out.build_patches(
+      problem.fe.reference_cell().template get_default_linear_mapping<dim, dim>());
+  data_out.write_vtk(output1);
+  problem.output_writer.finish();
+}
+
+#endif